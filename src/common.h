@@ -8,9 +8,16 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// uncomment these to dump the compiled bytecode and trace every instruction, they
+// are far too noisy (and slow) to leave on for real scripts
+//#define DEBUG_PRINT_CODE
+//#define DEBUG_TRACE_EXECUTION
+// and this one to see how often each loop ran once a script finishes
+//#define DEBUG_LOOP_HOTNESS
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+// the largest operand the _LONG opcodes can hold
+#define UINT24_MAX ((1 << 24) - 1)
 
 #endif
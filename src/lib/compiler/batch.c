@@ -0,0 +1,78 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "batch.h"
+#include "cache.h"
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+#include "object.h"
+#include "source.h"
+
+typedef struct {
+    const char** paths;
+    int count;
+    // the index of the next script nobody has picked up yet
+    atomic_int next;
+    atomic_bool failed;
+} Batch;
+
+static bool compileFile(Heap* heap, const char* path) {
+    Source source;
+    if (!openSourceFile(&source, path)) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+    // the function and everything in it is freed along with the rest of the heap
+    ObjFunction* script = compileSource(heap, &source, path);
+    if (script != NULL) writeBytecodeCache(path, &source, script);
+    closeSource(&source);
+    return script != NULL;
+}
+
+static void* worker(void* argument) {
+    Batch* batch = (Batch*)argument;
+    // strings only need interning within a script, so each thread gets a heap of its
+    // own and empties it after every script rather than letting it grow
+    Heap heap;
+    initHeap(&heap);
+    for (;;) {
+        int index = atomic_fetch_add(&batch->next, 1);
+        if (index >= batch->count) break;
+        if (!compileFile(&heap, batch->paths[index])) {
+            atomic_store(&batch->failed, true);
+        }
+        freeHeap(&heap);
+        initHeap(&heap);
+    }
+    freeHeap(&heap);
+    return NULL;
+}
+
+bool compileFiles(const char** paths, int count, int jobs) {
+    Batch batch;
+    batch.paths = paths;
+    batch.count = count;
+    atomic_init(&batch.next, 0);
+    atomic_init(&batch.failed, false);
+
+    // no point starting threads that would find nothing to do
+    if (jobs > count) jobs = count;
+    if (jobs < 1) jobs = 1;
+
+    // the calling thread does its share too, so we only start jobs - 1 more
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * (size_t)jobs);
+    int started = 0;
+    for (int i = 1; i < jobs; i++) {
+        if (pthread_create(&threads[started], NULL, worker, &batch) != 0) break;
+        started++;
+    }
+    worker(&batch);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return !atomic_load(&batch.failed);
+}
@@ -0,0 +1,12 @@
+#ifndef clox_batch_h
+#define clox_batch_h
+
+#include "common.h"
+
+// Compiles every script in paths and writes its bytecode cache, without running any of
+// them. Scripts are handed out to jobs threads as they free up, each thread keeping
+// its own heap so they never have to wait on one another. Returns true if every
+// script compiled
+bool compileFiles(const char** paths, int count, int jobs);
+
+#endif
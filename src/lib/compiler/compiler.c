@@ -8,18 +8,16 @@
 #include "common.h"
 #include "value.h"
 #include "compiler.h"
+#include "jit.h"
+#include "memory.h"
+#include "number.h"
+#include "table.h"
+#include "threaded.h"
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 #include "scanner.h"
 
-typedef struct {
-    Token current;
-    Token previous;
-    bool hadError;
-    bool panicMode;
-} Parser;
-
 // all of lox's precedence levels in order of lowest to highest, C
 // implictly numbers them in ascending order when instantiated in an enum
 typedef enum {
@@ -36,70 +34,147 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-// a simple typedef for a function type that takes no args and returns nothing
-typedef void (*ParseFn)(bool canAssign);
-
-// this represents a single row in the rules table
-typedef struct {
-    ParseFn prefix;
-    ParseFn infix;
-    Precedence precedence;
-} ParseRule;
+// What the compiler can prove about a value before the script runs. The only thing
+// we use it for so far is spotting arithmetic on values that are certainly numbers,
+// which can then skip the VM's type checks
+typedef enum {
+    TYPE_UNKNOWN,
+    TYPE_NUMBER,
+    TYPE_STRING,
+    TYPE_BOOL,
+    TYPE_NIL,
+} StaticType;
+
+// We only track types for the first 64 local slots, so that what an expression's type
+// relies on fits in one bit per local. Locals past these are always TYPE_UNKNOWN
+#define TYPED_LOCALS 64
+#define LOCAL_BIT(slot) ((uint64_t)1 << (slot))
 
 typedef struct {
   Token name;
   int depth;
+  // the type of every value the local has been given so far, and the other locals
+  // that type relies on
+  StaticType type;
+  uint64_t depends;
 } Local;
 
+// An unchecked instruction we emitted because of the types of the locals in depends.
+// If any of them is later assigned something else, we put the checked one back
 typedef struct {
-  Local locals[UINT8_COUNT];
+  int offset;
+  uint8_t checked;
+  uint64_t depends;
+} UncheckedOp;
+
+// how many locals can be in scope at once, slots past 255 use the _LONG opcodes
+#define LOCALS_MAX UINT16_COUNT
+
+// the top level of a script is compiled just like the body of a function
+typedef enum {
+  TYPE_FUNCTION,
+  TYPE_SCRIPT,
+} FunctionType;
+
+// There's one of these for each function being compiled, a function declared inside
+// another gets a new one that points back at the one it's nested in
+typedef struct Compiler {
+  struct Compiler* enclosing;
+  ObjFunction* function;
+  FunctionType type;
+  // grows as needed, most scripts never have more than a handful of locals
+  Local* locals;
+  int localCapacity;
   int localCount;
   int scopeDepth;
+  UncheckedOp* unchecked;
+  int uncheckedCount;
+  int uncheckedCapacity;
+  // how many stack slots the function is using at the point we're compiling, the
+  // deepest this ever gets becomes the function's maxSlots
+  int stackDepth;
+  // Maps each string already in the function's constant pool to its index, so every
+  // use of the same identifier or string literal shares one constant (and one operand
+  // byte for longer before we have to go wide). The REPL keeps the script's going
+  // across entries, every other function points this at its own ownStrings
+  Table* stringConstants;
+  Table ownStrings;
 } Compiler;
 
-Parser parser;
-Compiler* current = NULL;
-Chunk* compilingChunk;
+// Everything a single compilation needs. None of the compiler's state lives in
+// globals, every function is handed the parser, so any number of threads can each
+// compile their own script at the same time
+typedef struct {
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool hadError;
+    bool panicMode;
+    // the innermost function being compiled
+    Compiler* compiler;
+    // where string constants are interned
+    Heap* heap;
+    // when set, errors are prefixed with it so we know which script they came from
+    const char* name;
+    // the static type of the expression we just compiled, and the locals it relies on
+    StaticType type;
+    uint64_t depends;
+} Parser;
+
+// a simple typedef for a function type that takes the parser and returns nothing
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
+
+// this represents a single row in the rules table
+typedef struct {
+    ParseFn prefix;
+    ParseFn infix;
+    Precedence precedence;
+} ParseRule;
 
 // forward declarations because why not
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
-//static Chunk* currentChunk();
-//static void errorAt(Token* token, const char* message);
-//static void error(const char* message);
-//static void errorAtCurrent(const char* message);
-//static void advance();
-//static void consume(TokenType type, const char* message);
-//static void emitByte(uint8_t byte);
-//static void emitBytes(uint8_t byte1, uint8_t byte2);
-//static void emitReturn();
-//static void endCompiler();
+static void parsePrecedence(Parser* parser, Precedence precedence);
+//static Chunk* currentChunk(Parser* parser);
+//static void errorAt(Parser* parser, Token* token, const char* message);
+//static void error(Parser* parser, const char* message);
+//static void errorAtCurrent(Parser* parser, const char* message);
+//static void advance(Parser* parser);
+//static void consume(Parser* parser, TokenType type, const char* message);
+//static void emitByte(Parser* parser, uint8_t byte);
+//static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2);
+//static void emitReturn(Parser* parser);
+//static void endCompiler(Parser* parser);
 //static ParseRule* getRule(TokenType type);
-//static void binary();
-//static void expression();
-//static void grouping();
-//static uint8_t makeConstant(Value value);
-//static void emitConstant(Value value);
-//static void number();
-//static void unary();
-
-static Chunk* currentChunk() {
-    return compilingChunk;
+//static void binary(Parser* parser);
+//static void expression(Parser* parser);
+//static void grouping(Parser* parser);
+//static uint8_t makeConstant(Parser* parser, Value value);
+//static void emitConstant(Parser* parser, Value value);
+//static void number(Parser* parser);
+//static void unary(Parser* parser);
+
+// code always goes into the function we're in the middle of compiling
+static Chunk* currentChunk(Parser* parser) {
+    return &parser->compiler->function->chunk;
 }
 
 // this error function is the workhorse of the error handling
-static void errorAt(Token* token, const char* message) {
+static void errorAt(Parser* parser, Token* token, const char* message) {
     // INFO: the reason we set this is because if panic mode is already set,
     // we wont print out any more errors. Otherwise we could have a huge list of
     // errors from the rest of the source code but not be able to see where the
     // panic mode occured
-    if (parser.panicMode) return;
+    if (parser->panicMode) return;
     // set the parser to panic mode
-    parser.panicMode = true;
-    // print the line the error occured on
+    parser->panicMode = true;
+    // other threads may be compiling too, holding the lock keeps the pieces of our
+    // message together on one line
+    flockfile(stderr);
+    // say which script it was if we know, then the line the error occured on
+    if (parser->name != NULL) fprintf(stderr, "%s: ", parser->name);
     fprintf(stderr, "[line %d] Error", token->line);
 
     // check if the type is EOF
@@ -114,144 +189,341 @@ static void errorAt(Token* token, const char* message) {
 
     // print the error message
     fprintf(stderr, ": %s\n", message);
+    funlockfile(stderr);
     // set the hadError flag to true to indicate a parsing error
-    parser.hadError = true;
+    parser->hadError = true;
 }
 
 // more commonly the error occurs at the token we just consumed, so this
 // function handles that case
-static void error(const char* message) {
-  errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+  errorAt(parser, &parser->previous, message);
 }
 
 // if the scanner returns an error then we should actually tell the user
-static void errorAtCurrent(const char* message) {
-  errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+  errorAt(parser, &parser->current, message);
 }
 
 // this funciton steps though the token stream
-static void advance() {
+static void advance(Parser* parser) {
     // we store the current token for later use
-    parser.previous = parser.current;
+    parser->previous = parser->current;
 
     for (;;) {
         // uses the scanner to get the current token
-        parser.current = scanToken();
+        parser->current = scanToken(&parser->scanner);
         // if its an error then break out of the loop
-        if (parser.current.type != TOKEN_ERROR) break;
+        if (parser->current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
 // turns a value into a constant and adds it to the chunks constant array
-static uint8_t makeConstant(Value value) {
-    printf("MAKE CONST\n");
+static int makeConstant(Parser* parser, Value value) {
+    // strings are interned, so the same string always gives us the same key
+    Value existing;
+    Table* stringConstants = parser->compiler->stringConstants;
+    if (IS_STRING(value) && tableGet(stringConstants, AS_STRING(value), &existing)) {
+        return (int)AS_INT(existing);
+    }
     // add the value to the current chunks data region and return its index
-    int constant = addConstant(currentChunk(), value);
-    // check for error
-    if (constant > UINT8_MAX) {
-        error("Too many constants in one chunk");
+    int constant = addConstant(currentChunk(parser), value);
+    // check for error, anything up to 3 bytes can be addressed by the _LONG opcodes
+    if (constant > UINT24_MAX) {
+        error(parser, "Too many constants in one chunk");
         return 0;
     }
-    printf("CONST: %d\n", constant);
+    if (IS_STRING(value)) {
+        tableSet(stringConstants, AS_STRING(value), INT_VAL(constant));
+    }
 
-    // return that constant cast to a byte
-    return (uint8_t)constant;
+    return constant;
 }
 // similar to advance in that it reads the next token, but it also validates that
 // the token has the correct type
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
     // if the type isnt correct, return an error
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+    return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-    if (!check(type)) return false;
-    advance();
+static bool match(Parser* parser, TokenType type) {
+    if (!check(parser, type)) return false;
+    advance(parser);
     return true;
 }
 
 // we start by appending a byte to a chunk, it may be an opcode or an operand,
 // and sends the previous tokens line information so any errors are associated
 // with that line
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(currentChunk(parser), byte, parser->previous.line);
+}
+
+// How many values each instruction leaves on the stack, less how many it takes off.
+// A call's arguments and an array's elements are accounted for where they're emitted, and the instructions the VM
+// rewrites for itself never come out of the compiler
+static const int8_t stackEffects[] = {
+    [OP_CONSTANT] = 1,           [OP_CONSTANT_LONG] = 1,
+    [OP_NIL] = 1,                [OP_TRUE] = 1,
+    [OP_FALSE] = 1,              [OP_POP] = -1,
+    [OP_GET_LOCAL] = 1,          [OP_GET_LOCAL_LONG] = 1,
+    [OP_SET_LOCAL] = 0,          [OP_SET_LOCAL_LONG] = 0,
+    [OP_SET_GLOBAL] = 0,         [OP_SET_GLOBAL_LONG] = 0,
+    [OP_GET_GLOBAL] = 1,         [OP_GET_GLOBAL_LONG] = 1,
+    [OP_DEFINE_GLOBAL] = -1,     [OP_DEFINE_GLOBAL_LONG] = -1,
+    [OP_EQUAL] = -1,             [OP_GREATER] = -1,
+    [OP_LESS] = -1,              [OP_ADD] = -1,
+    [OP_SUBTRACT] = -1,          [OP_MULTIPLY] = -1,
+    [OP_DIVIDE] = -1,            [OP_NOT] = 0,
+    [OP_NEGATE] = 0,             [OP_PRINT] = -1,
+    [OP_JUMP] = 0,               [OP_JUMP_IF_FALSE] = 0,
+    [OP_JUMP_BACK] = 0,          [OP_LOOP] = 0,
+    [OP_CALL] = 0,               [OP_RETURN] = -1,
+    [OP_ARRAY] = 1,              [OP_GET_INDEX] = -1,
+    [OP_SET_INDEX] = -2,
+    [OP_ADD_NUMBERS] = -1,       [OP_SUBTRACT_NUMBERS] = -1,
+    [OP_MULTIPLY_NUMBERS] = -1,  [OP_DIVIDE_NUMBERS] = -1,
+    [OP_GREATER_NUMBERS] = -1,   [OP_LESS_NUMBERS] = -1,
+    [OP_NEGATE_NUMBER] = 0,
+};
+
+// Keeps count of how deep the stack is at this point in the function. The VM checks
+// a call has room for the deepest it ever gets once, when the call is made, so nothing
+// that pushes inside the function has to check
+static void adjustStack(Parser* parser, int delta) {
+    Compiler* compiler = parser->compiler;
+    compiler->stackDepth += delta;
+    if (compiler->stackDepth > compiler->function->maxSlots) {
+        compiler->function->maxSlots = compiler->stackDepth;
+    }
+}
+
+// every opcode goes through here so the stack depth is kept up to date, operands are
+// written with plain emitByte
+static void emitOp(Parser* parser, uint8_t op) {
+    emitByte(parser, op);
+    adjustStack(parser, stackEffects[op]);
 }
 
 // just makes our life easier by allowing us to emit a opcode and an operand
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitOp(parser, byte1);
+    emitByte(parser, byte2);
+}
+
+// emits an instruction that takes a constant index or local slot, using the one byte
+// form whenever the operand fits and the long form otherwise
+static void emitOperand(Parser* parser, uint8_t op, uint8_t longOp, int operand) {
+    if (operand <= UINT8_MAX) {
+        emitBytes(parser, op, (uint8_t)operand);
+    } else {
+        emitOp(parser, longOp);
+        emitByte(parser, (operand >> 16) & 0xFF);
+        emitByte(parser, (operand >> 8) & 0xFF);
+        emitByte(parser, operand & 0xFF);
+    }
+}
+
+// Emits a jump with a placeholder offset and returns where the offset is, we don't
+// know how far to jump until we've compiled the code being jumped over
+static int emitJump(Parser* parser, uint8_t instruction) {
+    emitOp(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
+}
+
+// goes back and fills in the offset of the jump at offset to land on the next
+// instruction we emit
+static void patchJump(Parser* parser, int offset) {
+    // -2 to adjust for the bytecode for the jump offset itself
+    int jump = currentChunk(parser)->count - offset - 2;
+    if (jump > UINT16_MAX) {
+        error(parser, "Too much code to jump over.");
+    }
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
+}
+
+// Jumps back to loopStart, counted jumps are the back edges of loops, the VM bumps
+// the chunk's counter for the loop every time one is taken so it can tell which
+// loops are worth optimising. The loop index comes from addLoop
+static void emitLoop(Parser* parser, int loopStart, bool counted, int loop) {
+    emitOp(parser, counted ? OP_LOOP : OP_JUMP_BACK);
+
+    // + 2 for the offset bytes themselves, and + 2 more for the loop index
+    int offset = currentChunk(parser)->count - loopStart + (counted ? 4 : 2);
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
+
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
+    if (counted) {
+        emitByte(parser, (loop >> 8) & 0xff);
+        emitByte(parser, loop & 0xff);
+    }
+}
+
+// gives the loop about to be compiled a counter of its own
+static int beginLoop(Parser* parser) {
+    int loop = addLoop(currentChunk(parser));
+    if (loop > UINT16_MAX) error(parser, "Too many loops in one chunk.");
+    return loop;
 }
 
-static void emitReturn() {
-    emitByte(OP_RETURN);
+static void setType(Parser* parser, StaticType type, uint64_t depends) {
+    parser->type = type;
+    parser->depends = depends;
 }
 
-// to wrap things up and print a single expression at this stage we add a return
-// opcode to the final byte in the chunk
-static void endCompiler() {
-    emitReturn();
+// Emits unchecked if safe says the operands are certainly numbers, otherwise checked.
+// An unchecked instruction that relies on the types of some locals is remembered so it
+// can be put back if we find out later that one of them can hold something else
+static void emitTyped(Parser* parser, uint8_t checked, uint8_t unchecked, bool safe,
+                      uint64_t depends) {
+    if (!safe) {
+        emitOp(parser, checked);
+        return;
+    }
+    emitOp(parser, unchecked);
+    if (depends == 0) return;
+
+    Compiler* compiler = parser->compiler;
+    if (compiler->uncheckedCapacity < compiler->uncheckedCount + 1) {
+        int oldCapacity = compiler->uncheckedCapacity;
+        compiler->uncheckedCapacity = GROW_CAPACITY(oldCapacity);
+        compiler->unchecked = GROW_ARRAY(UncheckedOp, compiler->unchecked, oldCapacity,
+                                         compiler->uncheckedCapacity);
+    }
+    UncheckedOp* op = &compiler->unchecked[compiler->uncheckedCount++];
+    op->offset = currentChunk(parser)->count - 1;
+    op->checked = checked;
+    op->depends = depends;
+}
+
+// The local in slot turned out to hold more than one type of value. Everything we
+// compiled assuming otherwise goes back to the checked instructions, which includes
+// anything relying on other locals whose types came from this one
+static void demoteLocal(Parser* parser, int slot) {
+    Compiler* compiler = parser->compiler;
+    compiler->locals[slot].type = TYPE_UNKNOWN;
+    compiler->locals[slot].depends = 0;
+
+    uint64_t bit = LOCAL_BIT(slot);
+    for (int i = 0; i < compiler->uncheckedCount; i++) {
+        UncheckedOp* op = &compiler->unchecked[i];
+        if ((op->depends & bit) == 0) continue;
+        currentChunk(parser)->code[op->offset] = op->checked;
+        // it's checked now, nothing more can happen to it
+        *op = compiler->unchecked[--compiler->uncheckedCount];
+        i--;
+    }
+    for (int i = 0; i < compiler->localCount && i < TYPED_LOCALS; i++) {
+        Local* local = &compiler->locals[i];
+        if (local->type != TYPE_UNKNOWN && (local->depends & bit) != 0) {
+            demoteLocal(parser, i);
+        }
+    }
+}
+
+// the value of an expression with the given type is being stored in the local in slot
+static void assignLocal(Parser* parser, int slot, StaticType type, uint64_t depends) {
+    if (slot >= TYPED_LOCALS) return;
+    Local* local = &parser->compiler->locals[slot];
+    if (local->type == TYPE_UNKNOWN) return;
+    if (local->type != type) {
+        demoteLocal(parser, slot);
+        return;
+    }
+    local->depends |= depends & ~LOCAL_BIT(slot);
+}
+
+// a function that runs off its end returns nil
+static void emitReturn(Parser* parser) {
+    emitOp(parser, OP_NIL);
+    emitOp(parser, OP_RETURN);
+}
+
+// wraps up the function we were compiling and hands it back, compiling carries on in
+// the function it was nested in
+static ObjFunction* endCompiler(Parser* parser) {
+    emitReturn(parser);
+    Compiler* compiler = parser->compiler;
+    ObjFunction* function = compiler->function;
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-        disassembleChunk(currentChunk(), "code");
+    if (!parser->hadError) {
+        disassembleChunk(currentChunk(parser),
+                         function->name != NULL ? function->name->chars : "<script>");
     }
 #endif
+    FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+    FREE_ARRAY(UncheckedOp, compiler->unchecked, compiler->uncheckedCapacity);
+    freeTable(&compiler->ownStrings);
+    parser->compiler = compiler->enclosing;
+    return function;
 }
 
 
 // this function starts at the current token and parses any expression at the given
 // precedence level or higher
-static void parsePrecedence(Precedence precedence) {
+static void parsePrecedence(Parser* parser, Precedence precedence) {
     // first we read the next token
-    advance();
+    advance(parser);
     // then look up the corresponding parse rule
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+    ParseFn prefixRule = getRule(parser->previous.type)->prefix;
     // if there is no parse rule then there must be a syntax error so we report that and
     // return to the caller
     if (prefixRule == NULL) {
-        error("Expect expression");
+        error(parser, "Expect expression");
         return;
     }
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    // anything that doesn't work out its type is unknown
+    setType(parser, TYPE_UNKNOWN, 0);
     // otherwise we call that prefix parse function and let it do its thing
-    prefixRule(canAssign);
+    prefixRule(parser, canAssign);
 
     // now we look up an infix parser for the next token, and if we find one it means that
     // the prefix expression we already compiled may be an operand for it.
     // But only if the precedence is low enough to permit this infix operation
     // if the precedence is too low, or isnt an infix operator at all, were done and we
     // have parsed all we need to.
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infixRule = getRule(parser->previous.type)->infix;
+        infixRule(parser, canAssign);
     }
-    if (canAssign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start,
+static int identifierConstant(Parser* parser, Token* name) {
+  return makeConstant(parser, OBJ_VAL(copyString(parser->heap, name->start,
                                          name->length)));
 }
 
-static void addLocal(Token name) {
-    if (current->localCount == UINT8_COUNT) {
-        error("Too many local variables in function.");
+static void addLocal(Parser* parser, Token name) {
+    if (parser->compiler->localCount == LOCALS_MAX) {
+        error(parser, "Too many local variables in function.");
         return;
-      }
-  Local* local = &current->locals[current->localCount++];
+    }
+    if (parser->compiler->localCapacity < parser->compiler->localCount + 1) {
+        int oldCapacity = parser->compiler->localCapacity;
+        parser->compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+        parser->compiler->locals = GROW_ARRAY(Local, parser->compiler->locals, oldCapacity,
+                                     parser->compiler->localCapacity);
+    }
+  Local* local = &parser->compiler->locals[parser->compiler->localCount++];
   local->name = name;
   local->depth = -1;
 }
@@ -261,95 +533,153 @@ static bool identifiersEqual(Token* a, Token* b) {
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static void declareVariable() {
-  if (current->scopeDepth == 0) return;
+static void declareVariable(Parser* parser) {
+  if (parser->compiler->scopeDepth == 0) return;
 
-  Token* name = &parser.previous;
-  for (int i = current->localCount - 1; i >= 0; i--) {
-      Local* local = &current->locals[i];
-      if (local->depth != -1 && local->depth < current->scopeDepth) {
+  Token* name = &parser->previous;
+  for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+      Local* local = &parser->compiler->locals[i];
+      if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
         break;
       }
 
       if (identifiersEqual(name, &local->name)) {
-        error("Already a variable with this name in this scope.");
+        error(parser, "Already a variable with this name in this scope.");
       }
     }
-  addLocal(*name);
+  addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
-  declareVariable();
-  if (current->scopeDepth > 0) return 0;
-  return identifierConstant(&parser.previous);
+static int parseVariable(Parser* parser, const char* errorMessage) {
+  consume(parser, TOKEN_IDENTIFIER, errorMessage);
+  declareVariable(parser);
+  if (parser->compiler->scopeDepth > 0) return 0;
+  return identifierConstant(parser, &parser->previous);
 }
 
 // when this is called the entire first operand and operator will have already been consumed
 // eg. 1 + 2 (1 + ) will have been consumed.
 // so the compiler will add 1 onto the stack, then 2, then the plus operator
-static void binary(bool canAssign) {
+static void binary(Parser* parser, bool canAssign) {
     // therefore the operator is the previous token
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
     // this is where the precedence takes place, when we parse the right hand operand
     // eg. 2 * 3 + 4 (right hand operand is 3 in this case), we dont need to capture
     // 3 + 4 becasue it is a lower precedence
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    StaticType leftType = parser->type;
+    uint64_t leftDepends = parser->depends;
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+    StaticType rightType = parser->type;
+    uint64_t depends = leftDepends | parser->depends;
+    // when both sides are certainly numbers the VM doesn't need to check them
+    bool numbers = leftType == TYPE_NUMBER && rightType == TYPE_NUMBER;
 
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER: emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS: emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS: emitByte(OP_ADD); break;
-        case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:
+            emitOp(parser, OP_EQUAL);
+            emitOp(parser, OP_NOT);
+            break;
+        case TOKEN_EQUAL_EQUAL: emitOp(parser, OP_EQUAL); break;
+        case TOKEN_GREATER:
+            emitTyped(parser, OP_GREATER, OP_GREATER_NUMBERS, numbers, depends);
+            break;
+        case TOKEN_GREATER_EQUAL:
+            emitTyped(parser, OP_LESS, OP_LESS_NUMBERS, numbers, depends);
+            emitOp(parser, OP_NOT);
+            break;
+        case TOKEN_LESS:
+            emitTyped(parser, OP_LESS, OP_LESS_NUMBERS, numbers, depends);
+            break;
+        case TOKEN_LESS_EQUAL:
+            emitTyped(parser, OP_GREATER, OP_GREATER_NUMBERS, numbers, depends);
+            emitOp(parser, OP_NOT);
+            break;
+        case TOKEN_PLUS:
+            emitTyped(parser, OP_ADD, OP_ADD_NUMBERS, numbers, depends);
+            // If either side is a number so is the result, the add fails otherwise, and
+            // likewise for strings. Which one it is relies on what the operands are
+            if (leftType == TYPE_NUMBER || rightType == TYPE_NUMBER) {
+                setType(parser, TYPE_NUMBER, depends);
+            } else if (leftType == TYPE_STRING || rightType == TYPE_STRING) {
+                setType(parser, TYPE_STRING, depends);
+            } else {
+                setType(parser, TYPE_UNKNOWN, 0);
+            }
+            return;
+        case TOKEN_MINUS:
+            emitTyped(parser, OP_SUBTRACT, OP_SUBTRACT_NUMBERS, numbers, depends);
+            // these can only ever give a number, whatever they're given
+            setType(parser, TYPE_NUMBER, 0);
+            return;
+        case TOKEN_STAR:
+            emitTyped(parser, OP_MULTIPLY, OP_MULTIPLY_NUMBERS, numbers, depends);
+            setType(parser, TYPE_NUMBER, 0);
+            return;
+        case TOKEN_SLASH:
+            emitTyped(parser, OP_DIVIDE, OP_DIVIDE_NUMBERS, numbers, depends);
+            setType(parser, TYPE_NUMBER, 0);
+            return;
         default: return; //unreachable
     }
+    // all that's left are comparisons
+    setType(parser, TYPE_BOOL, 0);
 }
 
-static void literal(bool canAssign) {
-    switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+static void literal(Parser* parser, bool canAssign) {
+    switch (parser->previous.type) {
+        case TOKEN_FALSE: emitOp(parser, OP_FALSE); break;
+        case TOKEN_NIL:
+            emitOp(parser, OP_NIL);
+            setType(parser, TYPE_NIL, 0);
+            return;
+        case TOKEN_TRUE: emitOp(parser, OP_TRUE); break;
         default: return; //unreachable
     }
+    setType(parser, TYPE_BOOL, 0);
 }
 
-static void expression() {
+static void expression(Parser* parser) {
     // say we had '-a.b + c' as our expression
     // when we call this function, it will parse the entire expression because
     // + has a higher precendence than assignment. If we were to call it with
     // PREC_UNARY then it would only compile '-a.b' and stop there because addition
     // has lower precedence than unary operators
-    parsePrecedence(PREC_ASSIGNMENT);
+    parsePrecedence(parser, PREC_ASSIGNMENT);
+}
+
+static void expressionStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression");
+    emitOp(parser, OP_POP);
 }
 
-static void expressionStatement() {
-    printf("EXPRESSION STATEMENT\n");
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression");
-    emitByte(OP_POP);
+static void printStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+    emitOp(parser, OP_PRINT);
 }
 
-static void printStatement() {
-    printf("PRINT STATEMENT\n");
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+static void returnStatement(Parser* parser) {
+    if (parser->compiler->type == TYPE_SCRIPT) {
+        error(parser, "Can't return from top-level code.");
+    }
+
+    if (match(parser, TOKEN_SEMICOLON)) {
+        emitReturn(parser);
+    } else {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+        emitOp(parser, OP_RETURN);
+    }
 }
 
-static void synchronize() {
-    parser.panicMode = false;
+static void synchronize(Parser* parser) {
+    parser->panicMode = false;
 
-      while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-        switch (parser.current.type) {
+      while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+        switch (parser->current.type) {
           case TOKEN_CLASS:
           case TOKEN_FUN:
           case TOKEN_VAR:
@@ -364,125 +694,427 @@ static void synchronize() {
             ; // Do nothing.
         }
 
-        advance();
+        advance(parser);
       }
 }
 
-static void markInitialized() {
-  current->locals[current->localCount - 1].depth =
-      current->scopeDepth;
+static void markInitialized(Parser* parser) {
+  if (parser->compiler->scopeDepth == 0) return;
+  int slot = parser->compiler->localCount - 1;
+  Local* local = &parser->compiler->locals[slot];
+  local->depth = parser->compiler->scopeDepth;
+  // the local starts out with the type of its initializer
+  if (slot < TYPED_LOCALS) {
+    local->type = parser->type;
+    local->depends = parser->depends;
+  }
 }
 
-static void defineVariable(uint8_t global) {
-    if (current->scopeDepth > 0) {
-        markInitialized();
+static void defineVariable(Parser* parser, int global) {
+    if (parser->compiler->scopeDepth > 0) {
+        markInitialized(parser);
         return;
     }
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitOperand(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
-static void varDeclaration() {
-    printf("VAR_DEC\n");
-  uint8_t global = parseVariable("Expect variable name.");
-
-  printf("VAR_PARSED: %d\n", global);
-
+static void varDeclaration(Parser* parser) {
+  int global = parseVariable(parser, "Expect variable name.");
 
-  if (match(TOKEN_EQUAL)) {
-    expression();
+  if (match(parser, TOKEN_EQUAL)) {
+    expression(parser);
   } else {
-    emitByte(OP_NIL);
+    emitOp(parser, OP_NIL);
+    setType(parser, TYPE_NIL, 0);
   }
-  printf("PASSED\n");
-  consume(TOKEN_SEMICOLON,
+  consume(parser, TOKEN_SEMICOLON,
           "Expect ';' after variable declaration.");
 
-  defineVariable(global);
+  defineVariable(parser, global);
 }
 
-static void declaration() {
-    if (match(TOKEN_VAR)) {
-        varDeclaration();
+static void block(Parser* parser);
+static void beginScope(Parser* parser);
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type,
+                         ObjFunction* function);
+
+// compiles a function's parameters and body, and leaves the finished function on the
+// stack as a constant
+static void function(Parser* parser, FunctionType type) {
+    Compiler compiler;
+    initCompiler(parser, &compiler, type, NULL);
+    // the parameters are locals in the function's outermost scope, there's no
+    // endScope to pop them, returning throws away the whole frame
+    beginScope(parser);
+
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            parser->compiler->function->arity++;
+            if (parser->compiler->function->arity > 255) {
+                errorAtCurrent(parser, "Can't have more than 255 parameters.");
+            }
+            int constant = parseVariable(parser, "Expect parameter name.");
+            // the caller already put the argument in its slot, and it could be anything
+            adjustStack(parser, 1);
+            setType(parser, TYPE_UNKNOWN, 0);
+            defineVariable(parser, constant);
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block(parser);
+
+    ObjFunction* compiled = endCompiler(parser);
+    emitOperand(parser, OP_CONSTANT, OP_CONSTANT_LONG,
+                makeConstant(parser, OBJ_VAL(compiled)));
+    setType(parser, TYPE_UNKNOWN, 0);
+}
+
+static void funDeclaration(Parser* parser) {
+    int global = parseVariable(parser, "Expect function name.");
+    // a local function can refer to itself before its body is done, so it can recurse
+    setType(parser, TYPE_UNKNOWN, 0);
+    markInitialized(parser);
+    function(parser, TYPE_FUNCTION);
+    defineVariable(parser, global);
+}
+
+static void declaration(Parser* parser) {
+    if (match(parser, TOKEN_FUN)) {
+        funDeclaration(parser);
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        statement();
+        statement(parser);
     }
-    if (parser.panicMode) synchronize();
+    if (parser->panicMode) synchronize(parser);
 }
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-       declaration();
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+       declaration(parser);
      }
 
-     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+     consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void beginScope() {
-  current->scopeDepth++;
+static void beginScope(Parser* parser) {
+  parser->compiler->scopeDepth++;
 }
 
-static void endScope() {
-  current->scopeDepth--;
-  while (current->localCount > 0 &&
-          current->locals[current->localCount - 1].depth >
-             current->scopeDepth) {
-     emitByte(OP_POP);
-     current->localCount--;
+static void endScope(Parser* parser) {
+  Compiler* compiler = parser->compiler;
+  compiler->scopeDepth--;
+  uint64_t dead = 0;
+  while (compiler->localCount > 0 &&
+          compiler->locals[compiler->localCount - 1].depth >
+             compiler->scopeDepth) {
+     emitOp(parser, OP_POP);
+     compiler->localCount--;
+     if (compiler->localCount < TYPED_LOCALS) dead |= LOCAL_BIT(compiler->localCount);
    }
+
+  // Nothing can be assigned to these locals any more, so their types are settled. An
+  // unchecked instruction that only relied on them stays unchecked for good, and a
+  // new local reusing one of their slots starts with a clean slate
+  for (int i = 0; i < compiler->uncheckedCount; i++) {
+    compiler->unchecked[i].depends &= ~dead;
+    if (compiler->unchecked[i].depends == 0) {
+      compiler->unchecked[i--] = compiler->unchecked[--compiler->uncheckedCount];
+    }
+  }
+  for (int i = 0; i < compiler->localCount && i < TYPED_LOCALS; i++) {
+    compiler->locals[i].depends &= ~dead;
+  }
+}
+
+static void ifStatement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    // the condition is left on the stack, so both branches start by popping it
+    int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitOp(parser, OP_POP);
+    statement(parser);
+
+    int elseJump = emitJump(parser, OP_JUMP);
+    patchJump(parser, thenJump);
+    // we got here by jumping, so the condition we already counted as popped is back
+    adjustStack(parser, 1);
+    emitOp(parser, OP_POP);
+
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patchJump(parser, elseJump);
 }
 
-static void statement() {
-    printf("Statement\n");
-    if (match(TOKEN_PRINT)) {
-        printStatement();
-    } else if (match(TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
+static void whileStatement(Parser* parser) {
+    int loop = beginLoop(parser);
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitOp(parser, OP_POP);
+    statement(parser);
+    emitLoop(parser, loopStart, true, loop);
+
+    patchJump(parser, exitJump);
+    adjustStack(parser, 1);
+    emitOp(parser, OP_POP);
+}
 
+static void forStatement(Parser* parser) {
+    // a variable declared in the initializer only lives as long as the loop
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMICOLON)) {
+        // No initializer.
+    } else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     } else {
-        expressionStatement();
+        expressionStatement(parser);
+    }
+
+    int loop = beginLoop(parser);
+    int loopStart = currentChunk(parser)->count;
+    int exitJump = -1;
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+        // jump out of the loop if the condition is false
+        exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+        emitOp(parser, OP_POP);
     }
+
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        // The increment comes before the body in the source but runs after it, so we
+        // jump over it to the body, and the body loops back to it rather than to the
+        // condition. The body's jump is the one we count, the increment's jump back to
+        // the condition happens just as often so counting it too would tell us nothing
+        int bodyJump = emitJump(parser, OP_JUMP);
+        int incrementStart = currentChunk(parser)->count;
+        expression(parser);
+        emitOp(parser, OP_POP);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+        emitLoop(parser, loopStart, false, 0);
+        loopStart = incrementStart;
+        patchJump(parser, bodyJump);
+    }
+
+    statement(parser);
+    emitLoop(parser, loopStart, true, loop);
+
+    if (exitJump != -1) {
+        patchJump(parser, exitJump);
+        // the condition
+        adjustStack(parser, 1);
+        emitOp(parser, OP_POP);
+    }
+    endScope(parser);
 }
 
-static void grouping(bool canAssign) {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);
+    } else if (match(parser, TOKEN_RETURN)) {
+        returnStatement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
+
+    } else {
+        expressionStatement(parser);
+    }
 }
 
+// the result of and/or is one of its operands, so we only know its type if both have
+// the same one
+static void joinTypes(Parser* parser, StaticType leftType, uint64_t leftDepends) {
+    if (leftType == parser->type) {
+        parser->depends |= leftDepends;
+    } else {
+        setType(parser, TYPE_UNKNOWN, 0);
+    }
+}
+
+// the left operand is already on the stack, if it's false so is the whole expression
+// and we skip the right one, leaving the left as the result
+static void and_(Parser* parser, bool canAssign) {
+    StaticType leftType = parser->type;
+    uint64_t leftDepends = parser->depends;
+    int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
+
+    emitOp(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
+
+    patchJump(parser, endJump);
+    joinTypes(parser, leftType, leftDepends);
+}
+
+// if the left operand is true we jump over the right one, otherwise we pop it and the
+// right operand is the result
+static void or_(Parser* parser, bool canAssign) {
+    StaticType leftType = parser->type;
+    uint64_t leftDepends = parser->depends;
+    int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(parser, OP_JUMP);
+
+    patchJump(parser, elseJump);
+    emitOp(parser, OP_POP);
+
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, endJump);
+    joinTypes(parser, leftType, leftDepends);
+}
+
+static void grouping(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+}
 
+static uint8_t argumentList(Parser* parser) {
+    uint8_t argCount = 0;
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
+        do {
+            expression(parser);
+            if (argCount == 255) {
+                error(parser, "Can't have more than 255 arguments.");
+            }
+            argCount++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return argCount;
+}
+
+// the callee is already on the stack, the arguments go on top of it
+static void call(Parser* parser, bool canAssign) {
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_CALL, argCount);
+    // the callee and its arguments are replaced by what it returns
+    adjustStack(parser, -argCount);
+    // a call can return anything
+    setType(parser, TYPE_UNKNOWN, 0);
+}
 
-static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+// [a, b, c] pushes each element and then gathers them into a new array
+static void arrayLiteral(Parser* parser, bool canAssign) {
+    int count = 0;
+    if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression(parser);
+            if (count == 255) {
+                error(parser, "Can't have more than 255 elements in an array literal.");
+            }
+            count++;
+        } while (match(parser, TOKEN_COMMA));
+    }
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+    emitBytes(parser, OP_ARRAY, (uint8_t)count);
+    adjustStack(parser, -count);
+    setType(parser, TYPE_UNKNOWN, 0);
 }
 
-static void initCompiler(Compiler* compiler) {
+// The array is already on the stack. Only arrays can be indexed and they only hold
+// numbers, so if indexing doesn't fail at runtime what comes out is certainly a number
+static void subscript(Parser* parser, bool canAssign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitOp(parser, OP_SET_INDEX);
+    } else {
+        emitOp(parser, OP_GET_INDEX);
+    }
+    setType(parser, TYPE_NUMBER, 0);
+}
+
+
+
+static void emitConstant(Parser* parser, Value value) {
+    emitOperand(parser, OP_CONSTANT, OP_CONSTANT_LONG, makeConstant(parser, value));
+}
+
+// starts compiling a function, into function if we're given one to add to and into
+// a new one otherwise
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type,
+                         ObjFunction* function) {
+    compiler->enclosing = parser->compiler;
+    compiler->function = function != NULL ? function : newFunction(parser->heap);
+    compiler->type = type;
+    compiler->locals = NULL;
+    compiler->localCapacity = 0;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    current = compiler;
+    compiler->unchecked = NULL;
+    compiler->uncheckedCount = 0;
+    compiler->uncheckedCapacity = 0;
+    compiler->stackDepth = 0;
+    initTable(&compiler->ownStrings);
+    compiler->stringConstants = &compiler->ownStrings;
+    parser->compiler = compiler;
+    if (type != TYPE_SCRIPT) {
+        // the function's name is the identifier we just consumed
+        compiler->function->name = copyString(parser->heap, parser->previous.start,
+                                              parser->previous.length);
+    }
+
+    // Slot 0 holds the function being called. It has no name so it can never be
+    // referred to, and the stack depth starts out counting it
+    addLocal(parser, (Token){.type = TOKEN_IDENTIFIER, .start = "", .length = 0});
+    Local* local = &compiler->locals[compiler->localCount - 1];
+    local->depth = 0;
+    local->type = TYPE_UNKNOWN;
+    local->depends = 0;
+    adjustStack(parser, 1);
 }
 
-static void number(bool canAssign) {
+static void number(Parser* parser, bool canAssign) {
     // we assume that the number literal has been consumed and is stored in previous
-    // then we use the c std library function to parse it to a double
-    double value = strtod(parser.previous.start, NULL);
+    // whole numbers become ints as long as they fit, the scanner already told us
+    // exactly how long the literal is
+    const char* start = parser->previous.start;
+    int length = parser->previous.length;
+    int64_t integer;
+    if (memchr(start, '.', (size_t)length) == NULL &&
+        parseInteger(start, length, &integer)) {
+        emitConstant(parser, INT_VAL(integer));
+        setType(parser, TYPE_NUMBER, 0);
+        return;
+    }
+    double value = parseNumber(start, length);
     // we can now wrap number in a value before storing it in the constant table
-    emitConstant(NUMBER_VAL(value));
+    emitConstant(parser, NUMBER_VAL(value));
+    setType(parser, TYPE_NUMBER, 0);
 }
 
-static void string(bool canAssign) {
+static void string(Parser* parser, bool canAssign) {
     // the + 1 and - 2 here trim the quotatin marks and just returns the string value itself
     // it then creates the string object, wraps it in a value and adds it to the constant table
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                  parser.previous.length - 2)));
+  emitConstant(parser, OBJ_VAL(copyString(parser->heap, parser->previous.start + 1,
+                                  parser->previous.length - 2)));
+  setType(parser, TYPE_STRING, 0);
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
   for (int i = compiler->localCount - 1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
     if (identifiersEqual(name, &local->name)) {
         if (local->depth == -1) {
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
               }
       return i;
     }
@@ -491,38 +1123,53 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1;
 }
 
-static void namedVariable(Token name, bool canAssign) {
-    uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
-    if (arg != -1) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
+    uint8_t getOp, getLongOp, setOp, setLongOp;
+    int arg = resolveLocal(parser, parser->compiler, &name);
+    bool isLocal = arg != -1;
+    if (isLocal) {
         getOp = OP_GET_LOCAL;
+        getLongOp = OP_GET_LOCAL_LONG;
         setOp = OP_SET_LOCAL;
+        setLongOp = OP_SET_LOCAL_LONG;
     } else {
-        arg = identifierConstant(&name);
+        arg = identifierConstant(parser, &name);
         getOp = OP_GET_GLOBAL;
+        getLongOp = OP_GET_GLOBAL_LONG;
         setOp = OP_SET_GLOBAL;
+        setLongOp = OP_SET_GLOBAL_LONG;
     }
 
-    if (canAssign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(setOp, (uint8_t)arg);
+    if (canAssign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        emitOperand(parser, setOp, setLongOp, arg);
+        // the assignment's value is its result, so its type stays as it is
+        if (isLocal) assignLocal(parser, arg, parser->type, parser->depends);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitOperand(parser, getOp, getLongOp, arg);
+        if (isLocal && arg < TYPED_LOCALS &&
+            parser->compiler->locals[arg].type != TYPE_UNKNOWN) {
+            // what we know about the value relies on the local never changing type
+            setType(parser, parser->compiler->locals[arg].type, LOCAL_BIT(arg));
+        } else {
+            // globals can be changed from anywhere, we can't know anything about them
+            setType(parser, TYPE_UNKNOWN, 0);
+        }
     }
 }
 
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+    namedVariable(parser, parser->previous, canAssign);
 }
 
 
-static void unary(bool canAssign) {
+static void unary(Parser* parser, bool canAssign) {
     // the leading '-' has been consumed and is sitting in the previous token
-    TokenType operatorType = parser.previous.type;
+    TokenType operatorType = parser->previous.type;
 
     // compile the operand
     // we use PREC_UNARY precedence to permit nested unary expressions like !!doubleNegative
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
 
     // it might seem strange to compile the operand and then emit the negation byte
     // however the order of execution is as follows:
@@ -534,8 +1181,15 @@ static void unary(bool canAssign) {
 
     // emit the operator instruction
     switch (operatorType) {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG:
+            emitOp(parser, OP_NOT);
+            setType(parser, TYPE_BOOL, 0);
+            break;
+        case TOKEN_MINUS:
+            emitTyped(parser, OP_NEGATE, OP_NEGATE_NUMBER, parser->type == TYPE_NUMBER,
+                      parser->depends);
+            setType(parser, TYPE_NUMBER, 0);
+            break;
         default: return; //unreachable
     }
 }
@@ -543,10 +1197,12 @@ static void unary(bool canAssign) {
 // we can see here how grouping and unary are fitted into the prefix operators,
 // and how the 4 binary operators are in the infix column
 ParseRule rules[] = {
-  [TOKEN_LEFT_PAREN]    = {grouping, NULL,   PREC_NONE},
+  [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
   [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {arrayLiteral, subscript, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -565,7 +1221,7 @@ ParseRule rules[] = {
   [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
   [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
-  [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
@@ -573,7 +1229,7 @@ ParseRule rules[] = {
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
   [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE},
-  [TOKEN_OR]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
@@ -585,37 +1241,101 @@ ParseRule rules[] = {
   [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
 
-// this function simple returns the rule at a gives index, and is called by binary() to look
+// this function simple returns the rule at a gives index, and is called by binary(parser) to look
 // up the precedence of the current operator
 static ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
 
-bool compile(const char* source, Chunk* chunk) {
-    initScanner(source);
+// compiles whatever the scanner has been pointed at as the top level of a script,
+// adding to script if we're given one
+static ObjFunction* compileScript(Parser* parser, Heap* heap, const char* name,
+                                  Table* stringConstants, ObjFunction* script) {
     Compiler compiler;
-    initCompiler(&compiler);
-    // set compiling chunk to chunk parameter
-    compilingChunk = chunk;
+    parser->heap = heap;
+    parser->name = name;
+    parser->compiler = NULL;
+    initCompiler(parser, &compiler, TYPE_SCRIPT, script);
+    compiler.stringConstants = stringConstants;
     // set error flags to false
-    parser.hadError = false;
-    parser.panicMode = false;
+    parser->hadError = false;
+    parser->panicMode = false;
     // primes the scanner
-    advance();
-    while (!match(TOKEN_EOF)) {
-        printf("x\n");
-        declaration();
+    advance(parser);
+    while (!match(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
     // wrap things up
-    endCompiler();
-    // if the parser had no error then compilation was a success so we return true
-    return !parser.hadError;
+    ObjFunction* function = endCompiler(parser);
+    // if the parser had no error then compilation was a success
+    return parser->hadError ? NULL : function;
+}
+
+ObjFunction* compile(Heap* heap, const char* source) {
+    // the whole parser lives on our stack, so nothing is shared between compilations
+    Parser parser;
+    Table stringConstants;
+    initTable(&stringConstants);
+    initScanner(&parser.scanner, source);
+    ObjFunction* function = compileScript(&parser, heap, NULL, &stringConstants, NULL);
+    freeTable(&stringConstants);
+    return function;
+}
+
+ObjFunction* compileSource(Heap* heap, Source* source, const char* name) {
+    Parser parser;
+    Table stringConstants;
+    initTable(&stringConstants);
+    initScannerSource(&parser.scanner, source);
+    ObjFunction* function = compileScript(&parser, heap, name, &stringConstants, NULL);
+    freeTable(&stringConstants);
+    return function;
+}
+
+bool compileAppend(Heap* heap, const char* source, Table* stringConstants,
+                   ObjFunction* script) {
+    Chunk* chunk = &script->chunk;
+    int codeCount = chunk->count;
+    int lineCount = chunk->lineCount;
+    int constantCount = chunk->constants.count;
+    int loopCount = chunk->loopCount;
+    // Machine code and threaded code made from the script point straight into its
+    // code, constants and loop counters, which may move as they grow, even if the
+    // compile then fails. Both are thrown away, the threaded code is made again when
+    // the script next runs and the machine code if it gets hot again
+    if (script->jit != NULL) {
+        freeJit(script->jit);
+        script->jit = NULL;
+    }
+    if (script->threaded != NULL) {
+        freeThreaded(script->threaded);
+        script->threaded = NULL;
+    }
+    script->calls = 0;
+
+    Parser parser;
+    initScanner(&parser.scanner, source);
+    if (compileScript(&parser, heap, NULL, stringConstants, script) != NULL) return true;
+
+    // Put the chunk back the way it was. Line runs are only ever added, so the runs
+    // before ours are untouched, and any string constants we added have to come out
+    // of the lookup table too or a later entry would point at a slot we reuse. The
+    // script's maxSlots can stay as it is, too many slots is never a problem
+    for (int i = constantCount; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_STRING(value)) tableDelete(stringConstants, AS_STRING(value));
+    }
+    chunk->constants.count = constantCount;
+    chunk->count = codeCount;
+    chunk->lineCount = lineCount;
+    chunk->loopCount = loopCount;
+    return false;
 }
 /*  TEMP CODE WHICH ALLOWED US TO DEBUG THE COMPILER BEFORE IMPLEMENTATION
     int line = -1;
     for (;;) {
-       Token token = scanToken();
+       Token token = scanToken(&parser->scanner);
        // if token is on a different line
        if (token.line != line) {
          //print new line number and then set line to token line
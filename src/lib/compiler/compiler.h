@@ -3,7 +3,20 @@
 
 #include "vm.h"
 #include "object.h"
+#include "source.h"
 
-bool compile(const char* source, Chunk* chunk);
+// Compiles source into a function for the top level of the script, interning its
+// strings in heap, or returns NULL if there was a compile error. The compiler keeps no
+// state of its own between calls, so threads can compile at the same time as long as
+// each has its own heap
+ObjFunction* compile(Heap* heap, const char* source);
+// same as compile but for a mapped or streamed source, errors are prefixed with name
+// when it isn't NULL
+ObjFunction* compileSource(Heap* heap, Source* source, const char* name);
+// Compiles source onto the end of script's code rather than into a new function,
+// reusing any string constant already listed in stringConstants (string -> constant
+// index). On a compile error the script and table are left exactly as they were
+bool compileAppend(Heap* heap, const char* source, Table* stringConstants,
+                   ObjFunction* script);
 
 #endif
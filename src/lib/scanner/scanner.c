@@ -3,110 +3,132 @@
 #include <string.h>
 
 #include "common.h"
+#include "cpu.h"
 #include "scanner.h"
+#include "source.h"
 
-typedef struct {
-    // marks the beginning of the current lexeme (word) being scanned
-    const char* start;
-    // the current character being looked at
-    const char* current;
-    // the current line number we are scanning
-    int line;
-} Scanner;
+// initialize the scanner with sensible defaults
+void initScanner(Scanner* scanner, const char* source) {
+    scanner->start = source;
+    scanner->current = source;
+    scanner->line = 1;
+    scanner->source = NULL;
+}
 
-// scanner variable
-Scanner scanner;
+void initScannerSource(Scanner* scanner, Source* source) {
+    initScanner(scanner, source->text);
+    scanner->source = source;
+}
 
-// initialize the scanner with sensible defaults
-void initScanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
+// Streamed sources are '\0' terminated at the end of each block. When the character
+// at `at` is that terminator we pull in the next block, which carries over the lexeme
+// we are in the middle of so start and current stay consistent. Tokens we've already
+// handed out keep pointing into the old block, which the source keeps alive.
+// Returns false if there really is nothing more to read
+static bool refill(Scanner* scanner, const char* at) {
+    if (scanner->source == NULL || at != scanner->source->end) return false;
+    const char* start = refillSource(scanner->source, scanner->start);
+    if (start == NULL) return false;
+    scanner->current = start + (scanner->current - scanner->start);
+    scanner->start = start;
+    return true;
 }
 
-// dereferences scanner.current and checks whether its an EOF char
-static bool isAtEnd() {
-    return *scanner.current == '\0';
+// dereferences scanner->current and checks whether its an EOF char
+static bool isAtEnd(Scanner* scanner) {
+    return *scanner->current == '\0' && !refill(scanner, scanner->current);
 }
 
 // Creates a token from a type using the scanner data
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
     Token token;
     token.type = type;
-    token.start = scanner.start;
-    token.length = (int)(scanner.current - scanner.start);
-    token.line = scanner.line;
+    token.start = scanner->start;
+    token.length = (int)(scanner->current - scanner->start);
+    token.line = scanner->line;
     //printf("Token: type = %i, start = %s, length = %i, line = %i\n", token.type, token.start, token.length, token.line);
     return token;
 }
 
 // Creats an error token which allows us to print compilation errors
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
     Token token;
     token.type = TOKEN_ERROR;
     token.start = message;
     token.length = (int)strlen(message);
-    token.line = scanner.line;
+    token.line = scanner->line;
     return token;
 }
 
 // advances the current char being pointer to
-static char advance() {
+static char advance(Scanner* scanner) {
     // consumes it by making the scanner 'walk' past it
-    scanner.current++;
+    scanner->current++;
     // returns the 'consumed character'
-    return scanner.current[-1];
+    return scanner->current[-1];
 }
 
 // checks if a character matches an expected one
-static bool match(char expected) {
+static bool match(Scanner* scanner, char expected) {
     // return false if we're at the end of a file
-    if (isAtEnd()) return false;
+    if (isAtEnd(scanner)) return false;
     // deref the character and check if it doesnt match expected
-    if (*scanner.current != expected) return false;
+    if (*scanner->current != expected) return false;
     // advance current char
-    scanner.current++;
+    scanner->current++;
     // return true if guards passed
     return true;
 }
 
 // exactly the same as advance but doesnt 'consume' the current character by
 // stepping over it
-static char peek() {
+static char peek(Scanner* scanner) {
+    // the terminator might just be the end of the current block
+    if (*scanner->current == '\0') refill(scanner, scanner->current);
     // returns dereferenced current
-    return *scanner.current;
+    return *scanner->current;
 }
 
 // same as peek but one character ahead
-static char peekNext() {
-    if (isAtEnd()) return '\0';
+static char peekNext(Scanner* scanner) {
+    if (isAtEnd(scanner)) return '\0';
+    if (scanner->current[1] == '\0') refill(scanner, scanner->current + 1);
     // the current char array index 1 is the next char
-    return scanner.current[1];
+    return scanner->current[1];
 }
 
 // this function allows us to skip whitespace as we dont actually care about any of it
-static void skipWhitespace() {
+static void skipWhitespace(Scanner* scanner) {
     for (;;) {
+        // nothing we skip needs carrying over if we have to refill mid way
+        scanner->start = scanner->current;
         // peek the char
-        char c = peek();
+        char c = peek(scanner);
         switch (c) {
             case ' ':
             case '\r':
             case '\t':
-                // if it's a tab or whitespace just keep going
-                advance();
+                // if it's a tab or whitespace just keep going, runs of indentation
+                // are skipped in one go by the vector kernel
+                scanner->current = kernels.skipBlanks(scanner->current);
                 break;
             case '\n':
-                // if its a newline char, increment scanner.line and then advance
-                scanner.line++;
-                advance();
+                // if its a newline char, increment scanner->line and then advance
+                scanner->line++;
+                advance(scanner);
                 break;
             case '/':
                 // if its a / and so is the next character then we know its a comment
-                if (peekNext() == '/') {
+                if (peekNext(scanner) == '/') {
                     //comments go until the end of the line
                     // basically keep advancing until we hit a new line or the end of a file
-                    while (peek() != '\n' && !isAtEnd()) advance();
+                    // (a comment can run past the end of a streamed block, in which
+                    // case we refill and carry on skipping)
+                    for (;;) {
+                        scanner->current = kernels.skipToLineEnd(scanner->current);
+                        scanner->start = scanner->current;
+                        if (*scanner->current != '\0' || !refill(scanner, scanner->current)) break;
+                    }
                 } else {
                     return;
                 }
@@ -117,39 +139,39 @@ static void skipWhitespace() {
     }
 }
 
-static Token string() {
+static Token string(Scanner* scanner) {
     // loop until we reach closing quotes or end of file
-    while (peek() != '"' && !isAtEnd()) {
+    while (peek(scanner) != '"' && !isAtEnd(scanner)) {
         // check if character is a new line then increment
-        if (peek() == '\n') scanner.line++;
+        if (peek(scanner) == '\n') scanner->line++;
         // keep going
-        advance();
+        advance(scanner);
     }
-    if (isAtEnd()) return errorToken("Unterminated string");
+    if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string");
 
     // for the closing quote
-    advance();
-    return makeToken(TOKEN_STRING);
+    advance(scanner);
+    return makeToken(scanner, TOKEN_STRING);
 }
 
 static bool isDigit(char c) {
     return c >= '0' && c <= '9';
 }
 
-static Token number() {
+static Token number(Scanner* scanner) {
     // keep advancing whilst char is a digit
-    while (isDigit(peek())) advance();
+    while (isDigit(peek(scanner))) advance(scanner);
 
     // look for fractional part
     // check if char is . and next char is a digit
-    if (peek() == '.' && isDigit(peekNext())) {
+    if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
         // consume the '.'
-        advance();
+        advance(scanner);
         // keep advancing whilst digit
-        while (isDigit(peek())) advance();
+        while (isDigit(peek(scanner))) advance(scanner);
     }
     // return number token
-    return makeToken(TOKEN_NUMBER);
+    return makeToken(scanner, TOKEN_NUMBER);
 }
 
 static bool isAlpha(char c) {
@@ -162,11 +184,11 @@ static bool isAlpha(char c) {
 // checks whether the identifier is a keyword
 //
 // takes start, length, the 'rest' of the keyword and then a token type to return
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
+static TokenType checkKeyword(Scanner* scanner, int start, int length, const char* rest, TokenType type) {
     // if lexeme length is the same length as the keyword
-    if (scanner.current - scanner.start == start + length
+    if (scanner->current - scanner->start == start + length
         // the remaining characters must also match
-        && memcmp(scanner.start + start, rest, length) == 0) {
+        && memcmp(scanner->start + start, rest, length) == 0) {
         // then we can return the token type
         return type;
     }
@@ -176,80 +198,83 @@ static TokenType checkKeyword(int start, int length, const char* rest, TokenType
 
 // this basically parses the lexeme for an identifier, which is either a variable name
 // or a reserved keyword such as else, or, nil etc.
-static TokenType identifierType() {
+static TokenType identifierType(Scanner* scanner) {
     // switch on the first letter of the current lexeme
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+    switch (scanner->start[0]) {
+        case 'a': return checkKeyword(scanner, 1, 2, "nd", TOKEN_AND);
+        case 'c': return checkKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
+        case 'e': return checkKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
         case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_OR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
+            if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                    case 'a': return checkKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+                    case 'o': return checkKeyword(scanner, 2, 1, "r", TOKEN_FOR);
+                    case 'u': return checkKeyword(scanner, 2, 1, "n", TOKEN_FUN);
                 }
             }
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+            break;
+        case 'i': return checkKeyword(scanner, 1, 1, "f", TOKEN_IF);
+        case 'n': return checkKeyword(scanner, 1, 2, "il", TOKEN_NIL);
+        case 'o': return checkKeyword(scanner, 1, 1, "r", TOKEN_OR);
+        case 'p': return checkKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
+        case 'r': return checkKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
+        case 's': return checkKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
         case 't':
-              if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                  case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                  case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
+              if (scanner->current - scanner->start > 1) {
+                switch (scanner->start[1]) {
+                  case 'h': return checkKeyword(scanner, 2, 2, "is", TOKEN_THIS);
+                  case 'r': return checkKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
                 }
               }
               break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+        case 'v': return checkKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
+        case 'w': return checkKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
     }
     return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
+static Token identifier(Scanner* scanner) {
     // if character is a number or a word keep advancing
-    while (isAlpha(peek()) || isDigit(peek())) advance();
+    while (isAlpha(peek(scanner)) || isDigit(peek(scanner))) advance(scanner);
     // return correct identifier type
-    return makeToken(identifierType());
+    return makeToken(scanner, identifierType(scanner));
 }
 
 // This is where all the work is done.
-Token scanToken() {
+Token scanToken(Scanner* scanner) {
     // the scanner doesnt care about whitespace, so skip it all
-    skipWhitespace();
+    skipWhitespace(scanner);
     // start of lexeme = current character
-    scanner.start = scanner.current;
+    scanner->start = scanner->current;
     // if end of file then return token
-    if (isAtEnd()) return makeToken(TOKEN_EOF);
+    if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
     // advance the token
-    char c = advance();
+    char c = advance(scanner);
     // check for alpha or digit
-    if (isAlpha(c)) return identifier();
-    if (isDigit(c)) return number();
+    if (isAlpha(c)) return identifier(scanner);
+    if (isDigit(c)) return number(scanner);
 
     // switch on the characters and return correct tokens
     switch (c) {
-        case '(': return makeToken(TOKEN_LEFT_PAREN);
-        case ')': return makeToken(TOKEN_RIGHT_PAREN);
-        case '{': return makeToken(TOKEN_LEFT_BRACE);
-        case '}': return makeToken(TOKEN_RIGHT_BRACE);
-        case ';': return makeToken(TOKEN_SEMICOLON);
-        case ',': return makeToken(TOKEN_COMMA);
-        case '.': return makeToken(TOKEN_DOT);
-        case '-': return makeToken(TOKEN_MINUS);
-        case '+': return makeToken(TOKEN_PLUS);
-        case '/': return makeToken(TOKEN_SLASH);
-        case '*': return makeToken(TOKEN_STAR);
-        case '!': return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-        case '=': return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-        case '<': return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-        case '>': return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-        case '"': return string();
+        case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+        case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+        case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+        case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+        case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+        case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+        case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+        case ',': return makeToken(scanner, TOKEN_COMMA);
+        case '.': return makeToken(scanner, TOKEN_DOT);
+        case '-': return makeToken(scanner, TOKEN_MINUS);
+        case '+': return makeToken(scanner, TOKEN_PLUS);
+        case '/': return makeToken(scanner, TOKEN_SLASH);
+        case '*': return makeToken(scanner, TOKEN_STAR);
+        case '!': return makeToken(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+        case '=': return makeToken(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+        case '<': return makeToken(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+        case '>': return makeToken(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+        case '"': return string(scanner);
     }
     //return error if not recognised character
-    return errorToken("Unexpected character");
+    return errorToken(scanner, "Unexpected character");
 }
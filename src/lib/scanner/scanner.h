@@ -1,10 +1,13 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "source.h"
+
 typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
   // One or two character tokens.
@@ -34,7 +37,21 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+typedef struct {
+    // marks the beginning of the current lexeme (word) being scanned
+    const char* start;
+    // the current character being looked at
+    const char* current;
+    // the current line number we are scanning
+    int line;
+    // where more text comes from when we run off the end of what we have, NULL when
+    // we were just given a string
+    Source* source;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+// scans a mapped or streamed source, pulling in more text as it is needed
+void initScannerSource(Scanner* scanner, Source* source);
+Token scanToken(Scanner* scanner);
 
 #endif
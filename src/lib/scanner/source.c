@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "source.h"
+
+// the text we hand out for empty input, the scanner only ever reads it
+static const char emptyText[] = "";
+
+static void initSource(Source* source) {
+    source->text = emptyText;
+    source->end = emptyText;
+    source->mapping = NULL;
+    source->mappingSize = 0;
+    source->stream = NULL;
+    source->ownsStream = false;
+    source->blocks = NULL;
+}
+
+// reads as much as is available up to size bytes, a short count from a pipe just
+// means the writer hasn't given us any more yet, only 0 means the end of the input
+static size_t readSome(FILE* stream, char* buffer, size_t size) {
+    int fd = fileno(stream);
+    for (;;) {
+        ssize_t count = read(fd, buffer, size);
+        if (count >= 0) return (size_t)count;
+        if (errno != EINTR) return 0;
+    }
+}
+
+const char* refillSource(Source* source, const char* lexemeStart) {
+    if (source->stream == NULL) return NULL;
+
+    size_t carried = (size_t)(source->end - lexemeStart);
+    size_t capacity = SOURCE_BLOCK_SIZE;
+    // a single lexeme bigger than a block (a huge string literal say) just gets a
+    // bigger block, doubling keeps the cost of copying it over and over linear
+    while (capacity < carried * 2 + 1) capacity *= 2;
+
+    SourceBlock* block = (SourceBlock*)malloc(sizeof(SourceBlock) + capacity);
+    if (block == NULL) {
+        fprintf(stderr, "Not enough memory to read the source.\n");
+        exit(74);
+    }
+    block->capacity = capacity;
+    memcpy(block->data, lexemeStart, carried);
+
+    size_t count = readSome(source->stream, block->data + carried, capacity - carried - 1);
+    if (count == 0) {
+        // we're at the end of the input, the scanner keeps going with the block it has
+        free(block);
+        if (source->ownsStream) fclose(source->stream);
+        source->stream = NULL;
+        return NULL;
+    }
+    block->data[carried + count] = '\0';
+
+    block->next = source->blocks;
+    source->blocks = block;
+    source->end = block->data + carried + count;
+    return block->data;
+}
+
+static void startStream(Source* source, FILE* stream, bool ownsStream) {
+    initSource(source);
+    source->stream = stream;
+    source->ownsStream = ownsStream;
+    const char* text = refillSource(source, source->end);
+    if (text != NULL) source->text = text;
+}
+
+void openSourceStream(Source* source, FILE* stream) {
+    startStream(source, stream, false);
+}
+
+bool openSourceFile(Source* source, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        initSource(source);
+        size_t size = (size_t)info.st_size;
+        if (size == 0) {
+            close(fd);
+            return true;
+        }
+
+        // The scanner expects a '\0' after the last character, but a mapping of the file
+        // stops at the file's last page. So we first reserve zero filled memory one byte
+        // longer than the file and then lay the file over the front of it, whatever
+        // follows the file's last byte is then guaranteed to read as '\0'
+        size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        size_t mappingSize = (size + 1 + pageSize - 1) / pageSize * pageSize;
+        char* base = mmap(NULL, mappingSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base != MAP_FAILED) {
+            if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+                close(fd);
+                // we only ever walk forwards through it
+                madvise(base, size, MADV_SEQUENTIAL);
+                source->text = base;
+                source->end = base + size;
+                source->mapping = base;
+                source->mappingSize = mappingSize;
+                return true;
+            }
+            munmap(base, mappingSize);
+        }
+        // if mapping fails for whatever reason we can still stream the file
+    }
+
+    FILE* stream = fdopen(fd, "rb");
+    if (stream == NULL) {
+        close(fd);
+        return false;
+    }
+    startStream(source, stream, true);
+    return true;
+}
+
+void closeSource(Source* source) {
+    if (source->mapping != NULL) munmap(source->mapping, source->mappingSize);
+    if (source->stream != NULL && source->ownsStream) fclose(source->stream);
+
+    SourceBlock* block = source->blocks;
+    while (block != NULL) {
+        SourceBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    initSource(source);
+}
@@ -0,0 +1,53 @@
+#ifndef clox_source_h
+#define clox_source_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+// how much we read from a pipe or stdin at a time
+#define SOURCE_BLOCK_SIZE (64 * 1024)
+
+// A block of streamed input, the text is always '\0' terminated so the scanner can
+// treat the end of a block exactly like the end of the file until it asks for more
+typedef struct SourceBlock {
+    struct SourceBlock* next;
+    size_t capacity;
+    char data[];
+} SourceBlock;
+
+// Where the scanner gets its characters from. Regular files are mapped straight into
+// memory so we never copy them, anything else (pipes, stdin, a terminal) is read in
+// blocks as the scanner runs out of text.
+//
+// Tokens point straight into this text, so every block stays alive until the source
+// is closed, that way the compiler can hang on to a Token as long as it likes
+typedef struct {
+    // the text the scanner starts on
+    const char* text;
+    // the '\0' at the end of the text we currently have, when the scanner reaches
+    // this exact character (rather than a '\0' inside the file) it asks for more
+    const char* end;
+    // for mapped files
+    void* mapping;
+    size_t mappingSize;
+    // for streamed input
+    FILE* stream;
+    // we close files we opened ourselves but leave stdin alone
+    bool ownsStream;
+    SourceBlock* blocks;
+} Source;
+
+// maps path if it is a regular file, otherwise streams it, returns false if the file
+// can't be opened
+bool openSourceFile(Source* source, const char* path);
+// streams from an already open file such as stdin, which stays open afterwards
+void openSourceStream(Source* source, FILE* stream);
+// Called by the scanner when it hits source->end. The unfinished lexeme from
+// lexemeStart up to the end of the block is carried over to the start of a new block
+// and more input is read after it. Returns where the lexeme now starts, or NULL if
+// there is no more input
+const char* refillSource(Source* source, const char* lexemeStart);
+void closeSource(Source* source);
+
+#endif
@@ -0,0 +1,384 @@
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "object.h"
+#include "value.h"
+
+// "CLXB" when read as a little endian word, a cache written on a machine with the
+// other byte order fails this check and gets ignored
+#define CACHE_MAGIC 0x42584C43u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+    uint64_t fileSize;
+} CacheHeader;
+
+// Starts every function in the file, the script's own comes straight after the
+// header. It's followed by the name, then the code and line runs (each starting on an
+// 8 byte boundary) and then the constants, the functions declared inside it included
+typedef struct {
+    uint32_t arity;
+    uint32_t maxSlots;
+    uint32_t codeCount;
+    uint32_t lineCount;
+    uint32_t constantCount;
+    // the counters themselves start at zero every run, only how many there are is kept
+    uint32_t loopCount;
+    // -1 for the script, which has no name
+    int32_t nameLength;
+    uint32_t padding;
+} FunctionRecord;
+
+// each constant is a tag byte followed by its payload
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,  // followed by the 8 bytes of the double
+    CONSTANT_STRING,  // followed by a 4 byte length and then the characters
+    CONSTANT_INT,     // followed by the 8 bytes of the integer
+    CONSTANT_FUNCTION,  // followed by a whole function, starting on an 8 byte boundary
+} ConstantTag;
+
+#define ALIGN8(offset) (((offset) + 7) & ~(uint64_t)7)
+
+// This only has to notice that a script changed, not stand up to someone trying to
+// fool it, so a multiply and shift per 8 bytes is plenty and keeps hashing a big
+// script far cheaper than compiling it. It must not depend on the CPU dispatch level
+// since caches are shared between machines
+static uint64_t hashBytes(const char* bytes, size_t length) {
+    uint64_t hash = 0x9E3779B97F4A7C15ull ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes + i, length - i);
+    hash = (hash ^ tail) * 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+// works out where the cache for the script at path lives, returns NULL if caching is
+// turned off, the caller frees the result
+static char* cachePath(const char* path) {
+    const char* setting = getenv("CLOX_CACHE");
+    if (setting != NULL && strcmp(setting, "off") == 0) return NULL;
+
+    char* result = (char*)malloc(PATH_MAX + 32);
+    if (result == NULL) return NULL;
+
+    const char* directory = getenv("CLOX_CACHE_DIR");
+    if (directory != NULL && directory[0] != '\0') {
+        // in a shared directory the cache is named after a hash of the script's full
+        // path, so scripts with the same name in different places don't collide
+        char resolved[PATH_MAX];
+        if (realpath(path, resolved) == NULL) {
+            free(result);
+            return NULL;
+        }
+        uint64_t hash = hashBytes(resolved, strlen(resolved));
+        snprintf(result, PATH_MAX + 32, "%s/%016llx.loxc", directory,
+                 (unsigned long long)hash);
+    } else {
+        snprintf(result, PATH_MAX + 32, "%s.loxc", path);
+    }
+    return result;
+}
+
+// Functions nest in the file as deep as they do in the script. No script needs more
+// than this, and a file claiming more would otherwise run us out of C stack reading it
+#define MAX_FUNCTION_DEPTH 256
+
+static ObjFunction* readFunction(Heap* heap, uint8_t* base, size_t size,
+                                 size_t* offset, int depth);
+
+// rebuilds the constant pool, returns false if the section is malformed
+static bool readConstants(Heap* heap, uint8_t* base, size_t size, size_t* offset,
+                          uint32_t count, Chunk* chunk, int depth) {
+    const uint8_t* bytes = base;
+    size_t at = *offset;
+    for (uint32_t i = 0; i < count; i++) {
+        if (at + 1 > size) return false;
+        uint8_t tag = bytes[at++];
+        switch (tag) {
+            case CONSTANT_NIL: addConstant(chunk, NIL_VAL); break;
+            case CONSTANT_FALSE: addConstant(chunk, BOOL_VAL(false)); break;
+            case CONSTANT_TRUE: addConstant(chunk, BOOL_VAL(true)); break;
+            case CONSTANT_NUMBER: {
+                double number;
+                if (at + sizeof(number) > size) return false;
+                memcpy(&number, bytes + at, sizeof(number));
+                at += sizeof(number);
+                addConstant(chunk, NUMBER_VAL(number));
+                break;
+            }
+            case CONSTANT_INT: {
+                int64_t integer;
+                if (at + sizeof(integer) > size) return false;
+                memcpy(&integer, bytes + at, sizeof(integer));
+                at += sizeof(integer);
+                addConstant(chunk, INT_VAL(integer));
+                break;
+            }
+            case CONSTANT_STRING: {
+                uint32_t length;
+                if (at + sizeof(length) > size) return false;
+                memcpy(&length, bytes + at, sizeof(length));
+                at += sizeof(length);
+                if (at + length > size) return false;
+                // strings have to be interned like any other, so they get copied
+                ObjString* string = copyString(heap, (const char*)bytes + at, (int)length);
+                at += length;
+                addConstant(chunk, OBJ_VAL(string));
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction* function = readFunction(heap, base, size, &at, depth + 1);
+                if (function == NULL) return false;
+                addConstant(chunk, OBJ_VAL(function));
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+    *offset = at;
+    return true;
+}
+
+// Rebuilds the function whose record starts at the next 8 byte boundary after offset,
+// and moves offset past it. Returns NULL if it's malformed, whatever we made before
+// finding out is just left for the heap to free.
+//
+// The hash in the header only says which source the cache was made from, not that the
+// rest of the file is what we wrote, so nothing in it is trusted. Every count has to
+// fit in what's left of the file and the bytecode is verified before anyone runs it,
+// a cache that fails is just a miss and the script is compiled again
+static ObjFunction* readFunction(Heap* heap, uint8_t* base, size_t size,
+                                 size_t* offset, int depth) {
+    FunctionRecord record;
+    size_t at = ALIGN8(*offset);
+    if (depth > MAX_FUNCTION_DEPTH || at + sizeof(record) > size) return NULL;
+    memcpy(&record, base + at, sizeof(record));
+    at += sizeof(record);
+    // the compiler allows 255 parameters, and a loop's index is 2 bytes
+    if (record.arity > 255 || record.maxSlots > INT32_MAX || record.loopCount > UINT16_MAX + 1) {
+        return NULL;
+    }
+
+    ObjFunction* function = newFunction(heap);
+    function->arity = (int)record.arity;
+    function->maxSlots = (int)record.maxSlots;
+    if (record.nameLength >= 0) {
+        if (at + (size_t)record.nameLength > size) return NULL;
+        function->name = copyString(heap, (const char*)base + at, record.nameLength);
+        at += (size_t)record.nameLength;
+    }
+
+    at = ALIGN8(at);
+    if (at + record.codeCount > size) return NULL;
+    uint8_t* code = base + at;
+    at += record.codeCount;
+    at = ALIGN8(at);
+    uint64_t linesSize = (uint64_t)record.lineCount * sizeof(LineStart);
+    if (record.lineCount == 0 || at + linesSize > size) return NULL;
+    LineStart* lines = (LineStart*)(base + at);
+    at += linesSize;
+
+    Chunk* chunk = &function->chunk;
+    if (!readConstants(heap, base, size, &at, record.constantCount, chunk, depth)) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < record.loopCount; i++) addLoop(chunk);
+
+    // The code and line runs are used right where they are in the mapping. Every
+    // function borrows them, it's up to the caller to give the mapping an owner
+    chunk->code = code;
+    chunk->count = (int)record.codeCount;
+    chunk->capacity = 0;
+    chunk->lines = lines;
+    chunk->lineCount = (int)record.lineCount;
+    chunk->lineCapacity = 0;
+    chunk->mapping = base;
+    chunk->mappingSize = 0;
+    if (!verifyChunk(chunk, function->arity, function->maxSlots)) return NULL;
+    *offset = at;
+    return function;
+}
+
+ObjFunction* loadBytecodeCache(Heap* heap, const char* path, Source* source) {
+    // we can only vouch for a source we have all of up front
+    if (source->mapping == NULL) return NULL;
+
+    char* cache = cachePath(path);
+    if (cache == NULL) return NULL;
+    int fd = open(cache, O_RDONLY);
+    free(cache);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)info.st_size;
+    // The VM rewrites instructions in place as it learns what types they see, so the
+    // mapping has to be writable. Being private, the first write to a page just gives
+    // us our own copy of it, the cache file itself never changes
+    uint8_t* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // the mapping keeps the file alive, we don't need the descriptor any more
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    CacheHeader header;
+    memcpy(&header, base, sizeof(header));
+    size_t sourceLength = (size_t)(source->end - source->text);
+    bool valid = header.magic == CACHE_MAGIC &&
+                 header.version == BYTECODE_CACHE_VERSION &&
+                 header.fileSize == size &&
+                 header.sourceLength == sourceLength &&
+                 header.sourceHash == hashBytes(source->text, sourceLength);
+    ObjFunction* script = NULL;
+    if (valid) {
+        size_t offset = sizeof(header);
+        script = readFunction(heap, base, size, &offset, 0);
+    }
+    if (script == NULL) {
+        munmap(base, size);
+        return NULL;
+    }
+    // the script's chunk unmaps the file when it's freed
+    script->chunk.mappingSize = size;
+    return script;
+}
+
+static void writePadding(FILE* file) {
+    static const uint8_t zeros[8] = {0};
+    long position = ftell(file);
+    fwrite(zeros, 1, (size_t)(ALIGN8((uint64_t)position) - (uint64_t)position), file);
+}
+
+static void writeFunction(FILE* file, ObjFunction* function);
+
+static void writeConstantValue(FILE* file, Value value) {
+    uint8_t tag;
+    switch (value.type) {
+        case VAL_NIL:
+            tag = CONSTANT_NIL;
+            fwrite(&tag, 1, 1, file);
+            break;
+        case VAL_BOOL:
+            tag = AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE;
+            fwrite(&tag, 1, 1, file);
+            break;
+        case VAL_NUMBER: {
+            tag = CONSTANT_NUMBER;
+            double number = AS_DOUBLE(value);
+            fwrite(&tag, 1, 1, file);
+            fwrite(&number, sizeof(number), 1, file);
+            break;
+        }
+        case VAL_INT: {
+            tag = CONSTANT_INT;
+            int64_t integer = AS_INT(value);
+            fwrite(&tag, 1, 1, file);
+            fwrite(&integer, sizeof(integer), 1, file);
+            break;
+        }
+        case VAL_OBJ: {
+            // the compiler only ever puts strings and functions in the constant pool
+            if (IS_FUNCTION(value)) {
+                tag = CONSTANT_FUNCTION;
+                fwrite(&tag, 1, 1, file);
+                writeFunction(file, AS_FUNCTION(value));
+                break;
+            }
+            ObjString* string = AS_STRING(value);
+            tag = CONSTANT_STRING;
+            uint32_t length = (uint32_t)string->length;
+            fwrite(&tag, 1, 1, file);
+            fwrite(&length, sizeof(length), 1, file);
+            fwrite(string->chars, 1, length, file);
+            break;
+        }
+    }
+}
+
+static void writeFunction(FILE* file, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    FunctionRecord record;
+    memset(&record, 0, sizeof(record));
+    record.arity = (uint32_t)function->arity;
+    record.maxSlots = (uint32_t)function->maxSlots;
+    record.codeCount = (uint32_t)chunk->count;
+    record.lineCount = (uint32_t)chunk->lineCount;
+    record.constantCount = (uint32_t)chunk->constants.count;
+    record.loopCount = (uint32_t)chunk->loopCount;
+    record.nameLength = function->name != NULL ? function->name->length : -1;
+
+    writePadding(file);
+    fwrite(&record, sizeof(record), 1, file);
+    if (function->name != NULL) {
+        fwrite(function->name->chars, 1, (size_t)function->name->length, file);
+    }
+    writePadding(file);
+    fwrite(chunk->code, 1, (size_t)chunk->count, file);
+    writePadding(file);
+    fwrite(chunk->lines, sizeof(LineStart), (size_t)chunk->lineCount, file);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeConstantValue(file, chunk->constants.values[i]);
+    }
+}
+
+void writeBytecodeCache(const char* path, Source* source, ObjFunction* script) {
+    if (source->mapping == NULL || script->chunk.mapping != NULL) return;
+
+    char* cache = cachePath(path);
+    if (cache == NULL) return;
+    // write to a temporary file and rename it into place, so a script being run
+    // concurrently never sees half a cache. The counter keeps two threads of the same
+    // process writing the same cache from sharing a temporary file
+    static atomic_uint writes;
+    char temporary[PATH_MAX + 64];
+    snprintf(temporary, sizeof(temporary), "%s.%ld.%u.tmp", cache, (long)getpid(),
+             atomic_fetch_add(&writes, 1));
+    FILE* file = fopen(temporary, "wb");
+    if (file == NULL) {
+        free(cache);
+        return;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CACHE_MAGIC;
+    header.version = BYTECODE_CACHE_VERSION;
+    header.sourceLength = (uint64_t)(source->end - source->text);
+    header.sourceHash = hashBytes(source->text, (size_t)header.sourceLength);
+
+    // the header gets written again at the end once we know the file's size
+    fwrite(&header, sizeof(header), 1, file);
+    writeFunction(file, script);
+    header.fileSize = (uint64_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+
+    bool failed = ferror(file) != 0;
+    if (fclose(file) != 0) failed = true;
+    if (failed || rename(temporary, cache) != 0) remove(temporary);
+    free(cache);
+}
@@ -0,0 +1,35 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "chunk.h"
+#include "object.h"
+#include "source.h"
+
+// Bump this whenever the layout of the cache or the meaning of any opcode changes,
+// caches written by an older interpreter are then simply ignored and rewritten
+#define BYTECODE_CACHE_VERSION 7
+
+// A compiled script can be cached on disk so the next run of the same script skips
+// the scanner and compiler entirely. The cache for "script.lox" lives next to it as
+// "script.lox.loxc", or in $CLOX_CACHE_DIR if that is set, and CLOX_CACHE=off turns
+// caching off altogether.
+//
+// The file is a header followed by the script's top level function, every function
+// looks like this with each section starting on an 8 byte boundary:
+//
+// [function record][name][code bytes][line runs][constants]
+//
+// and a function declared inside it is one of its constants, written out the same way
+// in the middle of its constant section.
+//
+// The header records a hash of the source it was compiled from, so an edited script is
+// never run from a stale cache. Code and line runs are used straight from the mapped
+// file, only the constants (which need interning) are rebuilt on load.
+
+// rebuilds the script's function from the cache for the source at path if there is an
+// up to date one, interning its strings in heap, and returns NULL otherwise
+ObjFunction* loadBytecodeCache(Heap* heap, const char* path, Source* source);
+// saves a freshly compiled script, failing to write the cache is not an error
+void writeBytecodeCache(const char* path, Source* source, ObjFunction* script);
+
+#endif
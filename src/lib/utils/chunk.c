@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <sys/mman.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -7,7 +8,15 @@ void initChunk(Chunk* chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
+    chunk->mapping = NULL;
+    chunk->mappingSize = 0;
+    chunk->frozen = false;
+    chunk->loopCount = 0;
+    chunk->loopCapacity = 0;
+    chunk->loopCounters = NULL;
     initValueArray(&chunk->constants);
 }
 
@@ -21,26 +30,55 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         // then we use the grow array macro to grow the opcodes array to the new capacity
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        // same with the lines array
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
     // write byte param to the opcode at the current array position
     chunk->code[chunk->count] = byte;
-    // write line param to the line at the current array position
-    chunk->lines[chunk->count] = line;
     // increment the count
     chunk->count++;
+
+    // if we're still on the same line as the last byte there is nothing to record
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+        return;
+    }
+    // otherwise start a new run, same growth strategy as the code
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+    LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+    lineStart->offset = chunk->count - 1;
+    lineStart->line = line;
 }
 
 // Uses our memory macros to free the opcode and line arrays
 void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    if (chunk->mapping != NULL) {
+        // The code and lines belong to the mapped cache file. Only the script's own
+        // chunk owns the mapping, the chunks of the functions in it borrow from it
+        // and have a mappingSize of 0
+        if (chunk->mappingSize > 0) munmap(chunk->mapping, chunk->mappingSize);
+    } else {
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+    }
+    FREE_ARRAY(uint64_t, chunk->loopCounters, chunk->loopCapacity);
     freeValueArray(&chunk->constants);
     // We then call initChunk to leave it in a well-defined, empty state
     initChunk(chunk);
 }
 
+int addLoop(Chunk* chunk) {
+    if (chunk->loopCapacity < chunk->loopCount + 1) {
+        int oldCapacity = chunk->loopCapacity;
+        chunk->loopCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->loopCounters = GROW_ARRAY(uint64_t, chunk->loopCounters, oldCapacity,
+                                         chunk->loopCapacity);
+    }
+    chunk->loopCounters[chunk->loopCount] = 0;
+    return chunk->loopCount++;
+}
+
 int addConstant(Chunk* chunk, Value value) {
     writeValueArray(&chunk->constants, value);
     return chunk->constants.count - 1;
@@ -49,27 +87,209 @@ int addConstant(Chunk* chunk, Value value) {
 void writeConstant(Chunk* chunk, Value value, int line) {
     int constantIndex = addConstant(chunk, value);
 
-    if (chunk->capacity < chunk->count + 4) {
-        int oldCapacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+    // the long form stores the index as 3 bytes, most significant first
+    writeChunk(chunk, OP_CONSTANT_LONG, line);
+    writeChunk(chunk, (constantIndex >> 16) & 0xFF, line);
+    writeChunk(chunk, (constantIndex >> 8) & 0xFF, line);
+    writeChunk(chunk, constantIndex & 0xFF, line);
+}
+
+// this is only needed when something goes wrong (or we are disassembling), so a
+// binary search over the runs is plenty fast
+int getLine(Chunk* chunk, int offset) {
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        // round up so we always make progress when low + 1 == high
+        int mid = low + (high - low + 1) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
     }
-    // write byte param to the opcode at the current array position
-    chunk->code[chunk->count] = OP_CONSTANT_LONG;
-    chunk->lines[chunk->count] = line;
-    // increment the count
-    chunk->count++;
+    return chunk->lines[low].line;
+}
 
-    chunk->code[chunk->count] = (constantIndex >> 16) & 0xFF;
-    chunk->lines[chunk->count] = line;
-    chunk->count++;
+// How many values the instruction at ip takes off the stack and how many it leaves
+static void stackUse(const uint8_t* ip, int* pops, int* pushes) {
+    *pops = 0;
+    *pushes = 0;
+    switch (ip[0]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            *pushes = 1;
+            break;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_PRINT:
+        case OP_RETURN:
+            *pops = 1;
+            break;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_NEGATE_NUMBER:
+        case OP_JUMP_IF_FALSE:
+            // they look at the value on top and leave it there
+            *pops = 1;
+            *pushes = 1;
+            break;
+        case OP_CALL:
+            // the callee and its arguments, replaced by what it returns
+            *pops = ip[1] + 1;
+            *pushes = 1;
+            break;
+        case OP_ARRAY:
+            *pops = ip[1];
+            *pushes = 1;
+            break;
+        case OP_SET_INDEX:
+            *pops = 3;
+            *pushes = 1;
+            break;
+        case OP_JUMP:
+        case OP_JUMP_BACK:
+        case OP_LOOP:
+            break;
+        default:
+            // the binary operators, OP_GET_INDEX and every quickened form of them
+            *pops = 2;
+            *pushes = 1;
+            break;
+    }
+}
 
-    chunk->code[chunk->count] = (constantIndex >> 8) & 0xFF;
-    chunk->lines[chunk->count] = line;
-    chunk->count++;
+// where a jump or loop goes, all of them count from the end of the instruction
+static int jumpTarget(const uint8_t* ip, int offset) {
+    switch (ip[0]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE: return offset + 3 + jumpOffset(ip);
+        case OP_JUMP_BACK: return offset + 3 - jumpOffset(ip);
+        default: return offset + 5 - jumpOffset(ip);
+    }
+}
 
-    chunk->code[chunk->count] = constantIndex & 0xFF;
-    chunk->lines[chunk->count] = line;
-    chunk->count++;
-}
\ No newline at end of file
+#define NOT_AN_INSTRUCTION -2
+#define NOT_REACHED -1
+
+bool verifyChunk(Chunk* chunk, int arity, int maxSlots) {
+    int count = chunk->count;
+    if (count <= 0 || arity < 0 || maxSlots < arity + 1) return false;
+    // By offset, how deep the stack is when the instruction there starts, which is all
+    // the VM counts on: it only checks there's room for maxSlots when the call is made
+    int* depths = (int*)malloc(sizeof(int) * (size_t)count * 2);
+    if (depths == NULL) return false;
+    int* pending = depths + count;
+    for (int i = 0; i < count; i++) depths[i] = NOT_AN_INSTRUCTION;
+
+    // every instruction has to fit and only name things the chunk has
+    bool valid = true;
+    for (int offset = 0; valid && offset < count;) {
+        uint8_t* ip = chunk->code + offset;
+        uint8_t op = ip[0];
+        int length = instructionLength(op);
+        if (op > OP_NEGATE_NUMBER || offset + length > count) {
+            valid = false;
+            break;
+        }
+        depths[offset] = NOT_REACHED;
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+                valid = instructionOperand(ip) < chunk->constants.count;
+                break;
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG:
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG:
+                valid = instructionOperand(ip) < chunk->constants.count &&
+                        IS_STRING(chunk->constants.values[instructionOperand(ip)]);
+                break;
+            case OP_LOOP:
+                valid = ((ip[3] << 8) | ip[4]) < chunk->loopCount;
+                break;
+            default:
+                break;
+        }
+        offset += length;
+    }
+
+    // Then every path through it, from the arguments on. Wherever paths meet they have
+    // to agree on the depth, no instruction may take off more than is above slot 0 or
+    // push past maxSlots, and a local has to be below the top. Code no path reaches is
+    // never run so it isn't checked
+    int pendingCount = 0;
+    if (valid) {
+        depths[0] = arity + 1;
+        pending[pendingCount++] = 0;
+    }
+    while (valid && pendingCount > 0) {
+        int offset = pending[--pendingCount];
+        uint8_t* ip = chunk->code + offset;
+        int depth = depths[offset];
+        int pops, pushes;
+        stackUse(ip, &pops, &pushes);
+        if (depth - pops < 1 || depth - pops + pushes > maxSlots) {
+            valid = false;
+            break;
+        }
+        switch (ip[0]) {
+            case OP_GET_LOCAL:
+            case OP_GET_LOCAL_LONG:
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_LONG:
+                valid = instructionOperand(ip) < depth;
+                break;
+            default:
+                break;
+        }
+        depth = depth - pops + pushes;
+
+        int next[2];
+        int nextCount = 0;
+        switch (ip[0]) {
+            case OP_RETURN:
+                break;
+            case OP_JUMP:
+            case OP_JUMP_BACK:
+            case OP_LOOP:
+                next[nextCount++] = jumpTarget(ip, offset);
+                break;
+            case OP_JUMP_IF_FALSE:
+                next[nextCount++] = jumpTarget(ip, offset);
+                next[nextCount++] = offset + 3;
+                break;
+            default:
+                next[nextCount++] = offset + instructionLength(ip[0]);
+                break;
+        }
+        for (int i = 0; valid && i < nextCount; i++) {
+            int target = next[i];
+            // running off the end counts as landing in the middle of an instruction
+            if (target < 0 || target >= count || depths[target] == NOT_AN_INSTRUCTION) {
+                valid = false;
+            } else if (depths[target] == NOT_REACHED) {
+                depths[target] = depth;
+                pending[pendingCount++] = target;
+            } else {
+                valid = depths[target] == depth;
+            }
+        }
+    }
+    free(depths);
+    return valid;
+}
@@ -10,21 +10,32 @@
 // [01] <- opcode   opcode->[00][21]<-constant index
 // (1 byte)                 (2 bytes)
 // each opcodes determines how many operand bytes it has, and also what they mean.
+//
+// Anything that takes a constant index or a local slot also has a _LONG form whose
+// operand is 3 bytes (most significant first) instead of 1, the compiler only uses
+// them once an index no longer fits in a byte, so small scripts pay nothing for them
+// OP_CONSTANT_LONG
+// [01][00][01][2c] <- constant index 300
 typedef enum {
     OP_CONSTANT,
+    OP_CONSTANT_LONG,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_POP,
     OP_GET_LOCAL,
+    OP_GET_LOCAL_LONG,
     OP_SET_LOCAL,
+    OP_SET_LOCAL_LONG,
     OP_SET_GLOBAL,
+    OP_SET_GLOBAL_LONG,
     OP_GET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
     OP_DEFINE_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
-    OP_CONSTANT_LONG,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -32,9 +43,106 @@ typedef enum {
     OP_NOT,
     OP_NEGATE,
     OP_PRINT,
+    // jumps take a 2 byte offset, most significant first, counted from the end of the
+    // instruction
+    OP_JUMP,
+    OP_JUMP_IF_FALSE,
+    // jumps backwards by its 2 byte offset without counting anything
+    OP_JUMP_BACK,
+    // The back edge of a loop, a 2 byte offset backwards followed by the 2 byte index
+    // of the loop's counter
+    // [OP_LOOP][offset][offset][loop][loop]
+    OP_LOOP,
+    // calls the value below its 1 byte argument count of arguments on the stack
+    OP_CALL,
+    // makes an array out of the number of values given by its 1 byte operand
+    OP_ARRAY,
+    // [array][index] -> the element
+    OP_GET_INDEX,
+    // [array][index][value] -> value, which is stored in the element
+    OP_SET_INDEX,
     OP_RETURN,
+    // The compiler never emits these. The VM rewrites a generic arithmetic instruction
+    // into one of them once it has seen what its operands are, _INT for two ints, _NUM
+    // for two doubles and _STR for two strings. If they ever see anything else they
+    // turn back into the generic instruction
+    OP_ADD_INT,
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_INT,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_INT,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_INT,
+    OP_DIVIDE_NUM,
+    OP_GREATER_INT,
+    OP_GREATER_NUM,
+    OP_LESS_INT,
+    OP_LESS_NUM,
+    // The compiler emits these when it can prove both operands are numbers, so they
+    // never check their types, they only pick between int and double arithmetic
+    OP_ADD_NUMBERS,
+    OP_SUBTRACT_NUMBERS,
+    OP_MULTIPLY_NUMBERS,
+    OP_DIVIDE_NUMBERS,
+    OP_GREATER_NUMBERS,
+    OP_LESS_NUMBERS,
+    OP_NEGATE_NUMBER,
 } OpCode;
 
+// How many bytes the instruction takes up, operands included
+static inline int instructionLength(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_CALL:
+        case OP_ARRAY:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_BACK:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_SET_LOCAL_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+            return 4;
+        case OP_LOOP:
+            return 5;
+        default:
+            return 1;
+    }
+}
+
+// The constant index or local slot of an instruction that has one, whichever width it
+// is. Only ask for the operands an instruction actually has, the last instruction in a
+// chunk has nothing after it
+static inline int instructionOperand(const uint8_t* ip) {
+    return instructionLength(ip[0]) == 4 ? (ip[1] << 16) | (ip[2] << 8) | ip[3] : ip[1];
+}
+
+// the 2 byte offset of a jump or loop
+static inline int jumpOffset(const uint8_t* ip) {
+    return (ip[1] << 8) | ip[2];
+}
+
+// once a loop has gone round this many times we consider it hot
+#define HOT_LOOP_THRESHOLD 1000
+
+// Rather than storing a line number for every byte of code we store one entry per run
+// of bytes that came from the same line, the line of an offset is then the line of the
+// last run starting at or before it
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 typedef struct {
     // the number of elements in the array that are actually in use
     int count;
@@ -44,8 +152,23 @@ typedef struct {
     // therefore a pointer is needed, which we will then use to create
     // a dynamic array
     uint8_t* code;
-    int* lines;
+    int lineCount;
+    int lineCapacity;
+    LineStart* lines;
     ValueArray constants;
+    // One counter per loop, bumped each time the loop goes round. They are never part
+    // of a bytecode cache so they always live on our heap, even for a mapped chunk
+    int loopCount;
+    int loopCapacity;
+    uint64_t* loopCounters;
+    // when a chunk is loaded from a bytecode cache, code and lines point straight into
+    // the mapped cache file instead of our heap, freeing the chunk unmaps it
+    void* mapping;
+    size_t mappingSize;
+    // A frozen chunk belongs to a Script that several VMs may be running at once, so
+    // the VM never writes to it, its instructions aren't quickened and its loops
+    // aren't counted
+    bool frozen;
 } Chunk;
 
 void initChunk(Chunk* chunk);
@@ -53,5 +176,16 @@ void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
 void writeConstant(Chunk* chunk, Value value, int line);
+int getLine(Chunk* chunk, int offset);
+// adds a counter for a new loop and returns its index
+int addLoop(Chunk* chunk);
+// Checks the bytecode of a function that came from a file rather than from the
+// compiler. Every instruction has to fit in the chunk, and every constant, global name
+// and loop counter it names has to exist. Every jump has to land on the start of an
+// instruction, and no path may run off the end. Along every path the stack has to stay
+// within the arity + 1 slots the function starts with and the maxSlots it asks for,
+// with locals below the top. Returns false for anything the VM could read, write or
+// jump outside of
+bool verifyChunk(Chunk* chunk, int arity, int maxSlots);
 
 #endif
@@ -0,0 +1,596 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CLOX_X86_KERNELS
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+// ---------------------------------------------------------------------------------
+// Scalar kernels, these work everywhere and are what we fall back to
+// ---------------------------------------------------------------------------------
+
+static const char* skipBlanksScalar(const char* p) {
+    while (*p == ' ' || *p == '\r' || *p == '\t') p++;
+    return p;
+}
+
+static const char* skipToLineEndScalar(const char* p) {
+    while (*p != '\n' && *p != '\0') p++;
+    return p;
+}
+
+// FNV-1a, simple and good enough, but it consumes one byte at a time
+static uint32_t hashStringScalar(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static bool bytesEqualScalar(const char* a, const char* b, int length) {
+    return memcmp(a, b, length) == 0;
+}
+
+static double sumDoublesScalar(const double* values, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += values[i];
+    return sum;
+}
+
+static double dotDoublesScalar(const double* a, const double* b, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static void scaleDoublesScalar(double* values, int count, double factor) {
+    for (int i = 0; i < count; i++) values[i] *= factor;
+}
+
+static void addDoublesScalar(double* into, const double* from, int count) {
+    for (int i = 0; i < count; i++) into[i] += from[i];
+}
+
+static double minDoublesScalar(const double* values, int count) {
+    double min = values[0];
+    for (int i = 1; i < count; i++) {
+        if (values[i] < min) min = values[i];
+    }
+    return min;
+}
+
+static double maxDoublesScalar(const double* values, int count) {
+    double max = values[0];
+    for (int i = 1; i < count; i++) {
+        if (values[i] > max) max = values[i];
+    }
+    return max;
+}
+
+// before initCpuDispatch() runs we want the table to be usable, so it starts out
+// pointing at the scalar versions
+CpuKernels kernels = {
+    CPU_SCALAR,
+    skipBlanksScalar,
+    skipToLineEndScalar,
+    hashStringScalar,
+    bytesEqualScalar,
+    sumDoublesScalar,
+    dotDoublesScalar,
+    scaleDoublesScalar,
+    addDoublesScalar,
+    minDoublesScalar,
+    maxDoublesScalar,
+};
+
+#ifdef CLOX_X86_KERNELS
+// ---------------------------------------------------------------------------------
+// x86 vector kernels, each one is compiled for its own target with the target
+// attribute so the rest of the binary stays baseline x86-64
+// ---------------------------------------------------------------------------------
+
+// compares two blocks shorter than 16 bytes, the loads overlap rather than reading
+// past the end of either buffer
+static inline bool smallBytesEqual(const char* a, const char* b, int length) {
+    if (length >= 8) {
+        uint64_t x0, y0, x1, y1;
+        memcpy(&x0, a, 8);
+        memcpy(&y0, b, 8);
+        memcpy(&x1, a + length - 8, 8);
+        memcpy(&y1, b + length - 8, 8);
+        return ((x0 ^ y0) | (x1 ^ y1)) == 0;
+    }
+    if (length >= 4) {
+        uint32_t x0, y0, x1, y1;
+        memcpy(&x0, a, 4);
+        memcpy(&y0, b, 4);
+        memcpy(&x1, a + length - 4, 4);
+        memcpy(&y1, b + length - 4, 4);
+        return ((x0 ^ y0) | (x1 ^ y1)) == 0;
+    }
+    for (int i = 0; i < length; i++) {
+        if (a[i] != b[i]) return false;
+    }
+    return true;
+}
+
+// The scanning kernels rely on the source being '\0' terminated and only ever do
+// aligned loads. An aligned load can never cross into the next page, so reading a
+// few bytes before p or past the terminator can't fault, we just mask those lanes off.
+// Those bytes are still outside the buffer as far as AddressSanitizer is concerned,
+// so the kernels aren't instrumented, or no ASAN build could scan a REPL line or a
+// streamed block without CLOX_CPU=scalar
+#define SCAN_KERNEL __attribute__((no_sanitize_address))
+
+__attribute__((target("sse4.2")))
+SCAN_KERNEL static const char* skipBlanksSse42(const char* p) {
+    uintptr_t offset = (uintptr_t)p & 15;
+    const __m128i* block = (const __m128i*)(p - offset);
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    // only the lanes at or after p count on the first block
+    uint32_t live = (0xFFFFu << offset) & 0xFFFFu;
+    for (;;) {
+        __m128i chunk = _mm_load_si128(block);
+        __m128i blank = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                                                  _mm_cmpeq_epi8(chunk, tab)),
+                                     _mm_cmpeq_epi8(chunk, cr));
+        uint32_t other = ~(uint32_t)_mm_movemask_epi8(blank) & live;
+        if (other != 0) return (const char*)block + __builtin_ctz(other);
+        live = 0xFFFFu;
+        block++;
+    }
+}
+
+__attribute__((target("sse4.2")))
+SCAN_KERNEL static const char* skipToLineEndSse42(const char* p) {
+    uintptr_t offset = (uintptr_t)p & 15;
+    const __m128i* block = (const __m128i*)(p - offset);
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t live = (0xFFFFu << offset) & 0xFFFFu;
+    for (;;) {
+        __m128i chunk = _mm_load_si128(block);
+        __m128i end = _mm_or_si128(_mm_cmpeq_epi8(chunk, newline),
+                                   _mm_cmpeq_epi8(chunk, zero));
+        uint32_t found = (uint32_t)_mm_movemask_epi8(end) & live;
+        if (found != 0) return (const char*)block + __builtin_ctz(found);
+        live = 0xFFFFu;
+        block++;
+    }
+}
+
+// SSE4.2 gives us a CRC32C instruction which chews through 8 bytes per cycle, far
+// quicker than FNV's byte at a time loop on anything longer than a short identifier
+__attribute__((target("sse4.2")))
+static uint32_t hashStringCrc32(const char* key, int length) {
+    uint64_t crc = 0xFFFFFFFFu;
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, key + i, 8);
+        crc = _mm_crc32_u64(crc, word);
+    }
+    uint32_t hash = (uint32_t)crc;
+    if (i + 4 <= length) {
+        uint32_t word;
+        memcpy(&word, key + i, 4);
+        hash = _mm_crc32_u32(hash, word);
+        i += 4;
+    }
+    for (; i < length; i++) hash = _mm_crc32_u8(hash, (uint8_t)key[i]);
+
+    // the table indexes with the low bits of the hash, so finish with murmur3's
+    // avalanche step to spread the crc's bits around
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+__attribute__((target("sse4.2")))
+static bool bytesEqualSse42(const char* a, const char* b, int length) {
+    if (length < 16) return smallBytesEqual(a, b, length);
+    for (int i = 0; i + 16 < length; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF) return false;
+    }
+    // the final block overlaps the previous one instead of running off the end
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + length - 16));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + length - 16));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+}
+
+__attribute__((target("avx2")))
+SCAN_KERNEL static const char* skipBlanksAvx2(const char* p) {
+    uintptr_t offset = (uintptr_t)p & 31;
+    const __m256i* block = (const __m256i*)(p - offset);
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    uint32_t live = 0xFFFFFFFFu << offset;
+    for (;;) {
+        __m256i chunk = _mm256_load_si256(block);
+        __m256i blank = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, space),
+                                                        _mm256_cmpeq_epi8(chunk, tab)),
+                                        _mm256_cmpeq_epi8(chunk, cr));
+        uint32_t other = ~(uint32_t)_mm256_movemask_epi8(blank) & live;
+        if (other != 0) return (const char*)block + __builtin_ctz(other);
+        live = 0xFFFFFFFFu;
+        block++;
+    }
+}
+
+__attribute__((target("avx2")))
+SCAN_KERNEL static const char* skipToLineEndAvx2(const char* p) {
+    uintptr_t offset = (uintptr_t)p & 31;
+    const __m256i* block = (const __m256i*)(p - offset);
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t live = 0xFFFFFFFFu << offset;
+    for (;;) {
+        __m256i chunk = _mm256_load_si256(block);
+        __m256i end = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline),
+                                      _mm256_cmpeq_epi8(chunk, zero));
+        uint32_t found = (uint32_t)_mm256_movemask_epi8(end) & live;
+        if (found != 0) return (const char*)block + __builtin_ctz(found);
+        live = 0xFFFFFFFFu;
+        block++;
+    }
+}
+
+__attribute__((target("avx2")))
+static bool bytesEqualAvx2(const char* a, const char* b, int length) {
+    if (length < 32) return bytesEqualSse42(a, b, length);
+    for (int i = 0; i + 32 < length; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xFFFFFFFFu) {
+            return false;
+        }
+    }
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + length - 32));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(b + length - 32));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) == 0xFFFFFFFFu;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+SCAN_KERNEL static const char* skipBlanksAvx512(const char* p) {
+    uintptr_t offset = (uintptr_t)p & 63;
+    const __m512i* block = (const __m512i*)(p - offset);
+    const __m512i space = _mm512_set1_epi8(' ');
+    const __m512i tab = _mm512_set1_epi8('\t');
+    const __m512i cr = _mm512_set1_epi8('\r');
+    uint64_t live = ~0ull << offset;
+    for (;;) {
+        __m512i chunk = _mm512_load_si512(block);
+        uint64_t blank = _mm512_cmpeq_epi8_mask(chunk, space) |
+                         _mm512_cmpeq_epi8_mask(chunk, tab) |
+                         _mm512_cmpeq_epi8_mask(chunk, cr);
+        uint64_t other = ~blank & live;
+        if (other != 0) return (const char*)block + __builtin_ctzll(other);
+        live = ~0ull;
+        block++;
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+SCAN_KERNEL static const char* skipToLineEndAvx512(const char* p) {
+    uintptr_t offset = (uintptr_t)p & 63;
+    const __m512i* block = (const __m512i*)(p - offset);
+    const __m512i newline = _mm512_set1_epi8('\n');
+    uint64_t live = ~0ull << offset;
+    for (;;) {
+        __m512i chunk = _mm512_load_si512(block);
+        uint64_t found = (_mm512_cmpeq_epi8_mask(chunk, newline) |
+                          _mm512_testn_epi8_mask(chunk, chunk)) & live;
+        if (found != 0) return (const char*)block + __builtin_ctzll(found);
+        live = ~0ull;
+        block++;
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static bool bytesEqualAvx512(const char* a, const char* b, int length) {
+    if (length < 64) return bytesEqualAvx2(a, b, length);
+    for (int i = 0; i + 64 < length; i += 64) {
+        __m512i x = _mm512_loadu_si512(a + i);
+        __m512i y = _mm512_loadu_si512(b + i);
+        if (_mm512_cmpneq_epi8_mask(x, y) != 0) return false;
+    }
+    __m512i x = _mm512_loadu_si512(a + length - 64);
+    __m512i y = _mm512_loadu_si512(b + length - 64);
+    return _mm512_cmpneq_epi8_mask(x, y) == 0;
+}
+
+// The array kernels. SSE only fits two doubles in a register, which isn't enough to
+// beat the scalar loops by much, so only the AVX levels get their own versions. Each
+// keeps two accumulators going so one add doesn't have to wait on the one before it,
+// and finishes off whatever doesn't fill a whole vector one element at a time
+
+__attribute__((target("avx2")))
+static double horizontalSumAvx2(__m256d vector) {
+    __m128d low = _mm256_castpd256_pd128(vector);
+    __m128d high = _mm256_extractf128_pd(vector, 1);
+    low = _mm_add_pd(low, high);
+    return _mm_cvtsd_f64(_mm_add_sd(low, _mm_unpackhi_pd(low, low)));
+}
+
+__attribute__((target("avx2")))
+static double sumDoublesAvx2(const double* values, int count) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_loadu_pd(values + i));
+        sum1 = _mm256_add_pd(sum1, _mm256_loadu_pd(values + i + 4));
+    }
+    double sum = horizontalSumAvx2(_mm256_add_pd(sum0, sum1));
+    for (; i < count; i++) sum += values[i];
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static double dotDoublesAvx2(const double* a, const double* b, int count) {
+    __m256d sum0 = _mm256_setzero_pd();
+    __m256d sum1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                 _mm256_loadu_pd(b + i)));
+        sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                                 _mm256_loadu_pd(b + i + 4)));
+    }
+    double sum = horizontalSumAvx2(_mm256_add_pd(sum0, sum1));
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static void scaleDoublesAvx2(double* values, int count, double factor) {
+    __m256d scale = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(values + i, _mm256_mul_pd(_mm256_loadu_pd(values + i), scale));
+    }
+    for (; i < count; i++) values[i] *= factor;
+}
+
+__attribute__((target("avx2")))
+static void addDoublesAvx2(double* into, const double* from, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(into + i, _mm256_add_pd(_mm256_loadu_pd(into + i),
+                                                 _mm256_loadu_pd(from + i)));
+    }
+    for (; i < count; i++) into[i] += from[i];
+}
+
+// min and max only start on vectors once there's a whole one, so the first element
+// seeds every lane and the scalar tail can carry on from the reduced result
+__attribute__((target("avx2")))
+static double minDoublesAvx2(const double* values, int count) {
+    if (count < 4) return minDoublesScalar(values, count);
+    __m256d min = _mm256_loadu_pd(values);
+    int i = 4;
+    for (; i + 4 <= count; i += 4) min = _mm256_min_pd(min, _mm256_loadu_pd(values + i));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, min);
+    double result = minDoublesScalar(lanes, 4);
+    for (; i < count; i++) {
+        if (values[i] < result) result = values[i];
+    }
+    return result;
+}
+
+__attribute__((target("avx2")))
+static double maxDoublesAvx2(const double* values, int count) {
+    if (count < 4) return maxDoublesScalar(values, count);
+    __m256d max = _mm256_loadu_pd(values);
+    int i = 4;
+    for (; i + 4 <= count; i += 4) max = _mm256_max_pd(max, _mm256_loadu_pd(values + i));
+    double lanes[4];
+    _mm256_storeu_pd(lanes, max);
+    double result = maxDoublesScalar(lanes, 4);
+    for (; i < count; i++) {
+        if (values[i] > result) result = values[i];
+    }
+    return result;
+}
+
+__attribute__((target("avx512f")))
+static double sumDoublesAvx512(const double* values, int count) {
+    __m512d sum0 = _mm512_setzero_pd();
+    __m512d sum1 = _mm512_setzero_pd();
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        sum0 = _mm512_add_pd(sum0, _mm512_loadu_pd(values + i));
+        sum1 = _mm512_add_pd(sum1, _mm512_loadu_pd(values + i + 8));
+    }
+    // the tail is a masked load, the lanes past the end read as zero
+    if (i + 8 <= count) {
+        sum0 = _mm512_add_pd(sum0, _mm512_loadu_pd(values + i));
+        i += 8;
+    }
+    __mmask8 tail = (__mmask8)((1u << (count - i)) - 1);
+    sum1 = _mm512_add_pd(sum1, _mm512_maskz_loadu_pd(tail, values + i));
+    return _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+}
+
+__attribute__((target("avx512f")))
+static double dotDoublesAvx512(const double* a, const double* b, int count) {
+    __m512d sum0 = _mm512_setzero_pd();
+    __m512d sum1 = _mm512_setzero_pd();
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        sum0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), sum0);
+        sum1 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i + 8), _mm512_loadu_pd(b + i + 8),
+                               sum1);
+    }
+    if (i + 8 <= count) {
+        sum0 = _mm512_fmadd_pd(_mm512_loadu_pd(a + i), _mm512_loadu_pd(b + i), sum0);
+        i += 8;
+    }
+    __mmask8 tail = (__mmask8)((1u << (count - i)) - 1);
+    sum1 = _mm512_fmadd_pd(_mm512_maskz_loadu_pd(tail, a + i),
+                           _mm512_maskz_loadu_pd(tail, b + i), sum1);
+    return _mm512_reduce_add_pd(_mm512_add_pd(sum0, sum1));
+}
+
+__attribute__((target("avx512f")))
+static void scaleDoublesAvx512(double* values, int count, double factor) {
+    __m512d scale = _mm512_set1_pd(factor);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm512_storeu_pd(values + i, _mm512_mul_pd(_mm512_loadu_pd(values + i), scale));
+    }
+    __mmask8 tail = (__mmask8)((1u << (count - i)) - 1);
+    _mm512_mask_storeu_pd(values + i, tail,
+                          _mm512_mul_pd(_mm512_maskz_loadu_pd(tail, values + i), scale));
+}
+
+__attribute__((target("avx512f")))
+static void addDoublesAvx512(double* into, const double* from, int count) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm512_storeu_pd(into + i, _mm512_add_pd(_mm512_loadu_pd(into + i),
+                                                 _mm512_loadu_pd(from + i)));
+    }
+    __mmask8 tail = (__mmask8)((1u << (count - i)) - 1);
+    _mm512_mask_storeu_pd(into + i, tail,
+                          _mm512_add_pd(_mm512_maskz_loadu_pd(tail, into + i),
+                                        _mm512_maskz_loadu_pd(tail, from + i)));
+}
+
+// AVX-512's min and max reductions are no faster than AVX2's once the data has to
+// come from memory, so those two stay on the AVX2 versions
+
+static uint64_t readXcr0() {
+    uint32_t low, high;
+    __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    return ((uint64_t)high << 32) | low;
+}
+
+static CpuLevel detectCpuLevel() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return CPU_SCALAR;
+    if (!(ecx & bit_SSE4_2)) return CPU_SCALAR;
+
+    // the CPU supporting AVX isn't enough, the OS also has to save the wider
+    // registers on a context switch, which is what XCR0 tells us
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)) return CPU_SSE42;
+    uint64_t xcr0 = readXcr0();
+    // bits 1 and 2 are the SSE and AVX state
+    if ((xcr0 & 0x6) != 0x6) return CPU_SSE42;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return CPU_SSE42;
+    if (!(ebx & bit_AVX2)) return CPU_SSE42;
+
+    // bits 5 to 7 are the opmask and the upper halves of the zmm registers
+    if ((xcr0 & 0xE0) == 0xE0 && (ebx & bit_AVX512F) && (ebx & bit_AVX512BW)) {
+        return CPU_AVX512;
+    }
+    return CPU_AVX2;
+}
+#else
+static CpuLevel detectCpuLevel() {
+    return CPU_SCALAR;
+}
+#endif
+
+const char* cpuLevelName(CpuLevel level) {
+    switch (level) {
+        case CPU_SCALAR: return "scalar";
+        case CPU_SSE42: return "sse4.2";
+        case CPU_AVX2: return "avx2";
+        case CPU_AVX512: return "avx512";
+    }
+    return "unknown"; // unreachable
+}
+
+// reads the CLOX_CPU override, returning the highest level we are allowed to use
+static CpuLevel levelOverride() {
+    const char* name = getenv("CLOX_CPU");
+    if (name == NULL || name[0] == '\0') return CPU_AVX512;
+    for (int level = CPU_SCALAR; level <= CPU_AVX512; level++) {
+        if (strcmp(name, cpuLevelName((CpuLevel)level)) == 0) return (CpuLevel)level;
+    }
+    fprintf(stderr, "Unknown CLOX_CPU level \"%s\", ignoring it.\n", name);
+    return CPU_AVX512;
+}
+
+static void bindKernels() {
+    CpuLevel level = detectCpuLevel();
+    CpuLevel limit = levelOverride();
+    if (level > limit) level = limit;
+
+    kernels.level = level;
+    kernels.skipBlanks = skipBlanksScalar;
+    kernels.skipToLineEnd = skipToLineEndScalar;
+    kernels.hashString = hashStringScalar;
+    kernels.bytesEqual = bytesEqualScalar;
+    kernels.sumDoubles = sumDoublesScalar;
+    kernels.dotDoubles = dotDoublesScalar;
+    kernels.scaleDoubles = scaleDoublesScalar;
+    kernels.addDoubles = addDoublesScalar;
+    kernels.minDoubles = minDoublesScalar;
+    kernels.maxDoubles = maxDoublesScalar;
+
+#ifdef CLOX_X86_KERNELS
+    switch (level) {
+        case CPU_AVX512:
+            kernels.skipBlanks = skipBlanksAvx512;
+            kernels.skipToLineEnd = skipToLineEndAvx512;
+            kernels.hashString = hashStringCrc32;
+            kernels.bytesEqual = bytesEqualAvx512;
+            kernels.sumDoubles = sumDoublesAvx512;
+            kernels.dotDoubles = dotDoublesAvx512;
+            kernels.scaleDoubles = scaleDoublesAvx512;
+            kernels.addDoubles = addDoublesAvx512;
+            kernels.minDoubles = minDoublesAvx2;
+            kernels.maxDoubles = maxDoublesAvx2;
+            break;
+        case CPU_AVX2:
+            kernels.skipBlanks = skipBlanksAvx2;
+            kernels.skipToLineEnd = skipToLineEndAvx2;
+            kernels.hashString = hashStringCrc32;
+            kernels.bytesEqual = bytesEqualAvx2;
+            kernels.sumDoubles = sumDoublesAvx2;
+            kernels.dotDoubles = dotDoublesAvx2;
+            kernels.scaleDoubles = scaleDoublesAvx2;
+            kernels.addDoubles = addDoublesAvx2;
+            kernels.minDoubles = minDoublesAvx2;
+            kernels.maxDoubles = maxDoublesAvx2;
+            break;
+        case CPU_SSE42:
+            kernels.skipBlanks = skipBlanksSse42;
+            kernels.skipToLineEnd = skipToLineEndSse42;
+            kernels.hashString = hashStringCrc32;
+            kernels.bytesEqual = bytesEqualSse42;
+            break;
+        case CPU_SCALAR:
+            break;
+    }
+#endif
+}
+
+// every VM calls this as it starts, possibly on several threads at once, but the
+// table is only ever written the first time so a VM never sees a kernel change
+// underneath it and every string is hashed the same way
+static pthread_once_t dispatchOnce = PTHREAD_ONCE_INIT;
+
+void initCpuDispatch() {
+    pthread_once(&dispatchOnce, bindKernels);
+}
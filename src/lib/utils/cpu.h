@@ -0,0 +1,54 @@
+#ifndef clox_cpu_h
+#define clox_cpu_h
+
+#include "common.h"
+
+// The instruction set levels we know how to take advantage of, each one is a
+// superset of the one before it, so the detected level is simply the highest one
+// both the CPU and the OS support
+typedef enum {
+    CPU_SCALAR,
+    CPU_SSE42,
+    CPU_AVX2,
+    CPU_AVX512,
+} CpuLevel;
+
+// The hot kernels the scanner and the string table spend most of their time in, and
+// the bulk operations on arrays of numbers.
+// Every build carries a plain C version of each of these plus vector versions,
+// and initCpuDispatch() points this table at the best ones for the machine we are
+// actually running on, that way a single binary runs well on the whole fleet
+typedef struct {
+    CpuLevel level;
+    // returns a pointer to the first character that isn't a space, tab or '\r'
+    const char* (*skipBlanks)(const char* p);
+    // returns a pointer to the first '\n' or '\0' at or after p, used for comments
+    const char* (*skipToLineEnd)(const char* p);
+    // the hash used for interning, note that the vector version produces different
+    // hashes to the scalar one, so hashes must never outlive the process
+    uint32_t (*hashString)(const char* key, int length);
+    // same as memcmp(a, b, length) == 0
+    bool (*bytesEqual)(const char* a, const char* b, int length);
+    // The vector versions add up in a different order to the scalar ones, so sums
+    // and dot products can differ in their last bits between CPU levels
+    double (*sumDoubles)(const double* values, int count);
+    double (*dotDoubles)(const double* a, const double* b, int count);
+    // values[i] *= factor
+    void (*scaleDoubles)(double* values, int count, double factor);
+    // into[i] += from[i]
+    void (*addDoubles)(double* into, const double* from, int count);
+    // count must be at least 1
+    double (*minDoubles)(const double* values, int count);
+    double (*maxDoubles)(const double* values, int count);
+} CpuKernels;
+
+extern CpuKernels kernels;
+
+// Detects the CPU features via cpuid and binds the kernels, setting the CLOX_CPU
+// environment variable to "scalar", "sse4.2", "avx2" or "avx512" caps the level
+// that will be used, which is handy for testing the fallbacks on a fast machine.
+// Only the first call does anything, so it's safe to call from every thread
+void initCpuDispatch();
+const char* cpuLevelName(CpuLevel level);
+
+#endif
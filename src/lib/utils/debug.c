@@ -32,7 +32,10 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
 }
 
 static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 3];
+    // the index is spread over the next 3 bytes, most significant first
+    int constant = (chunk->code[offset + 1] << 16) |
+                   (chunk->code[offset + 2] << 8) |
+                   chunk->code[offset + 3];
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
@@ -40,7 +43,6 @@ static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 4;
 }
 
-
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -53,14 +55,37 @@ static int byteInstruction(const char* name, Chunk* chunk,
   return offset + 2;
 }
 
+static int byteLongInstruction(const char* name, Chunk* chunk, int offset) {
+    int slot = (chunk->code[offset + 1] << 16) |
+               (chunk->code[offset + 2] << 8) |
+               chunk->code[offset + 3];
+    printf("%-16s %4d\n", name, slot);
+    return offset + 4;
+}
+
+// shows where a jump lands rather than its raw offset, sign is -1 for backward jumps
+static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
+    jump |= chunk->code[offset + 2];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+    return offset + 3;
+}
+
+static int loopInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    int loop = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+    printf("%-16s %4d -> %d loop %d\n", name, offset, offset + 5 - jump, loop);
+    return offset + 5;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
 
     // this basically checks if the source code line is the same as the previous one
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    if (offset > 0 && getLine(chunk, offset) == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", getLine(chunk, offset));
     }
 
     // This gets a single byte from the bytecode at the given offset, which we
@@ -70,6 +95,8 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     {
     case OP_CONSTANT:
         return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_CONSTANT_LONG:
+        return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
     case OP_NIL:
         return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
@@ -80,20 +107,30 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         return simpleInstruction("OP_POP", offset);
     case OP_GET_LOCAL:
         return byteInstruction("OP_GET_LOCAL", chunk, offset);
+    case OP_GET_LOCAL_LONG:
+        return byteLongInstruction("OP_GET_LOCAL_LONG", chunk, offset);
     case OP_SET_LOCAL:
         return byteInstruction("OP_SET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL_LONG:
+        return byteLongInstruction("OP_SET_LOCAL_LONG", chunk, offset);
     case OP_DEFINE_GLOBAL:
         return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+        return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
     case OP_EQUAL:
         return simpleInstruction("OP_EQUAL", offset);
     case OP_GET_GLOBAL:
         return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+        return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+    case OP_SET_GLOBAL:
+        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+        return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
     case OP_GREATER:
         return simpleInstruction("OP_GREATER", offset);
     case OP_LESS:
         return simpleInstruction("OP_LESS", offset);
-    case OP_CONSTANT_LONG:
-        return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
     case OP_ADD:
         return simpleInstruction("OP_ADD", offset);
     case OP_SUBTRACT:
@@ -108,11 +145,75 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         return simpleInstruction("OP_NEGATE", offset);
     case OP_PRINT:
         return simpleInstruction("OP_PRINT", offset);
+    case OP_JUMP:
+        return jumpInstruction("OP_JUMP", 1, chunk, offset);
+    case OP_JUMP_IF_FALSE:
+        return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+    case OP_JUMP_BACK:
+        return jumpInstruction("OP_JUMP_BACK", -1, chunk, offset);
+    case OP_LOOP:
+        return loopInstruction("OP_LOOP", chunk, offset);
+    case OP_CALL:
+        return byteInstruction("OP_CALL", chunk, offset);
+    case OP_ARRAY:
+        return byteInstruction("OP_ARRAY", chunk, offset);
+    case OP_GET_INDEX:
+        return simpleInstruction("OP_GET_INDEX", offset);
+    case OP_SET_INDEX:
+        return simpleInstruction("OP_SET_INDEX", offset);
     case OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
+    case OP_ADD_INT:
+        return simpleInstruction("OP_ADD_INT", offset);
+    case OP_ADD_NUM:
+        return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+        return simpleInstruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_INT:
+        return simpleInstruction("OP_SUBTRACT_INT", offset);
+    case OP_SUBTRACT_NUM:
+        return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_INT:
+        return simpleInstruction("OP_MULTIPLY_INT", offset);
+    case OP_MULTIPLY_NUM:
+        return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_INT:
+        return simpleInstruction("OP_DIVIDE_INT", offset);
+    case OP_DIVIDE_NUM:
+        return simpleInstruction("OP_DIVIDE_NUM", offset);
+    case OP_GREATER_INT:
+        return simpleInstruction("OP_GREATER_INT", offset);
+    case OP_GREATER_NUM:
+        return simpleInstruction("OP_GREATER_NUM", offset);
+    case OP_LESS_INT:
+        return simpleInstruction("OP_LESS_INT", offset);
+    case OP_LESS_NUM:
+        return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_ADD_NUMBERS:
+        return simpleInstruction("OP_ADD_NUMBERS", offset);
+    case OP_SUBTRACT_NUMBERS:
+        return simpleInstruction("OP_SUBTRACT_NUMBERS", offset);
+    case OP_MULTIPLY_NUMBERS:
+        return simpleInstruction("OP_MULTIPLY_NUMBERS", offset);
+    case OP_DIVIDE_NUMBERS:
+        return simpleInstruction("OP_DIVIDE_NUMBERS", offset);
+    case OP_GREATER_NUMBERS:
+        return simpleInstruction("OP_GREATER_NUMBERS", offset);
+    case OP_LESS_NUMBERS:
+        return simpleInstruction("OP_LESS_NUMBERS", offset);
+    case OP_NEGATE_NUMBER:
+        return simpleInstruction("OP_NEGATE_NUMBER", offset);
     default:
         // On the off chance theres a compiler bug, we print that too
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
     }
 }
+
+void printLoopHotness(Chunk* chunk, const char* name) {
+    for (int loop = 0; loop < chunk->loopCount; loop++) {
+        uint64_t count = chunk->loopCounters[loop];
+        fprintf(stderr, "%s loop %d: %llu%s\n", name, loop, (unsigned long long)count,
+                count >= HOT_LOOP_THRESHOLD ? " (hot)" : "");
+    }
+}
@@ -5,5 +5,8 @@
 
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
+// writes how many times each loop in the chunk of the function called name went
+// round to stderr
+void printLoopHotness(Chunk* chunk, const char* name);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,15 @@
+#ifndef clox_format_h
+#define clox_format_h
+
+#include "common.h"
+
+// big enough for any number formatNumber writes, including the '\0'
+#define NUMBER_BUFFER_SIZE 32
+
+// Writes value into buffer using the fewest digits that still read back as exactly
+// the same double, laid out like printf's %g (plain up to 17 digits before the
+// point, exponent form beyond that or below 0.0001). Returns the length written
+int formatNumber(double value, char* buffer);
+int formatInteger(int64_t value, char* buffer);
+
+#endif
@@ -1,9 +1,10 @@
 #include <stdlib.h>
 
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "threaded.h"
 #include "value.h"
-#include "vm.h"
 
 // Although this returns a void* we are using the GROW_ARRAY macro to cast it back to a
 // chosen pointer type.
@@ -33,6 +34,27 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 
 static void freeObject(Obj* object) {
     switch (object->type) {
+        case OBJ_ARRAY: {
+            ObjArray* array = (ObjArray*)object;
+            FREE_ARRAY(double, array->values, array->capacity);
+            FREE(ObjArray, object);
+            break;
+        }
+        case OBJ_FIBER:
+            freeFiberStacks((ObjFiber*)object);
+            FREE(ObjFiber, object);
+            break;
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            freeChunk(&function->chunk);
+            if (function->jit != NULL) freeJit(function->jit);
+            if (function->threaded != NULL) freeThreaded(function->threaded);
+            FREE(ObjFunction, object);
+            break;
+        }
+        case OBJ_NATIVE:
+            FREE(ObjNative, object);
+            break;
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
             FREE_ARRAY(char, string->chars, string->length + 1);
@@ -42,11 +64,12 @@ static void freeObject(Obj* object) {
     }
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+void freeObjects(Heap* heap) {
+    Obj* object = heap->objects;
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
         object = next;
     }
+    heap->objects = NULL;
 }
@@ -28,6 +28,6 @@
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+void freeObjects(Heap* heap);
 
 #endif
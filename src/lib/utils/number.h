@@ -0,0 +1,14 @@
+#ifndef clox_number_h
+#define clox_number_h
+
+#include "common.h"
+
+// Turns the text of a number literal (digits with an optional fraction, exactly what
+// the scanner accepts) into the nearest double, giving bit for bit the same answer as
+// strtod. The text doesn't have to be '\0' terminated, only length bytes are looked at
+double parseNumber(const char* start, int length);
+// Parses a literal without a fraction as an integer. Returns false if it doesn't fit
+// in 64 bits, the caller then uses parseNumber instead
+bool parseInteger(const char* start, int length, int64_t* result);
+
+#endif
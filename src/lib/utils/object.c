@@ -1,72 +1,215 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 
+#include "cpu.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
+#include "threaded.h"
 #include "value.h"
-#include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(heap, type, objectType) \
+    (type*)allocateObject(heap, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
+void initHeap(Heap* heap) {
+    heap->objects = NULL;
+    initTable(&heap->strings);
+    heap->imageObjects = NULL;
+    heap->image = NULL;
+    heap->imageSize = 0;
+}
+
+void freeHeap(Heap* heap) {
+    freeTable(&heap->strings);
+    freeObjects(heap);
+    // the elements of the image's arrays were copied out so they could grow, and its
+    // functions may have been compiled or translated since, the rest of every image object is part
+    // of the mapping
+    for (Obj* object = heap->imageObjects; object != NULL; object = object->next) {
+        if (object->type == OBJ_ARRAY) {
+            ObjArray* array = (ObjArray*)object;
+            FREE_ARRAY(double, array->values, array->capacity);
+        } else if (object->type == OBJ_FUNCTION) {
+            ObjFunction* function = (ObjFunction*)object;
+            if (function->jit != NULL) freeJit(function->jit);
+            if (function->threaded != NULL) freeThreaded(function->threaded);
+        }
+    }
+    if (heap->image != NULL) munmap(heap->image, heap->imageSize);
+    heap->imageObjects = NULL;
+    heap->image = NULL;
+    heap->imageSize = 0;
+}
+
+static Obj* allocateObject(Heap* heap, size_t size, ObjType type) {
   Obj* object = (Obj*)reallocate(NULL, 0, size);
   object->type = type;
 
   // so we can track objects now, every time we allocate one we store it in the
   // objects list
-  object->next = vm.objects;
-  vm.objects = object;
+  object->next = heap->objects;
+  heap->objects = object;
   return object;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+ObjArray* newArray(Heap* heap, int count) {
+    ObjArray* array = ALLOCATE_OBJ(heap, ObjArray, OBJ_ARRAY);
+    array->count = 0;
+    array->capacity = 0;
+    array->values = NULL;
+    if (count > 0) {
+        array->values = ALLOCATE(double, count);
+        memset(array->values, 0, sizeof(double) * (size_t)count);
+        array->count = count;
+        array->capacity = count;
+    }
+    return array;
+}
+
+void appendArray(ObjArray* array, double value) {
+    if (array->capacity < array->count + 1) {
+        int oldCapacity = array->capacity;
+        array->capacity = GROW_CAPACITY(oldCapacity);
+        array->values = GROW_ARRAY(double, array->values, oldCapacity, array->capacity);
+    }
+    array->values[array->count++] = value;
+}
+
+void initFiber(ObjFiber* fiber) {
+    fiber->state = FIBER_NEW;
+    fiber->caller = NULL;
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = 0;
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->stackCapacity = 0;
+}
+
+void freeFiberStacks(ObjFiber* fiber) {
+    FREE_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity);
+    FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+    fiber->frames = NULL;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = 0;
+    fiber->stack = NULL;
+    fiber->stackTop = NULL;
+    fiber->stackCapacity = 0;
+}
+
+ObjFiber* newFiber(Heap* heap, ObjFunction* function) {
+    ObjFiber* fiber = ALLOCATE_OBJ(heap, ObjFiber, OBJ_FIBER);
+    initFiber(fiber);
+    // Just enough for the function's first call, most fibers never go deeper than a
+    // few calls and the stack grows if they do. The function sits in slot 0 like any
+    // other call, its argument (if it takes one) is pushed when it starts
+    fiber->frameCapacity = 4;
+    fiber->frames = ALLOCATE(CallFrame, fiber->frameCapacity);
+    fiber->stackCapacity = function->maxSlots;
+    fiber->stack = ALLOCATE(Value, fiber->stackCapacity);
+    fiber->stack[0] = OBJ_VAL(function);
+    fiber->stackTop = fiber->stack + 1;
+    CallFrame* frame = &fiber->frames[fiber->frameCount++];
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    frame->slots = fiber->stack;
+    return fiber;
+}
+
+ObjFunction* newFunction(Heap* heap) {
+    ObjFunction* function = ALLOCATE_OBJ(heap, ObjFunction, OBJ_FUNCTION);
+    function->arity = 0;
+    function->maxSlots = 0;
+    function->name = NULL;
+    function->calls = 0;
+    function->jit = NULL;
+    function->threaded = NULL;
+    initChunk(&function->chunk);
+    return function;
+}
+
+ObjNative* newNative(Heap* heap, NativeFn function, int arity, ObjString* name) {
+    ObjNative* native = ALLOCATE_OBJ(heap, ObjNative, OBJ_NATIVE);
+    native->function = function;
+    native->arity = arity;
+    native->name = name;
+    return native;
+}
+
+static ObjString* allocateString(Heap* heap, char* chars, int length, uint32_t hash) {
+    ObjString* string = ALLOCATE_OBJ(heap, ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);
+    tableSet(&heap->strings, string, NIL_VAL);
     return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
-}
-
-ObjString* takeString(char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,
+ObjString* takeString(Heap* heap, char* chars, int length) {
+  uint32_t hash = kernels.hashString(chars, length);
+  ObjString* interned = tableFindString(&heap->strings, chars, length,
                                         hash);
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length + 1);
     return interned;
   }
 
-  return allocateString(chars, length, hash);
+  return allocateString(heap, chars, length, hash);
 }
 
 
-ObjString* copyString(const char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length,
+ObjString* copyString(Heap* heap, const char* chars, int length) {
+  uint32_t hash = kernels.hashString(chars, length);
+  ObjString* interned = tableFindString(&heap->strings, chars, length,
                                         hash);
   if (interned != NULL) return interned;
 
   char* heapChars = ALLOCATE(char, length + 1);
   memcpy(heapChars, chars, length);
   heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  return allocateString(heap, heapChars, length, hash);
+}
+
+bool stringsEqual(ObjString* a, ObjString* b) {
+  if (a == b) return true;
+  return a->hash == b->hash && a->length == b->length &&
+         kernels.bytesEqual(a->chars, b->chars, a->length);
+}
+
+static void printFunction(ObjFunction* function) {
+    if (function->name == NULL) {
+        printf("<script>");
+        return;
+    }
+    printf("<fn %s>", function->name->chars);
+}
+
+static void printArray(ObjArray* array) {
+    printf("[");
+    for (int i = 0; i < array->count; i++) {
+        if (i > 0) printf(", ");
+        printValue(NUMBER_VAL(array->values[i]));
+    }
+    printf("]");
 }
 
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
+        case OBJ_ARRAY:
+            printArray(AS_ARRAY(value));
+            break;
+        case OBJ_FIBER:
+            printf("<fiber>");
+            break;
+        case OBJ_FUNCTION:
+            printFunction(AS_FUNCTION(value));
+            break;
+        case OBJ_NATIVE:
+            printf("<native fn %s>", AS_NATIVE(value)->name->chars);
+            break;
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
@@ -1,18 +1,32 @@
 #ifndef clox_object_h
 #define clox_object_h
 
+#include "chunk.h"
 #include "common.h"
+#include "table.h"
 #include "value.h"
 #include <stdint.h>
 
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
 
+#define IS_ARRAY(value)        isObjType(value, OBJ_ARRAY)
+#define IS_FIBER(value)        isObjType(value, OBJ_FIBER)
+#define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
+#define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 
+#define AS_ARRAY(value)        ((ObjArray*)AS_OBJ(value))
+#define AS_FIBER(value)        ((ObjFiber*)AS_OBJ(value))
+#define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
 typedef enum {
+    OBJ_ARRAY,
+    OBJ_FIBER,
+    OBJ_FUNCTION,
+    OBJ_NATIVE,
     OBJ_STRING,
 } ObjType;
 
@@ -21,6 +35,101 @@ struct Obj {
     struct Obj* next;
 };
 
+// Every function (and the top level of a script, which is compiled as a function
+// with no name) has its own chunk of code
+typedef struct {
+    Obj obj;
+    int arity;
+    // The most stack slots the function ever uses at once, its locals and the
+    // temporaries of its expressions included. A call checks there's room for this
+    // many once, so nothing inside the function has to check again
+    int maxSlots;
+    Chunk chunk;
+    // NULL for the top level of a script
+    ObjString* name;
+    // how many times it's been called, and its machine code once that or one of its
+    // loops got hot, only ever touched with the VM's jit flag set (see jit.h)
+    int calls;
+    struct JitCode* jit;
+    // its direct-threaded code once it's first run, only ever made by the core built
+    // with make CORE=threaded (see threaded.h)
+    struct ThreadedCode* threaded;
+} ObjFunction;
+
+// A function call in progress. Its locals are a window onto its fiber's value stack
+// starting at slots, with the function itself in slot 0 and the arguments after it,
+// so making a call never allocates anything
+typedef struct {
+    ObjFunction* function;
+    // where to carry on in function's code when a call it made returns
+    uint8_t* ip;
+    Value* slots;
+} CallFrame;
+
+typedef enum {
+    // made but never resumed, its function hasn't started
+    FIBER_NEW,
+    // it yielded and is waiting for someone to resume it
+    FIBER_SUSPENDED,
+    // it's the fiber running now, or it resumed the one that is and is waiting on it
+    FIBER_RUNNING,
+    // parked on the event loop until some I/O it asked for goes through, see loop.h
+    FIBER_WAITING,
+    // its function returned, or a runtime error ended it
+    FIBER_DONE,
+} FiberState;
+
+// A coroutine, a call stack of its own that can stop part way through and be picked up
+// again later. Each has its own frames and value stack, which start small and grow as
+// it calls deeper, so thousands of them cost very little memory
+typedef struct ObjFiber {
+    Obj obj;
+    FiberState state;
+    // whoever resumed it and gets control back when it yields or finishes
+    struct ObjFiber* caller;
+    CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+} ObjFiber;
+
+// An array of numbers. They're stored as plain doubles one after another rather than
+// as Values, half the size and laid out the way the vector kernels want them. Ints
+// stored in an array come back out as doubles
+typedef struct {
+    Obj obj;
+    int count;
+    int capacity;
+    double* values;
+} ObjArray;
+
+// The VM a native is running in, natives need it to make strings or report errors
+struct VM;
+
+// A function written in C. args points straight at the arguments on the VM's stack,
+// nothing is copied, and the native stores what it returns in result. Returning false
+// means it failed, having already reported why with nativeError
+typedef bool (*NativeFn)(struct VM* vm, int argCount, Value* args, Value* result);
+
+// natives with this arity take any number of arguments and check them themselves
+#define NATIVE_VARIADIC -1
+
+// how a native is registered, see natives.c
+typedef struct {
+    const char* name;
+    NativeFn function;
+    int arity;
+} NativeDef;
+
+typedef struct {
+    Obj obj;
+    NativeFn function;
+    int arity;
+    ObjString* name;
+} ObjNative;
+
 struct ObjString {
     Obj obj;
     int length;
@@ -28,8 +137,43 @@ struct ObjString {
     uint32_t hash;
 };
 
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
+// Somewhere for objects to live. Every object is linked into the objects list of the
+// heap it was allocated in so it can be freed later, and strings are interned in the
+// heap's string table. The VM has its own heap, and each compiler worker thread gets
+// one of its own so compiling never touches shared state
+//
+// A heap can also start out from a heap image (see image.h). The image's objects stay
+// where they are in the mapped file rather than being allocated one by one, so they're
+// on a list of their own and go all at once when the image is unmapped
+typedef struct {
+    Obj* objects;
+    Table strings;
+    Obj* imageObjects;
+    void* image;
+    size_t imageSize;
+} Heap;
+
+void initHeap(Heap* heap);
+void freeHeap(Heap* heap);
+// an array of count zeros
+ObjArray* newArray(Heap* heap, int count);
+// adds value to the end of array, growing it if it's full
+void appendArray(ObjArray* array, double value);
+// a fiber that will call function, which takes 0 or 1 arguments, when first resumed
+ObjFiber* newFiber(Heap* heap, ObjFunction* function);
+// empties everything but the object header, the VM's main fiber isn't on any heap
+// and only ever gets this
+void initFiber(ObjFiber* fiber);
+// frees a fiber's frames and stack but not the fiber itself
+void freeFiberStacks(ObjFiber* fiber);
+ObjFunction* newFunction(Heap* heap);
+ObjNative* newNative(Heap* heap, NativeFn function, int arity, ObjString* name);
+ObjString* takeString(Heap* heap, char* chars, int length);
+ObjString* copyString(Heap* heap, const char* chars, int length);
+// Strings interned in the same heap are equal only if they're the same object, but a
+// VM running a shared Script sees strings from two heaps, its own and the script's,
+// so anything comparing strings that may come from different heaps has to use this
+bool stringsEqual(ObjString* a, ObjString* b);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
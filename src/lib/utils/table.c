@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cpu.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -32,8 +33,9 @@ static Entry* findEntry(Entry* entries, int capacity,
       } else {
         if (tombstone == NULL) tombstone = entry;
       }
-    } else if (entry->key == key) {
-        printf("ENTRY: %s\n", AS_STRING(entry->value)->chars);
+    } else if (stringsEqual(entry->key, key)) {
+      // usually the very same string, but a global named by a shared script's constant
+      // and one named by the VM's own copy of it are still the same global
       return entry;
     }
     index = (index + 1) & (capacity - 1);
@@ -50,6 +52,13 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
   return true;
 }
 
+Entry* tableGetEntry(Table* table, ObjString* key) {
+  if (table->count == 0) return NULL;
+
+  Entry* entry = findEntry(table->entries, table->capacity, key);
+  return entry->key == NULL ? NULL : entry;
+}
+
 static void adjustCapacity(Table* table, int capacity) {
     Entry* entries = ALLOCATE(Entry, capacity);
       for (int i = 0; i < capacity; i++) {
@@ -108,7 +117,7 @@ ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash) {
   if (table->count == 0) return NULL;
 
-  uint32_t index = hash % table->capacity;
+  uint32_t index = hash & (table->capacity - 1);
   for (;;) {
     Entry* entry = &table->entries[index];
     if (entry->key == NULL) {
@@ -116,11 +125,11 @@ ObjString* tableFindString(Table* table, const char* chars,
       if (IS_NIL(entry->value)) return NULL;
     } else if (entry->key->length == length &&
         entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
+        kernels.bytesEqual(entry->key->chars, chars, length)) {
       // We found it.
       return entry->key;
     }
 
-    index = (index + 1) % table->capacity;
+    index = (index + 1) & (table->capacity - 1);
   }
 }
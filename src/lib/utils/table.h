@@ -18,6 +18,9 @@ typedef struct {
 void initTable(Table* table);
 void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
+// The entry holding key, or NULL if it isn't there. The entry stays put until the
+// table grows or key is deleted, so it can be held on to for a while
+Entry* tableGetEntry(Table* table, ObjString* key);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
 void tableAddAll(Table* from, Table* to);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "format.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
@@ -32,18 +33,40 @@ void printValue(Value value) {
             printf(AS_BOOL(value) ? "true" : "false");
             break;
         case VAL_NIL: printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_NUMBER: {
+            // same digits as the print statement uses
+            char text[NUMBER_BUFFER_SIZE];
+            formatNumber(AS_DOUBLE(value), text);
+            printf("%s", text);
+            break;
+        }
+        case VAL_INT: printf("%lld", (long long)AS_INT(value)); break;
         case VAL_OBJ: printObject(value); break;
     }
 }
 
+// an int and a double are equal only if they are exactly the same number, which
+// converting the int to a double can't tell us above 2^53
+static bool intEqualsDouble(int64_t integer, double number) {
+    return number == (double)integer &&
+           number >= -9223372036854775808.0 && number < 9223372036854775808.0 &&
+           (int64_t)number == integer;
+}
+
 bool valuesEqual(Value a, Value b) {
+    // 1 and 1.0 are the same number as far as a script can tell
+    if (IS_INT(a) && IS_DOUBLE(b)) return intEqualsDouble(AS_INT(a), AS_DOUBLE(b));
+    if (IS_DOUBLE(a) && IS_INT(b)) return intEqualsDouble(AS_INT(b), AS_DOUBLE(a));
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL: return true;
-        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_NUMBER: return AS_DOUBLE(a) == AS_DOUBLE(b);
+        case VAL_INT: return AS_INT(a) == AS_INT(b);
+        case VAL_OBJ:
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            // only strings compare by what's in them, see stringsEqual
+            return IS_STRING(a) && IS_STRING(b) && stringsEqual(AS_STRING(a), AS_STRING(b));
         default: return false; // unreachable
     }
 }
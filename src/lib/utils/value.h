@@ -12,6 +12,10 @@ typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    // Whole numbers that fit in 64 bits. To a lox script these are just numbers, the
+    // VM keeps them as integers so arithmetic on counters and indices stays exact and
+    // skips the floating point unit, and turns them into doubles when it has to
+    VAL_INT,
     VAL_OBJ
 } ValueType;
 
@@ -23,6 +27,7 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int64_t integer;
         Obj* obj; //objects are always stored on the heap
     } as; // as is a common name for the union in C so we can do as.number etc
 } Value;
@@ -30,19 +35,26 @@ typedef struct {
 // these macros are for checking if the type of a value is a certain type
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
-#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_DOUBLE(value)  ((value).type == VAL_NUMBER)
+#define IS_INT(value)     ((value).type == VAL_INT)
+// either kind of number
+#define IS_NUMBER(value)  (IS_DOUBLE(value) || IS_INT(value))
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
 // each one of these macros takes a c value of the appropriate type and
 // returns a value of the appropriate type, this is a common pattern in C
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)    ((value).as.boolean)
-#define AS_NUMBER(value)  ((value).as.number)
+#define AS_DOUBLE(value)  ((value).as.number)
+#define AS_INT(value)     ((value).as.integer)
+// any number as a double, a function so the value is only evaluated once
+#define AS_NUMBER(value)  valueToDouble(value)
 
 // these macros are for creating values of the appropriate type
 #define BOOL_VAL(value)    ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL            ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value)  ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)     ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object)    ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
 
@@ -58,6 +70,10 @@ typedef struct {
     Value* values;
 } ValueArray;
 
+static inline double valueToDouble(Value value) {
+    return IS_INT(value) ? (double)AS_INT(value) : AS_DOUBLE(value);
+}
+
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
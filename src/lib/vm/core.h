@@ -0,0 +1,47 @@
+#ifndef clox_core_h
+#define clox_core_h
+
+#include "vm.h"
+
+// The parts of the VM shared by everything that runs bytecode: the interpreter core
+// vm.c is built with, the machine code the JIT makes and the helpers it calls. None of
+// it is for anyone else, scripts are run through vm.h
+
+// a runtime error in the running script, reported with a stack trace from the frames'
+// ips, which then ends it
+void runtimeError(VM* vm, const char* format, ...);
+// throws away every frame and value and goes back to the main fiber
+void resetStack(VM* vm);
+// Called by a generic binary instruction before it does anything. If its operands
+// have a quickened form the instruction at instruction is rewritten into it and this
+// returns true, the caller then runs it again
+bool quicken(VM* vm, uint8_t* instruction, uint8_t generic);
+// calls callee with the argCount arguments on top of the stack, pushing a frame if
+// it's a lox function, reporting an error if it can't be called
+bool callValue(VM* vm, Value callee, int argCount);
+// replaces the two strings on top of the stack with them joined together
+void concatenate(VM* vm);
+
+static inline bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Multiplies two ints, returning true if the result can't be an int. That's either
+// because it overflowed, or because it is a zero with a negative operand, which as a
+// double would have been -0 and prints differently
+static inline bool multiplyOverflows(int64_t a, int64_t b, int64_t* result) {
+    if (__builtin_mul_overflow(a, b, result)) return true;
+    return *result == 0 && (a < 0 || b < 0);
+}
+
+#ifdef CLOX_TAILCALL_CORE
+// runs the frame on top of the VM's until the script finishes, fails or yields, see
+// tailcall.c
+InterpretResult runTailCall(VM* vm);
+#endif
+#ifdef CLOX_THREADED_CORE
+// the same for the direct-threaded core, see threaded.c
+InterpretResult runThreaded(VM* vm);
+#endif
+
+#endif
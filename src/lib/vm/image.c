@@ -0,0 +1,591 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "cpu.h"
+#include "image.h"
+#include "memory.h"
+#include "natives.h"
+
+// "CLXI" when read as a little endian word
+#define IMAGE_MAGIC 0x49584C43u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    // the chunks in an image are bytecode, so it goes stale whenever a cache would
+    uint32_t cacheVersion;
+    // what the hash kernel of the interpreter that wrote the image made of HASH_CHECK
+    uint32_t hashCheck;
+    uint64_t size;
+    // offsets of the first object, which links to the rest, and of the two tables
+    uint64_t objects;
+    uint64_t strings;
+    uint64_t globals;
+    int32_t stringCount;
+    int32_t stringCapacity;
+    int32_t globalCount;
+    int32_t globalCapacity;
+} ImageHeader;
+
+#define HASH_CHECK "clox heap image"
+
+static uint32_t hashCheck(void) {
+    return kernels.hashString(HASH_CHECK, (int)strlen(HASH_CHECK));
+}
+
+// The image being built in memory, plus where each object has gone in it. That's an
+// open addressed table from the object's address to its offset, we can't use a Table
+// since those are keyed by strings
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    Obj** keys;
+    uint64_t* offsets;
+    size_t mapCapacity;
+    bool failed;
+} ImageWriter;
+
+// makes room for size zeroed bytes on an 8 byte boundary and returns their offset
+static uint64_t reserve(ImageWriter* writer, size_t size) {
+    size_t offset = (writer->count + 7) & ~(size_t)7;
+    if (offset + size > writer->capacity) {
+        size_t capacity = writer->capacity < 4096 ? 4096 : writer->capacity;
+        while (capacity < offset + size) capacity *= 2;
+        writer->bytes = (uint8_t*)reallocate(writer->bytes, writer->capacity, capacity);
+        memset(writer->bytes + writer->capacity, 0, capacity - writer->capacity);
+        writer->capacity = capacity;
+    }
+    writer->count = offset + size;
+    return offset;
+}
+
+// copies size bytes into the image, nothing at all is offset 0 which loads as NULL
+static uint64_t saveBytes(ImageWriter* writer, const void* bytes, size_t size) {
+    if (size == 0) return 0;
+    uint64_t offset = reserve(writer, size);
+    memcpy(writer->bytes + offset, bytes, size);
+    return offset;
+}
+
+static size_t slotFor(ImageWriter* writer, Obj* object) {
+    size_t mask = writer->mapCapacity - 1;
+    size_t slot = (size_t)(((uintptr_t)object >> 3) * 0x9E3779B97F4A7C15ull) & mask;
+    while (writer->keys[slot] != NULL && writer->keys[slot] != object) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static uint64_t offsetOf(ImageWriter* writer, Obj* object) {
+    if (object == NULL) return 0;
+    size_t slot = slotFor(writer, object);
+    if (writer->keys[slot] == NULL) {
+        // every object on the heap was given a place before anything was written, so
+        // this one must belong to some other heap, a shared Script's say
+        if (!writer->failed) fprintf(stderr, "Can't save an object from another heap.\n");
+        writer->failed = true;
+        return 0;
+    }
+    return writer->offsets[slot];
+}
+
+#define AS_OFFSET(type, offset) ((type)(uintptr_t)(offset))
+
+static Value saveValue(ImageWriter* writer, Value value) {
+    if (!IS_OBJ(value)) return value;
+    if (IS_FIBER(value)) {
+        if (!writer->failed) fprintf(stderr, "Can't save a fiber in a heap image.\n");
+        writer->failed = true;
+        return NIL_VAL;
+    }
+    value.as.obj = AS_OFFSET(Obj*, offsetOf(writer, AS_OBJ(value)));
+    return value;
+}
+
+// next is the object that follows it in the image, or NULL for the last one
+static void saveObject(ImageWriter* writer, Obj* object, Obj* next) {
+    uint64_t offset = offsetOf(writer, object);
+    switch (object->type) {
+        case OBJ_ARRAY: {
+            ObjArray copy = *(ObjArray*)object;
+            copy.obj.next = AS_OFFSET(Obj*, offsetOf(writer, next));
+            copy.capacity = copy.count;
+            copy.values = AS_OFFSET(double*, saveBytes(writer, copy.values,
+                                                       sizeof(double) * (size_t)copy.count));
+            memcpy(writer->bytes + offset, &copy, sizeof(copy));
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            ObjFunction copy = *function;
+            Chunk* chunk = &copy.chunk;
+            copy.obj.next = AS_OFFSET(Obj*, offsetOf(writer, next));
+            copy.name = AS_OFFSET(ObjString*, offsetOf(writer, (Obj*)function->name));
+            // machine code is made afresh by each process that finds the function hot,
+            // and threaded code by each that runs it
+            copy.calls = 0;
+            copy.jit = NULL;
+            copy.threaded = NULL;
+            chunk->capacity = chunk->count;
+            chunk->code = AS_OFFSET(uint8_t*, saveBytes(writer, chunk->code, (size_t)chunk->count));
+            chunk->lineCapacity = chunk->lineCount;
+            chunk->lines = AS_OFFSET(LineStart*, saveBytes(writer, chunk->lines,
+                                     sizeof(LineStart) * (size_t)chunk->lineCount));
+
+            chunk->constants.capacity = chunk->constants.count;
+            uint64_t constants = 0;
+            if (chunk->constants.count > 0) {
+                constants = reserve(writer, sizeof(Value) * (size_t)chunk->constants.count);
+                for (int i = 0; i < chunk->constants.count; i++) {
+                    Value value = saveValue(writer, function->chunk.constants.values[i]);
+                    memcpy(writer->bytes + constants + sizeof(Value) * (size_t)i, &value,
+                           sizeof(value));
+                }
+            }
+            chunk->constants.values = AS_OFFSET(Value*, constants);
+
+            // like a cache the image only keeps how many loops there are, every VM that
+            // starts from it counts them from zero
+            chunk->loopCapacity = chunk->loopCount;
+            chunk->loopCounters = AS_OFFSET(uint64_t*, chunk->loopCount == 0 ? 0 :
+                                            reserve(writer, sizeof(uint64_t) * (size_t)chunk->loopCount));
+            chunk->mapping = NULL;
+            chunk->mappingSize = 0;
+            chunk->frozen = false;
+            memcpy(writer->bytes + offset, &copy, sizeof(copy));
+            break;
+        }
+        case OBJ_NATIVE: {
+            ObjNative copy = *(ObjNative*)object;
+            copy.obj.next = AS_OFFSET(Obj*, offsetOf(writer, next));
+            copy.function = NULL;
+            copy.name = AS_OFFSET(ObjString*, offsetOf(writer, (Obj*)copy.name));
+            memcpy(writer->bytes + offset, &copy, sizeof(copy));
+            break;
+        }
+        case OBJ_STRING: {
+            ObjString copy = *(ObjString*)object;
+            copy.obj.next = AS_OFFSET(Obj*, offsetOf(writer, next));
+            copy.chars = AS_OFFSET(char*, saveBytes(writer, copy.chars, (size_t)copy.length + 1));
+            memcpy(writer->bytes + offset, &copy, sizeof(copy));
+            break;
+        }
+        case OBJ_FIBER:
+            break;
+    }
+}
+
+static uint64_t saveTable(ImageWriter* writer, Table* table) {
+    if (table->capacity == 0) return 0;
+    uint64_t offset = reserve(writer, sizeof(Entry) * (size_t)table->capacity);
+    for (int i = 0; i < table->capacity; i++) {
+        Entry entry = table->entries[i];
+        // an empty bucket or a tombstone has no key and nothing in its value to move
+        if (entry.key != NULL) {
+            entry.key = AS_OFFSET(ObjString*, offsetOf(writer, (Obj*)entry.key));
+            entry.value = saveValue(writer, entry.value);
+        }
+        memcpy(writer->bytes + offset + sizeof(Entry) * (size_t)i, &entry, sizeof(entry));
+    }
+    return offset;
+}
+
+static size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_ARRAY: return sizeof(ObjArray);
+        case OBJ_FUNCTION: return sizeof(ObjFunction);
+        case OBJ_NATIVE: return sizeof(ObjNative);
+        case OBJ_STRING: return sizeof(ObjString);
+        case OBJ_FIBER: break;
+    }
+    return 0;
+}
+
+bool writeHeapImage(Heap* heap, Table* globals, const char* path) {
+    ImageWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    reserve(&writer, sizeof(ImageHeader));
+
+    // Everything but the fibers goes in, and a heap that itself started from an image
+    // has objects on both lists
+    size_t objectCount = 0;
+    Obj** order = NULL;
+    size_t orderCapacity = 0;
+    Obj* lists[] = {heap->objects, heap->imageObjects};
+    for (int list = 0; list < 2; list++) {
+        for (Obj* object = lists[list]; object != NULL; object = object->next) {
+            if (object->type == OBJ_FIBER) continue;
+            if (objectCount == orderCapacity) {
+                size_t capacity = GROW_CAPACITY(orderCapacity);
+                order = GROW_ARRAY(Obj*, order, orderCapacity, capacity);
+                orderCapacity = capacity;
+            }
+            order[objectCount++] = object;
+        }
+    }
+
+    writer.mapCapacity = 16;
+    while (writer.mapCapacity < objectCount * 2) writer.mapCapacity *= 2;
+    writer.keys = (Obj**)calloc(writer.mapCapacity, sizeof(Obj*));
+    writer.offsets = ALLOCATE(uint64_t, writer.mapCapacity);
+
+    // every object gets its place first, all of them together at the front, so any
+    // pointer can be turned into an offset however the objects refer to each other
+    for (size_t i = 0; i < objectCount; i++) {
+        size_t slot = slotFor(&writer, order[i]);
+        writer.keys[slot] = order[i];
+        writer.offsets[slot] = reserve(&writer, objectSize(order[i]));
+    }
+    for (size_t i = 0; i < objectCount; i++) {
+        saveObject(&writer, order[i], i + 1 < objectCount ? order[i + 1] : NULL);
+    }
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = IMAGE_MAGIC;
+    header.version = HEAP_IMAGE_VERSION;
+    header.cacheVersion = BYTECODE_CACHE_VERSION;
+    header.hashCheck = hashCheck();
+    header.objects = objectCount > 0 ? offsetOf(&writer, order[0]) : 0;
+    header.strings = saveTable(&writer, &heap->strings);
+    header.stringCount = heap->strings.count;
+    header.stringCapacity = heap->strings.capacity;
+    header.globals = saveTable(&writer, globals);
+    header.globalCount = globals->count;
+    header.globalCapacity = globals->capacity;
+    // round the end up too, so the file is a whole number of 8 byte words
+    reserve(&writer, 0);
+    header.size = writer.count;
+    memcpy(writer.bytes, &header, sizeof(header));
+
+    bool succeeded = !writer.failed;
+    if (succeeded) {
+        // like a cache it's written beside its final name and renamed into place, so a
+        // VM starting up meanwhile never maps half an image
+        char temporary[PATH_MAX + 32];
+        snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", path, (long)getpid());
+        FILE* file = fopen(temporary, "wb");
+        succeeded = file != NULL;
+        if (succeeded) {
+            if (fwrite(writer.bytes, 1, writer.count, file) != writer.count) succeeded = false;
+            if (fclose(file) != 0) succeeded = false;
+            if (!succeeded || rename(temporary, path) != 0) {
+                remove(temporary);
+                succeeded = false;
+            }
+        }
+        if (!succeeded) fprintf(stderr, "Could not write heap image \"%s\".\n", path);
+    }
+
+    FREE_ARRAY(uint8_t, writer.bytes, writer.capacity);
+    free(writer.keys);
+    FREE_ARRAY(Obj*, order, orderCapacity);
+    FREE_ARRAY(uint64_t, writer.offsets, writer.mapCapacity);
+    return succeeded;
+}
+
+// turns an offset read from the image back into a pointer
+static inline void* relocate(uint8_t* base, const void* offset) {
+    return offset == NULL ? NULL : base + (uintptr_t)offset;
+}
+
+static inline Value loadValue(uint8_t* base, Value value) {
+    if (IS_OBJ(value)) value.as.obj = (Obj*)relocate(base, value.as.obj);
+    return value;
+}
+
+static void loadTable(uint8_t* base, Table* table, uint64_t offset, int count, int capacity,
+                      bool rehash) {
+    Entry* entries = (Entry*)relocate(base, AS_OFFSET(void*, offset));
+    if (rehash) {
+        // the buckets were picked by hashes we no longer agree with, so every key
+        // has to be inserted again
+        for (int i = 0; i < capacity; i++) {
+            if (entries[i].key == NULL) continue;
+            tableSet(table, (ObjString*)relocate(base, entries[i].key),
+                     loadValue(base, entries[i].value));
+        }
+        return;
+    }
+
+    // The table is copied out of the image since it grows as the program adds to it,
+    // but it's copied bucket for bucket, nothing is hashed or looked up
+    table->entries = ALLOCATE(Entry, capacity);
+    for (int i = 0; i < capacity; i++) {
+        Entry entry = entries[i];
+        if (entry.key != NULL) {
+            entry.key = (ObjString*)relocate(base, entry.key);
+            entry.value = loadValue(base, entry.value);
+        }
+        table->entries[i] = entry;
+    }
+    table->count = count;
+    table->capacity = capacity;
+}
+
+// Nothing read from an image is trusted: a corrupted one has to fail to load, not
+// take the VM down with it. So before a single pointer is fixed up every offset in the
+// image is checked. Whatever an object points to has to lie inside the file, and every
+// reference to an object has to be to the start of one of the right type. The objects
+// were written in the order they're linked, so the list only ever moves forward
+// through the file and has to come to an end
+typedef struct {
+    uint8_t* base;
+    size_t size;
+    // by 8 byte word of the image, 1 + the type of the object starting there, 0 if none
+    uint8_t* kinds;
+} ImageChecker;
+
+// whether length bytes at offset, which is still an offset, are all in the image
+static bool inImage(ImageChecker* checker, const void* offset, uint64_t length) {
+    uint64_t start = (uint64_t)(uintptr_t)offset;
+    return start >= sizeof(ImageHeader) && start <= checker->size &&
+           length <= checker->size - start;
+}
+
+// whether count elements of the given size and alignment at offset are in the image.
+// An empty array is never read, but its pointer still gets fixed up, so it has to be
+// null or somewhere in the file too
+static bool arrayInImage(ImageChecker* checker, const void* offset, int count,
+                         size_t elementSize, size_t alignment) {
+    if (count < 0) return false;
+    if (count == 0) return offset == NULL || inImage(checker, offset, 0);
+    return (uintptr_t)offset % alignment == 0 &&
+           inImage(checker, offset, elementSize * (uint64_t)count);
+}
+
+#define ARRAY_IN_IMAGE(checker, offset, count, type) \
+    arrayInImage(checker, offset, count, sizeof(type), _Alignof(type))
+
+// whether offset is the start of an object of the given type, or any type for -1
+static bool isObjectAt(ImageChecker* checker, const void* offset, int type) {
+    uint64_t start = (uint64_t)(uintptr_t)offset;
+    if (start % 8 != 0 || start >= checker->size) return false;
+    uint8_t kind = checker->kinds[start / 8];
+    return kind != 0 && (type < 0 || kind == type + 1);
+}
+
+static bool isStringOrNull(ImageChecker* checker, const void* offset) {
+    return offset == NULL || isObjectAt(checker, offset, OBJ_STRING);
+}
+
+static bool validValue(ImageChecker* checker, Value value) {
+    if ((unsigned)value.type > VAL_OBJ) return false;
+    return !IS_OBJ(value) || isObjectAt(checker, value.as.obj, -1);
+}
+
+static bool validObject(ImageChecker* checker, Obj* object) {
+    switch (object->type) {
+        case OBJ_ARRAY: {
+            ObjArray* array = (ObjArray*)object;
+            // the elements are copied out into an array of capacity, which the writer
+            // made the same as count
+            return array->capacity == array->count &&
+                   ARRAY_IN_IMAGE(checker, array->values, array->count, double);
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            Chunk* chunk = &function->chunk;
+            if (function->arity < 0 || function->arity > 255 || function->maxSlots < 0 ||
+                !isStringOrNull(checker, function->name)) {
+                return false;
+            }
+            if (chunk->count <= 0 || chunk->lineCount <= 0 ||
+                chunk->loopCount > UINT16_MAX + 1 ||
+                !ARRAY_IN_IMAGE(checker, chunk->code, chunk->count, uint8_t) ||
+                !ARRAY_IN_IMAGE(checker, chunk->lines, chunk->lineCount, LineStart) ||
+                !ARRAY_IN_IMAGE(checker, chunk->loopCounters, chunk->loopCount, uint64_t)) {
+                return false;
+            }
+            int count = chunk->constants.count;
+            if (!ARRAY_IN_IMAGE(checker, chunk->constants.values, count, Value)) return false;
+            if (count > 0) {
+                Value* constants = (Value*)(checker->base + (uintptr_t)chunk->constants.values);
+                for (int i = 0; i < count; i++) {
+                    if (!validValue(checker, constants[i])) return false;
+                }
+            }
+            // the bytecode itself is verified once the constants are fixed up
+            return true;
+        }
+        case OBJ_NATIVE: {
+            ObjNative* native = (ObjNative*)object;
+            return native->name != NULL && isObjectAt(checker, native->name, OBJ_STRING);
+        }
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            if (string->length < 0 ||
+                !inImage(checker, string->chars, (uint64_t)string->length + 1)) {
+                return false;
+            }
+            return checker->base[(uintptr_t)string->chars + (size_t)string->length] == '\0';
+        }
+        case OBJ_FIBER:
+            break;
+    }
+    return false;
+}
+
+static bool validTable(ImageChecker* checker, uint64_t offset, int count, int capacity) {
+    if (capacity == 0) return offset == 0 && count == 0;
+    // the table is probed with a mask, and has to be left with a bucket that's never
+    // been used or a lookup that misses would go round it forever
+    if (capacity < 0 || (capacity & (capacity - 1)) != 0 || count < 0 || count >= capacity) {
+        return false;
+    }
+    if (!ARRAY_IN_IMAGE(checker, AS_OFFSET(void*, offset), capacity, Entry)) return false;
+    Entry* entries = (Entry*)(checker->base + offset);
+    int used = 0;
+    for (int i = 0; i < capacity; i++) {
+        if (!isStringOrNull(checker, entries[i].key) || !validValue(checker, entries[i].value)) {
+            return false;
+        }
+        // tombstones are counted too
+        if (entries[i].key != NULL || !IS_NIL(entries[i].value)) used++;
+    }
+    return used <= count;
+}
+
+static bool validImage(uint8_t* base, size_t size, ImageHeader* header) {
+    ImageChecker checker;
+    checker.base = base;
+    checker.size = size;
+    checker.kinds = (uint8_t*)calloc(size / 8 + 1, 1);
+    if (checker.kinds == NULL) return false;
+
+    // first where every object is and what it is, so references to them can be checked
+    bool valid = true;
+    uint64_t offset = header->objects;
+    while (valid && offset != 0) {
+        valid = offset % 8 == 0 && inImage(&checker, AS_OFFSET(void*, offset), sizeof(Obj));
+        if (!valid) break;
+        Obj* object = (Obj*)(base + offset);
+        valid = (unsigned)object->type <= OBJ_STRING && object->type != OBJ_FIBER &&
+                inImage(&checker, AS_OFFSET(void*, offset), objectSize(object));
+        if (!valid) break;
+        checker.kinds[offset / 8] = (uint8_t)(object->type + 1);
+        uint64_t next = (uint64_t)(uintptr_t)object->next;
+        valid = next == 0 || next > offset;
+        offset = next;
+    }
+    for (offset = header->objects; valid && offset != 0;
+         offset = (uint64_t)(uintptr_t)((Obj*)(base + offset))->next) {
+        valid = validObject(&checker, (Obj*)(base + offset));
+    }
+    valid = valid &&
+            validTable(&checker, header->strings, header->stringCount, header->stringCapacity) &&
+            validTable(&checker, header->globals, header->globalCount, header->globalCapacity);
+    free(checker.kinds);
+    return valid;
+}
+
+bool loadHeapImage(Heap* heap, Table* globals, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(ImageHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)info.st_size;
+    // A private mapping, so fixing up the pointers, quickening instructions and bumping
+    // loop counters only ever touch our own copy of the pages they're on, and the
+    // pages nobody writes to are shared with every other process using the image. We
+    // touch every page fixing it up anyway, so it's cheaper to fault them all in at once
+    uint8_t* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return false;
+
+    ImageHeader* header = (ImageHeader*)base;
+    if (header->magic != IMAGE_MAGIC || header->version != HEAP_IMAGE_VERSION ||
+        header->cacheVersion != BYTECODE_CACHE_VERSION || header->size != size ||
+        !validImage(base, size, header)) {
+        munmap(base, size);
+        return false;
+    }
+    bool rehash = header->hashCheck != hashCheck();
+    Obj* objects = (Obj*)relocate(base, AS_OFFSET(void*, header->objects));
+
+    // strings first, natives need their names readable
+    for (Obj* object = objects; object != NULL; object = object->next) {
+        object->next = (Obj*)relocate(base, object->next);
+        if (object->type != OBJ_STRING) continue;
+        ObjString* string = (ObjString*)object;
+        string->chars = (char*)relocate(base, string->chars);
+        if (rehash) string->hash = kernels.hashString(string->chars, string->length);
+    }
+
+    for (Obj* object = objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_NATIVE) {
+            ObjNative* native = (ObjNative*)object;
+            native->name = (ObjString*)relocate(base, native->name);
+            native->function = findNative(native->name->chars, native->arity);
+            if (native->function == NULL) {
+                // written by an interpreter with a native we don't have, or don't have
+                // with that arity, nothing has been allocated yet so we can just let go
+                // of it
+                munmap(base, size);
+                return false;
+            }
+        }
+    }
+
+    for (Obj* object = objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION) {
+            ObjFunction* function = (ObjFunction*)object;
+            Chunk* chunk = &function->chunk;
+            function->name = (ObjString*)relocate(base, function->name);
+            // these were cleared when the image was written, so a corrupted one can't
+            // leave us freeing or running code that isn't ours
+            function->calls = 0;
+            function->jit = NULL;
+            function->threaded = NULL;
+            chunk->mapping = NULL;
+            chunk->mappingSize = 0;
+            chunk->frozen = false;
+            chunk->code = (uint8_t*)relocate(base, chunk->code);
+            chunk->lines = (LineStart*)relocate(base, chunk->lines);
+            chunk->loopCounters = (uint64_t*)relocate(base, chunk->loopCounters);
+            chunk->constants.values = (Value*)relocate(base, chunk->constants.values);
+            for (int i = 0; i < chunk->constants.count; i++) {
+                chunk->constants.values[i] = loadValue(base, chunk->constants.values[i]);
+            }
+            // the bytecode can only be checked now its global names are readable
+            if (!verifyChunk(chunk, function->arity, function->maxSlots)) {
+                munmap(base, size);
+                return false;
+            }
+        }
+    }
+
+    for (Obj* object = objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_ARRAY) {
+            ObjArray* array = (ObjArray*)object;
+            double* values = (double*)relocate(base, array->values);
+            array->values = ALLOCATE(double, array->capacity);
+            if (array->count > 0) {
+                memcpy(array->values, values, sizeof(double) * (size_t)array->count);
+            }
+        }
+    }
+
+    loadTable(base, &heap->strings, header->strings, header->stringCount,
+              header->stringCapacity, rehash);
+    loadTable(base, globals, header->globals, header->globalCount, header->globalCapacity,
+              rehash);
+    heap->imageObjects = objects;
+    heap->image = base;
+    heap->imageSize = size;
+    return true;
+}
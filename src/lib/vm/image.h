@@ -0,0 +1,37 @@
+#ifndef clox_image_h
+#define clox_image_h
+
+#include "object.h"
+#include "table.h"
+
+// Bump this whenever the layout of any object, chunk or table changes, an image written
+// by an older interpreter is then refused rather than misread
+#define HEAP_IMAGE_VERSION 3
+
+// A heap image is a VM's whole heap and globals written out as they are in memory, the
+// natives, a prelude's functions and anything else it defined included, so a new VM
+// can start from it instead of building all of that again.
+//
+// Every object is copied into the file as it is, with each pointer replaced by the
+// offset of what it points at from the start of the file:
+//
+// [header][object][object]...[payloads][interned strings][globals]
+//
+// where the payloads are the characters, code, line runs, constants and array elements
+// the objects point at. Loading maps the file and adds the address it was mapped at to
+// every offset, nothing is allocated or interned again. Only the two tables are copied
+// out, and the elements of arrays so they can grow.
+//
+// Natives are looked up again by name, and the header records what our hash kernel
+// made of a fixed string. If a machine with a different hash kernel loads the image
+// it rehashes every string and rebuilds both tables, which is slower but still right.
+//
+// Fibers can't be saved, a global holding one makes writing the image fail
+
+// writes heap and globals to path, returning false (having said why) if it can't
+bool writeHeapImage(Heap* heap, Table* globals, const char* path);
+// Starts heap and globals, which must both be empty, from the image at path. Returns
+// false, leaving them empty, if there's no usable image there
+bool loadHeapImage(Heap* heap, Table* globals, const char* path);
+
+#endif
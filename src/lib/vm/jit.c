@@ -0,0 +1,734 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "jit.h"
+#include "memory.h"
+#include "output.h"
+#include "table.h"
+#include "vm.h"
+
+void freeJit(JitCode* jit) {
+    munmap(jit->memory, jit->size);
+    FREE_ARRAY(void*, jit->entries, jit->entryCount);
+    FREE(JitCode, jit);
+}
+
+#if defined(__x86_64__)
+
+// The machine code calls these for everything it doesn't do inline. Each works on the
+// VM's stack exactly like the instruction it stands in for, the machine code has
+// stored its top of the stack and the frame's ip beforehand, and returns JIT_CONTINUE
+// for the machine code to carry on or whatever it should stop with
+
+static JitStatus jitGetGlobal(VM* vm, ObjString* name) {
+    Value value;
+    if (!tableGet(&vm->globals, name, &value)) {
+        nativeError(vm, "Undefined variable '%s'.", name->chars);
+        return JIT_ERROR;
+    }
+    push(vm, value);
+    return JIT_CONTINUE;
+}
+
+static JitStatus jitSetGlobal(VM* vm, ObjString* name) {
+    if (tableSet(&vm->globals, name, vm->stackTop[-1])) {
+        tableDelete(&vm->globals, name);
+        nativeError(vm, "Undefined variable '%s'.", name->chars);
+        return JIT_ERROR;
+    }
+    return JIT_CONTINUE;
+}
+
+static JitStatus jitDefineGlobal(VM* vm, ObjString* name) {
+    tableSet(&vm->globals, name, vm->stackTop[-1]);
+    vm->stackTop--;
+    return JIT_CONTINUE;
+}
+
+// Every binary instruction ends up here when its operands aren't the ones its
+// template does inline. op is the generic instruction, whatever it was quickened to
+static JitStatus jitBinary(VM* vm, int op) {
+    Value b = vm->stackTop[-1];
+    Value a = vm->stackTop[-2];
+    Value result;
+    if (op == OP_EQUAL) {
+        result = BOOL_VAL(valuesEqual(a, b));
+    } else if (op == OP_ADD && IS_STRING(a) && IS_STRING(b)) {
+        concatenate(vm);
+        return JIT_CONTINUE;
+    } else if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        nativeError(vm, op == OP_ADD ? "Operands must be two numbers or two strings."
+                                     : "Operands must be numbers.");
+        return JIT_ERROR;
+    } else if (IS_INT(a) && IS_INT(b) && op != OP_DIVIDE) {
+        int64_t x = AS_INT(a);
+        int64_t y = AS_INT(b);
+        int64_t r;
+        switch (op) {
+            case OP_ADD:
+                result = __builtin_add_overflow(x, y, &r) ? NUMBER_VAL((double)x + (double)y)
+                                                          : INT_VAL(r);
+                break;
+            case OP_SUBTRACT:
+                result = __builtin_sub_overflow(x, y, &r) ? NUMBER_VAL((double)x - (double)y)
+                                                          : INT_VAL(r);
+                break;
+            case OP_MULTIPLY:
+                result = multiplyOverflows(x, y, &r) ? NUMBER_VAL((double)x * (double)y)
+                                                     : INT_VAL(r);
+                break;
+            case OP_GREATER: result = BOOL_VAL(x > y); break;
+            default: result = BOOL_VAL(x < y); break;
+        }
+    } else {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (op) {
+            case OP_ADD: result = NUMBER_VAL(x + y); break;
+            case OP_SUBTRACT: result = NUMBER_VAL(x - y); break;
+            case OP_MULTIPLY: result = NUMBER_VAL(x * y); break;
+            case OP_DIVIDE: result = NUMBER_VAL(x / y); break;
+            case OP_GREATER: result = BOOL_VAL(x > y); break;
+            default: result = BOOL_VAL(x < y); break;
+        }
+    }
+    vm->stackTop--;
+    vm->stackTop[-1] = result;
+    return JIT_CONTINUE;
+}
+
+static JitStatus jitNot(VM* vm) {
+    vm->stackTop[-1] = BOOL_VAL(isFalsey(vm->stackTop[-1]));
+    return JIT_CONTINUE;
+}
+
+static JitStatus jitNegate(VM* vm) {
+    Value value = vm->stackTop[-1];
+    if (!IS_NUMBER(value)) {
+        nativeError(vm, "Operand must be a number.");
+        return JIT_ERROR;
+    }
+    // -0 and -INT64_MIN aren't ints
+    if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT64_MIN) {
+        vm->stackTop[-1] = INT_VAL(-AS_INT(value));
+    } else {
+        vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(value));
+    }
+    return JIT_CONTINUE;
+}
+
+static JitStatus jitPrint(VM* vm) {
+    writeValue(&vm->output, pop(vm));
+    writeNewline(&vm->output);
+    return JIT_CONTINUE;
+}
+
+static JitStatus jitGetIndex(VM* vm) {
+    Value index = vm->stackTop[-1];
+    Value array = vm->stackTop[-2];
+    if (!IS_ARRAY(array)) {
+        nativeError(vm, "Only arrays can be indexed.");
+        return JIT_ERROR;
+    }
+    if (!IS_INT(index)) {
+        nativeError(vm, "Array index must be a whole number.");
+        return JIT_ERROR;
+    }
+    ObjArray* elements = AS_ARRAY(array);
+    if ((uint64_t)AS_INT(index) >= (uint64_t)elements->count) {
+        nativeError(vm, "Array index %lld out of bounds.", (long long)AS_INT(index));
+        return JIT_ERROR;
+    }
+    vm->stackTop--;
+    vm->stackTop[-1] = NUMBER_VAL(elements->values[AS_INT(index)]);
+    return JIT_CONTINUE;
+}
+
+static JitStatus jitSetIndex(VM* vm) {
+    Value value = vm->stackTop[-1];
+    Value index = vm->stackTop[-2];
+    Value array = vm->stackTop[-3];
+    if (!IS_ARRAY(array)) {
+        nativeError(vm, "Only arrays can be indexed.");
+        return JIT_ERROR;
+    }
+    if (!IS_INT(index)) {
+        nativeError(vm, "Array index must be a whole number.");
+        return JIT_ERROR;
+    }
+    if (!IS_NUMBER(value)) {
+        nativeError(vm, "Arrays can only hold numbers.");
+        return JIT_ERROR;
+    }
+    ObjArray* elements = AS_ARRAY(array);
+    if ((uint64_t)AS_INT(index) >= (uint64_t)elements->count) {
+        nativeError(vm, "Array index %lld out of bounds.", (long long)AS_INT(index));
+        return JIT_ERROR;
+    }
+    elements->values[AS_INT(index)] = AS_NUMBER(value);
+    vm->stackTop -= 2;
+    vm->stackTop[-1] = value;
+    return JIT_CONTINUE;
+}
+
+// Natives are called right here. A call to anything else, or one that would be an
+// error, backs the ip up onto the call so the interpreter makes it, having spent
+// nothing, since the interpreter spends the budget for it
+static JitStatus jitCall(VM* vm, int argCount, int64_t* budget) {
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    Value callee = vm->stackTop[-1 - argCount];
+    if (!IS_NATIVE(callee) || (AS_NATIVE(callee)->arity != argCount &&
+                               AS_NATIVE(callee)->arity != NATIVE_VARIADIC)) {
+        frame->ip -= 2;
+        return JIT_EXIT;
+    }
+    if (--*budget == 0) {
+        // a yield here runs the whole call again when we resume
+        frame->ip -= 2;
+        return JIT_EXIT;
+    }
+    ObjNative* native = AS_NATIVE(callee);
+    Value* args = vm->stackTop - argCount;
+    ObjFiber* fiber = vm->fiber;
+    if (!native->function(vm, argCount, args, &args[-1])) return JIT_ERROR;
+    // it switched fibers, the interpreter carries on wherever the new one was
+    if (vm->fiber != fiber) return JIT_EXIT;
+    vm->stackTop = args;
+    return JIT_CONTINUE;
+}
+
+// The registers the machine code keeps its state in, all callee saved so calls into C
+// leave them alone
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+#define TOP RBX      // vm->stackTop
+#define SLOTS R12    // frame->slots
+#define VM_REG R13
+#define FRAME R14
+#define BUDGET R15   // the int64_t budget
+
+// condition codes
+enum {
+    CC_O = 0x0, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_L = 0xC, CC_G = 0xF,
+};
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+#define TYPE_AT(slot) ((int32_t)(slot) * VALUE_SIZE + (int32_t)offsetof(Value, type))
+#define PAYLOAD_AT(slot) ((int32_t)(slot) * VALUE_SIZE + (int32_t)offsetof(Value, as))
+
+// a jump whose target is an instruction, filled in once every instruction has a place
+typedef struct {
+    int at;
+    int target;
+} Patch;
+
+typedef struct {
+    uint8_t* code;
+    int count;
+    int capacity;
+    // where each instruction's machine code starts, -1 between instructions
+    int* labels;
+    Patch* patches;
+    int patchCount;
+    int patchCapacity;
+    // the shared ends of the machine code, one writing the top of the stack back first
+    int saveAndReturn;
+    int justReturn;
+} Assembler;
+
+static void emitByte(Assembler* as, uint8_t byte) {
+    if (as->count == as->capacity) {
+        int capacity = GROW_CAPACITY(as->capacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, as->capacity, capacity);
+        as->capacity = capacity;
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emitByte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void patch32(Assembler* as, int at, int32_t value) {
+    memcpy(as->code + at, &value, sizeof(value));
+}
+
+static void emitRex(Assembler* as, bool wide, int reg, int base) {
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+    if (rex != 0x40) emitByte(as, rex);
+}
+
+// Any instruction with a [base + disp] operand, reg being the other register or the
+// opcode's extension. The displacement is always 32 bits, which keeps every template
+// the same size whatever slot it uses
+static void emitMemoryOp(Assembler* as, uint8_t prefix, bool wide, uint32_t opcode,
+                         int reg, int base, int32_t disp) {
+    if (prefix != 0) emitByte(as, prefix);
+    emitRex(as, wide, reg, base);
+    if (opcode > 0xFF) emitByte(as, (uint8_t)(opcode >> 8));
+    emitByte(as, (uint8_t)opcode);
+    emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    // rsp and r12 as a base need a SIB byte saying there's no index
+    if ((base & 7) == RSP) emitByte(as, 0x24);
+    emit32(as, (uint32_t)disp);
+}
+
+static void loadQword(Assembler* as, int reg, int base, int32_t disp) {
+    emitMemoryOp(as, 0, true, 0x8B, reg, base, disp);
+}
+
+static void storeQword(Assembler* as, int base, int32_t disp, int reg) {
+    emitMemoryOp(as, 0, true, 0x89, reg, base, disp);
+}
+
+static void storeType(Assembler* as, int base, int32_t disp, ValueType type) {
+    emitMemoryOp(as, 0, false, 0xC7, 0, base, disp);
+    emit32(as, (uint32_t)type);
+}
+
+static void compareType(Assembler* as, int base, int32_t disp, ValueType type) {
+    emitMemoryOp(as, 0, false, 0x81, 7, base, disp);
+    emit32(as, (uint32_t)type);
+}
+
+static void moveImmediate(Assembler* as, int reg, uint64_t value) {
+    emitRex(as, true, 0, reg);
+    emitByte(as, 0xB8 + (reg & 7));
+    emit64(as, value);
+}
+
+static void moveRegister(Assembler* as, int to, int from) {
+    emitRex(as, true, from, to);
+    emitByte(as, 0x89);
+    emitByte(as, 0xC0 | ((from & 7) << 3) | (to & 7));
+}
+
+// moves the top of the stack by count values
+static void adjustTop(Assembler* as, int count) {
+    emitRex(as, true, 0, TOP);
+    emitByte(as, 0x81);
+    emitByte(as, (count < 0 ? 0xE8 : 0xC0) | (TOP & 7));
+    emit32(as, (uint32_t)((count < 0 ? -count : count) * VALUE_SIZE));
+}
+
+// copies a whole Value through xmm0
+static void copyValue(Assembler* as, int toBase, int32_t to, int fromBase, int32_t from) {
+    emitMemoryOp(as, 0xF3, false, 0x0F6F, 0, fromBase, from);
+    emitMemoryOp(as, 0xF3, false, 0x0F7F, 0, toBase, to);
+}
+
+static void pushConstant(Assembler* as, Value value) {
+    uint64_t payload;
+    memcpy(&payload, &value.as, sizeof(payload));
+    storeType(as, TOP, 0, value.type);
+    moveImmediate(as, RAX, payload);
+    storeQword(as, TOP, PAYLOAD_AT(0), RAX);
+    adjustTop(as, 1);
+}
+
+// a jump to somewhere later in this template, returns where to patch it
+static int jumpForward(Assembler* as, int condition) {
+    if (condition < 0) {
+        emitByte(as, 0xE9);
+    } else {
+        emitByte(as, 0x0F);
+        emitByte(as, 0x80 | condition);
+    }
+    int at = as->count;
+    emit32(as, 0);
+    return at;
+}
+
+static void landHere(Assembler* as, int at) {
+    patch32(as, at, as->count - (at + 4));
+}
+
+// a jump to code that has already been emitted
+static void jumpBack(Assembler* as, int condition, int to) {
+    int at = jumpForward(as, condition);
+    patch32(as, at, to - (at + 4));
+}
+
+static void jumpToInstruction(Assembler* as, int condition, int target) {
+    int at = jumpForward(as, condition);
+    if (as->patchCount == as->patchCapacity) {
+        int capacity = GROW_CAPACITY(as->patchCapacity);
+        as->patches = GROW_ARRAY(Patch, as->patches, as->patchCapacity, capacity);
+        as->patchCapacity = capacity;
+    }
+    as->patches[as->patchCount++] = (Patch){at, target};
+}
+
+static void storeIp(Assembler* as, uint8_t* ip) {
+    moveImmediate(as, RAX, (uint64_t)(uintptr_t)ip);
+    storeQword(as, FRAME, (int32_t)offsetof(CallFrame, ip), RAX);
+}
+
+// stops and hands over to the interpreter at ip
+static void exitAt(Assembler* as, uint8_t* ip) {
+    storeIp(as, ip);
+    emitByte(as, 0xB8);  // mov eax, JIT_EXIT
+    emit32(as, JIT_EXIT);
+    jumpBack(as, -1, as->saveAndReturn);
+}
+
+// Calls one of the helpers above with the VM and up to two more arguments, which must
+// already be in rsi and rdx. next is the ip after the instruction, where an error is
+// reported from
+static void callHelper(Assembler* as, void* helper, uint8_t* next) {
+    storeIp(as, next);
+    storeQword(as, VM_REG, (int32_t)offsetof(VM, stackTop), TOP);
+    moveRegister(as, RDI, VM_REG);
+    moveImmediate(as, RAX, (uint64_t)(uintptr_t)helper);
+    emitByte(as, 0xFF);  // call rax
+    emitByte(as, 0xD0);
+    emitByte(as, 0x3D);  // cmp eax, JIT_CONTINUE
+    emit32(as, JIT_CONTINUE);
+    // anything else and the helper has left the VM's stack as it should be
+    jumpBack(as, CC_NE, as->justReturn);
+    loadQword(as, TOP, VM_REG, (int32_t)offsetof(VM, stackTop));
+}
+
+static void callBinary(Assembler* as, OpCode generic, uint8_t* next) {
+    moveImmediate(as, RSI, generic);
+    callHelper(as, (void*)jitBinary, next);
+}
+
+// Both operands are checked to be of type, jumps to the slow path are added to slow
+static void guardOperands(Assembler* as, ValueType type, int slow[2]) {
+    compareType(as, TOP, TYPE_AT(-2), type);
+    slow[0] = jumpForward(as, CC_NE);
+    compareType(as, TOP, TYPE_AT(-1), type);
+    slow[1] = jumpForward(as, CC_NE);
+}
+
+// +, - or * on two ints, anything else (an overflow included) goes to jitBinary
+static void intArithmetic(Assembler* as, OpCode generic, uint8_t* next) {
+    int slow[2];
+    guardOperands(as, VAL_INT, slow);
+    loadQword(as, RAX, TOP, PAYLOAD_AT(-2));
+    uint32_t opcode = generic == OP_ADD ? 0x03 : generic == OP_SUBTRACT ? 0x2B : 0x0FAF;
+    emitMemoryOp(as, 0, true, opcode, RAX, TOP, PAYLOAD_AT(-1));
+    int overflow = jumpForward(as, CC_O);
+    int zero = -1;
+    if (generic == OP_MULTIPLY) {
+        // a zero might have to be -0, the slow path works out which
+        emitByte(as, 0x48);  // test rax, rax
+        emitByte(as, 0x85);
+        emitByte(as, 0xC0);
+        zero = jumpForward(as, CC_E);
+    }
+    storeQword(as, TOP, PAYLOAD_AT(-2), RAX);
+    adjustTop(as, -1);
+    int done = jumpForward(as, -1);
+
+    landHere(as, slow[0]);
+    landHere(as, slow[1]);
+    landHere(as, overflow);
+    if (zero >= 0) landHere(as, zero);
+    callBinary(as, generic, next);
+    landHere(as, done);
+}
+
+// writes the flag condition leaves as the bool under the top value and pops the top
+static void storeCondition(Assembler* as, int condition) {
+    emitByte(as, 0x0F);  // setcc al
+    emitByte(as, 0x90 | condition);
+    emitByte(as, 0xC0);
+    emitByte(as, 0x0F);  // movzx eax, al
+    emitByte(as, 0xB6);
+    emitByte(as, 0xC0);
+    storeQword(as, TOP, PAYLOAD_AT(-2), RAX);
+    storeType(as, TOP, TYPE_AT(-2), VAL_BOOL);
+    adjustTop(as, -1);
+}
+
+static void intCompare(Assembler* as, OpCode generic, uint8_t* next) {
+    int slow[2];
+    guardOperands(as, VAL_INT, slow);
+    loadQword(as, RAX, TOP, PAYLOAD_AT(-2));
+    emitMemoryOp(as, 0, true, 0x3B, RAX, TOP, PAYLOAD_AT(-1));  // cmp rax, b
+    storeCondition(as, generic == OP_GREATER ? CC_G : CC_L);
+    int done = jumpForward(as, -1);
+    landHere(as, slow[0]);
+    landHere(as, slow[1]);
+    callBinary(as, generic, next);
+    landHere(as, done);
+}
+
+static void doubleArithmetic(Assembler* as, OpCode generic, uint8_t* next) {
+    int slow[2];
+    guardOperands(as, VAL_NUMBER, slow);
+    emitMemoryOp(as, 0xF2, false, 0x0F10, 0, TOP, PAYLOAD_AT(-2));  // movsd xmm0, a
+    uint32_t opcode = generic == OP_ADD ? 0x0F58 : generic == OP_SUBTRACT ? 0x0F5C
+                    : generic == OP_MULTIPLY ? 0x0F59 : 0x0F5E;
+    emitMemoryOp(as, 0xF2, false, opcode, 0, TOP, PAYLOAD_AT(-1));
+    emitMemoryOp(as, 0xF2, false, 0x0F11, 0, TOP, PAYLOAD_AT(-2));  // movsd a, xmm0
+    adjustTop(as, -1);
+    int done = jumpForward(as, -1);
+    landHere(as, slow[0]);
+    landHere(as, slow[1]);
+    callBinary(as, generic, next);
+    landHere(as, done);
+}
+
+static void doubleCompare(Assembler* as, OpCode generic, uint8_t* next) {
+    int slow[2];
+    guardOperands(as, VAL_NUMBER, slow);
+    // a > b and b < a are both "above" once ucomisd has compared them, which is false
+    // when either is NaN
+    int left = generic == OP_GREATER ? -2 : -1;
+    int right = generic == OP_GREATER ? -1 : -2;
+    emitMemoryOp(as, 0xF2, false, 0x0F10, 0, TOP, PAYLOAD_AT(left));
+    emitMemoryOp(as, 0x66, false, 0x0F2E, 0, TOP, PAYLOAD_AT(right));
+    storeCondition(as, CC_A);
+    int done = jumpForward(as, -1);
+    landHere(as, slow[0]);
+    landHere(as, slow[1]);
+    callBinary(as, generic, next);
+    landHere(as, done);
+}
+
+// back edges and calls spend the budget, running out stops at resumeAt
+static void spendBudget(Assembler* as, uint8_t* resumeAt) {
+    emitMemoryOp(as, 0, true, 0x83, 5, BUDGET, 0);  // sub qword [budget], 1
+    emitByte(as, 1);
+    int left = jumpForward(as, CC_NE);
+    exitAt(as, resumeAt);
+    landHere(as, left);
+}
+
+static void emitPrologue(Assembler* as) {
+    // the entry point, pushing the registers we use and loading them from the VM
+    emitByte(as, 0x53);  // push rbx
+    emitByte(as, 0x41);  // push r12 to r15
+    emitByte(as, 0x54);
+    emitByte(as, 0x41);
+    emitByte(as, 0x55);
+    emitByte(as, 0x41);
+    emitByte(as, 0x56);
+    emitByte(as, 0x41);
+    emitByte(as, 0x57);
+    moveRegister(as, VM_REG, RDI);
+    moveRegister(as, FRAME, RSI);
+    moveRegister(as, BUDGET, RDX);
+    loadQword(as, TOP, VM_REG, (int32_t)offsetof(VM, stackTop));
+    loadQword(as, SLOTS, FRAME, (int32_t)offsetof(CallFrame, slots));
+    emitByte(as, 0xFF);  // jmp rcx, to the instruction we're starting at
+    emitByte(as, 0xE1);
+
+    as->saveAndReturn = as->count;
+    storeQword(as, VM_REG, (int32_t)offsetof(VM, stackTop), TOP);
+    as->justReturn = as->count;
+    emitByte(as, 0x41);  // pop r15 to r12
+    emitByte(as, 0x5F);
+    emitByte(as, 0x41);
+    emitByte(as, 0x5E);
+    emitByte(as, 0x41);
+    emitByte(as, 0x5D);
+    emitByte(as, 0x41);
+    emitByte(as, 0x5C);
+    emitByte(as, 0x5B);  // pop rbx
+    emitByte(as, 0xC3);  // ret
+}
+
+// Emits the template for the instruction at ip, returning false if the interpreter
+// has to run it instead
+static bool emitInstruction(Assembler* as, Chunk* chunk, uint8_t* ip) {
+    uint8_t op = ip[0];
+    uint8_t* next = ip + instructionLength(op);
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            pushConstant(as, chunk->constants.values[instructionOperand(ip)]);
+            return true;
+        case OP_NIL: pushConstant(as, NIL_VAL); return true;
+        case OP_TRUE: pushConstant(as, BOOL_VAL(true)); return true;
+        case OP_FALSE: pushConstant(as, BOOL_VAL(false)); return true;
+        case OP_POP: adjustTop(as, -1); return true;
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG:
+            copyValue(as, TOP, 0, SLOTS, instructionOperand(ip) * VALUE_SIZE);
+            adjustTop(as, 1);
+            return true;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG:
+            copyValue(as, SLOTS, instructionOperand(ip) * VALUE_SIZE, TOP, -VALUE_SIZE);
+            return true;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG: {
+            ObjString* name = AS_STRING(chunk->constants.values[instructionOperand(ip)]);
+            moveImmediate(as, RSI, (uint64_t)(uintptr_t)name);
+            void* helper = op == OP_GET_GLOBAL || op == OP_GET_GLOBAL_LONG ? (void*)jitGetGlobal
+                         : op == OP_SET_GLOBAL || op == OP_SET_GLOBAL_LONG ? (void*)jitSetGlobal
+                         : (void*)jitDefineGlobal;
+            callHelper(as, helper, next);
+            return true;
+        }
+        case OP_EQUAL: callBinary(as, OP_EQUAL, next); return true;
+
+        case OP_ADD:
+        case OP_ADD_INT:
+        case OP_ADD_NUMBERS:
+            intArithmetic(as, OP_ADD, next);
+            return true;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_INT:
+        case OP_SUBTRACT_NUMBERS:
+            intArithmetic(as, OP_SUBTRACT, next);
+            return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_INT:
+        case OP_MULTIPLY_NUMBERS:
+            intArithmetic(as, OP_MULTIPLY, next);
+            return true;
+        case OP_ADD_NUM: doubleArithmetic(as, OP_ADD, next); return true;
+        case OP_SUBTRACT_NUM: doubleArithmetic(as, OP_SUBTRACT, next); return true;
+        case OP_MULTIPLY_NUM: doubleArithmetic(as, OP_MULTIPLY, next); return true;
+        case OP_DIVIDE_NUM: doubleArithmetic(as, OP_DIVIDE, next); return true;
+        case OP_ADD_STR: callBinary(as, OP_ADD, next); return true;
+        case OP_DIVIDE:
+        case OP_DIVIDE_INT:
+        case OP_DIVIDE_NUMBERS:
+            callBinary(as, OP_DIVIDE, next);
+            return true;
+        case OP_GREATER:
+        case OP_GREATER_INT:
+        case OP_GREATER_NUMBERS:
+            intCompare(as, OP_GREATER, next);
+            return true;
+        case OP_LESS:
+        case OP_LESS_INT:
+        case OP_LESS_NUMBERS:
+            intCompare(as, OP_LESS, next);
+            return true;
+        case OP_GREATER_NUM: doubleCompare(as, OP_GREATER, next); return true;
+        case OP_LESS_NUM: doubleCompare(as, OP_LESS, next); return true;
+        case OP_NOT: callHelper(as, (void*)jitNot, next); return true;
+        case OP_NEGATE:
+        case OP_NEGATE_NUMBER:
+            callHelper(as, (void*)jitNegate, next);
+            return true;
+        case OP_PRINT: callHelper(as, (void*)jitPrint, next); return true;
+        case OP_GET_INDEX: callHelper(as, (void*)jitGetIndex, next); return true;
+        case OP_SET_INDEX: callHelper(as, (void*)jitSetIndex, next); return true;
+
+        case OP_JUMP:
+            jumpToInstruction(as, -1, (int)(next - chunk->code) + jumpOffset(ip));
+            return true;
+        case OP_JUMP_IF_FALSE: {
+            int target = (int)(next - chunk->code) + jumpOffset(ip);
+            // nil, or a bool that's false
+            emitMemoryOp(as, 0, false, 0x8B, RAX, TOP, TYPE_AT(-1));  // mov eax, type
+            emitByte(as, 0x3D);
+            emit32(as, VAL_NIL);
+            jumpToInstruction(as, CC_E, target);
+            emitByte(as, 0x3D);
+            emit32(as, VAL_BOOL);
+            int truthy = jumpForward(as, CC_NE);
+            emitMemoryOp(as, 0, false, 0x80, 7, TOP, PAYLOAD_AT(-1));  // cmp byte, 0
+            emitByte(as, 0);
+            jumpToInstruction(as, CC_E, target);
+            landHere(as, truthy);
+            return true;
+        }
+        case OP_JUMP_BACK:
+        case OP_LOOP: {
+            int target = (int)(next - chunk->code) - jumpOffset(ip);
+            if (op == OP_LOOP) {
+                uint64_t* counter = &chunk->loopCounters[(ip[3] << 8) | ip[4]];
+                moveImmediate(as, RAX, (uint64_t)(uintptr_t)counter);
+                emitMemoryOp(as, 0, true, 0xFF, 0, RAX, 0);  // inc qword [rax]
+            }
+            spendBudget(as, chunk->code + target);
+            jumpToInstruction(as, -1, target);
+            return true;
+        }
+        case OP_CALL:
+            moveImmediate(as, RSI, ip[1]);
+            moveRegister(as, RDX, BUDGET);
+            callHelper(as, (void*)jitCall, next);
+            return true;
+        default:
+            // calls into lox, returns and making arrays
+            exitAt(as, ip);
+            return false;
+    }
+}
+
+bool compileJit(ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    if (chunk->frozen || function->jit != NULL) return false;
+
+    Assembler as;
+    memset(&as, 0, sizeof(as));
+    as.labels = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++) as.labels[i] = -1;
+    bool* enterable = ALLOCATE(bool, chunk->count);
+
+    emitPrologue(&as);
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk->code[offset])) {
+        as.labels[offset] = as.count;
+        enterable[offset] = emitInstruction(&as, chunk, chunk->code + offset);
+    }
+    for (int i = 0; i < as.patchCount; i++) {
+        Patch* patch = &as.patches[i];
+        patch32(&as, patch->at, as.labels[patch->target] - (patch->at + 4));
+    }
+
+    // written while it's writable and only then made executable, never both at once
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t)as.count + pageSize - 1) / pageSize * pageSize;
+    uint8_t* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+    bool compiled = memory != MAP_FAILED;
+    if (compiled) {
+        memcpy(memory, as.code, (size_t)as.count);
+        if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+            munmap(memory, size);
+            compiled = false;
+        }
+    }
+    if (compiled) {
+        JitCode* jit = ALLOCATE(JitCode, 1);
+        jit->memory = memory;
+        jit->size = size;
+        jit->enter = (JitEntry)(void*)memory;
+        jit->entryCount = chunk->count;
+        jit->entries = ALLOCATE(void*, chunk->count);
+        for (int i = 0; i < chunk->count; i++) {
+            jit->entries[i] = as.labels[i] >= 0 && enterable[i] ? memory + as.labels[i] : NULL;
+        }
+        function->jit = jit;
+    }
+
+    FREE_ARRAY(uint8_t, as.code, as.capacity);
+    FREE_ARRAY(int, as.labels, chunk->count);
+    FREE_ARRAY(Patch, as.patches, as.patchCapacity);
+    FREE_ARRAY(bool, enterable, chunk->count);
+    return compiled;
+}
+
+#else
+
+bool compileJit(ObjFunction* function) {
+    (void)function;
+    return false;
+}
+
+#endif
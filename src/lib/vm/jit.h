@@ -0,0 +1,75 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+#include "vm.h"
+
+// once a function has been called this many times we consider it hot
+#define HOT_CALL_THRESHOLD 1000
+
+// A baseline JIT. With the VM's jit flag set (clox --jit), a function whose loops or
+// calls get hot has its whole chunk translated into x86-64 machine code, each
+// instruction stitched together from a fixed template for its opcode. The machine code
+// works on the very same frames and value stack the interpreter does, keeping the top
+// of the stack in a register, so control can pass between the two at any instruction.
+//
+// The common instructions (constants, locals, int and double arithmetic and
+// comparisons, jumps and loops) are done inline. Anything the templates don't cover,
+// globals, indexing, natives and operands of the wrong type, calls back into C. A few
+// instructions it leaves to the interpreter altogether, calls to other lox functions
+// and returns among them: the machine code stops with the frame's ip at the
+// instruction, and the interpreter carries on from there until the next back edge,
+// call or return lets it jump back into machine code.
+//
+// Runtime errors are reported by the same code paths as the interpreter's, with the
+// same stack traces, and back edges and calls spend the same budget. Chunks of a
+// shared Script are frozen and never compiled, and on anything other than x86-64
+// compileJit always fails so the interpreter runs everything
+
+// what running machine code ended with
+typedef enum {
+    // the frame on top of the VM's (which may not be the one we entered in) says where
+    // to carry on interpreting
+    JIT_EXIT,
+    // a runtime error, already reported
+    JIT_ERROR,
+    // only ever seen inside the machine code, a call into C went fine and it carries on
+    JIT_CONTINUE,
+} JitStatus;
+
+typedef JitStatus (*JitEntry)(struct VM* vm, CallFrame* frame, int64_t* budget, void* start);
+
+typedef struct JitCode {
+    // the executable mapping, the prologue that enter jumps through is at its start
+    void* memory;
+    size_t size;
+    JitEntry enter;
+    // Where the machine code for each instruction starts, by the instruction's offset
+    // in the chunk. NULL for offsets in the middle of an instruction and for
+    // instructions left to the interpreter, entering at those would just stop again
+    void** entries;
+    int entryCount;
+} JitCode;
+
+// compiles function's chunk, returning false if it can't (it's frozen, or this isn't
+// x86-64, or there's no executable memory to be had)
+bool compileJit(ObjFunction* function);
+void freeJit(JitCode* jit);
+
+// Whether function has machine code to enter at ip. The machine code only covers the
+// chunk as it was when it was compiled, an offset past that has no entry
+static inline bool hasJitEntry(ObjFunction* function, const uint8_t* ip) {
+    JitCode* jit = function->jit;
+    if (jit == NULL) return false;
+    ptrdiff_t offset = ip - function->chunk.code;
+    return offset < jit->entryCount && jit->entries[offset] != NULL;
+}
+
+// Runs frame's function in machine code from frame->ip, which must have an entry (see
+// hasJitEntry), spending budget the same way the interpreter does
+static inline JitStatus runJit(struct VM* vm, CallFrame* frame, int64_t* budget) {
+    JitCode* jit = frame->function->jit;
+    return jit->enter(vm, frame, budget, jit->entries[frame->ip - frame->function->chunk.code]);
+}
+
+#endif
@@ -0,0 +1,473 @@
+// accept4 and pipe2 let us make descriptors non blocking in the same call
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "loop.h"
+#include "memory.h"
+#include "vm.h"
+
+// the most a single read() gives back
+#define READ_SIZE (64 * 1024)
+// how many ready file descriptors we take from epoll at a time
+#define MAX_EVENTS 64
+
+// A script writing to a pipe or socket nobody reads any more should get nil back, not
+// have the whole process killed by SIGPIPE
+static pthread_once_t ignoreSigpipeOnce = PTHREAD_ONCE_INIT;
+
+static void ignoreSigpipe() {
+    signal(SIGPIPE, SIG_IGN);
+}
+
+void initLoop(EventLoop* loop) {
+    pthread_once(&ignoreSigpipeOnce, ignoreSigpipe);
+    loop->epollFd = -1;
+    loop->waiting = NULL;
+    loop->readyHead = NULL;
+    loop->readyTail = NULL;
+}
+
+static Waiter* newWaiter(ObjFiber* fiber, WaitKind kind, int fd) {
+    Waiter* waiter = ALLOCATE(Waiter, 1);
+    waiter->fiber = fiber;
+    waiter->kind = kind;
+    waiter->fd = fd;
+    waiter->data = NULL;
+    waiter->written = 0;
+    waiter->result = NIL_VAL;
+    waiter->previous = NULL;
+    waiter->next = NULL;
+    return waiter;
+}
+
+static void makeReady(EventLoop* loop, Waiter* waiter) {
+    waiter->previous = NULL;
+    waiter->next = NULL;
+    if (loop->readyTail == NULL) {
+        loop->readyHead = waiter;
+    } else {
+        loop->readyTail->next = waiter;
+    }
+    loop->readyTail = waiter;
+}
+
+// takes waiter off the waiting list and out of epoll
+static void stopWaiting(EventLoop* loop, Waiter* waiter) {
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, waiter->fd, NULL);
+    // a sleep's timer is ours, nobody else will close it
+    if (waiter->kind == WAIT_SLEEP) close(waiter->fd);
+    if (waiter->previous != NULL) {
+        waiter->previous->next = waiter->next;
+    } else {
+        loop->waiting = waiter->next;
+    }
+    if (waiter->next != NULL) waiter->next->previous = waiter->previous;
+}
+
+void resetLoop(EventLoop* loop) {
+    while (loop->waiting != NULL) {
+        Waiter* waiter = loop->waiting;
+        stopWaiting(loop, waiter);
+        waiter->fiber->state = FIBER_DONE;
+        FREE(Waiter, waiter);
+    }
+    while (loop->readyHead != NULL) {
+        Waiter* waiter = loop->readyHead;
+        loop->readyHead = waiter->next;
+        waiter->fiber->state = FIBER_DONE;
+        FREE(Waiter, waiter);
+    }
+    loop->readyTail = NULL;
+}
+
+void freeLoop(EventLoop* loop) {
+    resetLoop(loop);
+    if (loop->epollFd != -1) close(loop->epollFd);
+    loop->epollFd = -1;
+}
+
+// Tries waiter's operation without blocking. Returns true once it has gone through,
+// or failed, with what the fiber's call returns in waiter->result, and false if it
+// would have to block
+static bool attempt(VM* vm, Waiter* waiter) {
+    switch (waiter->kind) {
+        case WAIT_START:
+        case WAIT_NOTHING:
+            return true;
+        case WAIT_READ: {
+            char buffer[READ_SIZE];
+            ssize_t count;
+            do {
+                count = read(waiter->fd, buffer, sizeof(buffer));
+            } while (count < 0 && errno == EINTR);
+            if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+            // an empty string is the end of the file, nil is an error
+            waiter->result = count < 0 ? NIL_VAL
+                                       : OBJ_VAL(copyString(&vm->heap, buffer, (int)count));
+            return true;
+        }
+        case WAIT_WRITE: {
+            ObjString* data = waiter->data;
+            while (waiter->written < (size_t)data->length) {
+                ssize_t count = write(waiter->fd, data->chars + waiter->written,
+                                      (size_t)data->length - waiter->written);
+                if (count < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+                    waiter->result = NIL_VAL;
+                    return true;
+                }
+                waiter->written += (size_t)count;
+            }
+            waiter->result = INT_VAL((int64_t)waiter->written);
+            return true;
+        }
+        case WAIT_ACCEPT: {
+            int fd = accept4(waiter->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return false;
+            }
+            waiter->result = fd < 0 ? NIL_VAL : INT_VAL(fd);
+            return true;
+        }
+        case WAIT_CONNECT: {
+            // only asked once the socket is writable, which means the connect finished
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(waiter->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+                error = errno;
+            }
+            if (error != 0) close(waiter->fd);
+            waiter->result = error != 0 ? NIL_VAL : INT_VAL(waiter->fd);
+            return true;
+        }
+        case WAIT_SLEEP: {
+            uint64_t expirations;
+            if (read(waiter->fd, &expirations, sizeof(expirations)) < 0) return false;
+            waiter->result = NIL_VAL;
+            return true;
+        }
+    }
+    return true; // unreachable
+}
+
+// waits for at least one file descriptor to be ready, and moves every waiter whose
+// operation then goes through onto the ready list
+static void pollLoop(VM* vm) {
+    EventLoop* loop = &vm->loop;
+    struct epoll_event events[MAX_EVENTS];
+    int count = epoll_wait(loop->epollFd, events, MAX_EVENTS, -1);
+    if (count < 0) {
+        if (errno == EINTR) return;
+        fprintf(stderr, "The event loop failed: %s.\n", strerror(errno));
+        exit(70);
+    }
+    for (int i = 0; i < count; i++) {
+        Waiter* waiter = (Waiter*)events[i].data.ptr;
+        // a write that only got part of the way stays where it is
+        if (!attempt(vm, waiter)) continue;
+        stopWaiting(loop, waiter);
+        makeReady(loop, waiter);
+    }
+}
+
+bool runNextFiber(VM* vm) {
+    EventLoop* loop = &vm->loop;
+    while (loop->readyHead == NULL) {
+        if (loop->waiting == NULL) return false;
+        pollLoop(vm);
+    }
+    Waiter* waiter = loop->readyHead;
+    loop->readyHead = waiter->next;
+    if (loop->readyHead == NULL) loop->readyTail = NULL;
+    ObjFiber* fiber = waiter->fiber;
+    Value result = waiter->result;
+    // a spawned fiber was only marked as waiting so nobody else would resume it
+    if (waiter->kind == WAIT_START) fiber->state = FIBER_NEW;
+    FREE(Waiter, waiter);
+    transferFiber(vm, fiber, result);
+    return true;
+}
+
+// Stops the running fiber until op's file descriptor is ready for events, and
+// switches to the next one. The native calling this then just returns, the fiber's
+// result is delivered when its operation goes through
+static bool park(VM* vm, Waiter* op, Value* args, uint32_t events) {
+    EventLoop* loop = &vm->loop;
+    for (Waiter* other = loop->waiting; other != NULL; other = other->next) {
+        if (other->fd == op->fd) {
+            return nativeError(vm, "Another fiber is already waiting on file %d.", op->fd);
+        }
+    }
+    if (loop->epollFd == -1) {
+        loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epollFd == -1) return nativeError(vm, "Couldn't start the event loop.");
+    }
+
+    Waiter* waiter = newWaiter(vm->fiber, op->kind, op->fd);
+    waiter->data = op->data;
+    waiter->written = op->written;
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = waiter;
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, waiter->fd, &event) == -1) {
+        FREE(Waiter, waiter);
+        return nativeError(vm, "Can't wait on file %d.", op->fd);
+    }
+    waiter->next = loop->waiting;
+    if (loop->waiting != NULL) loop->waiting->previous = waiter;
+    loop->waiting = waiter;
+
+    // our result slot is left on top for the result to go in
+    vm->fiber->state = FIBER_WAITING;
+    vm->stackTop = args;
+    // there's always something to wait for, this fiber if nothing else
+    runNextFiber(vm);
+    return true;
+}
+
+// file descriptors are plain numbers, the ones pipe() gives back come out of an array
+// so they're doubles
+static bool expectFd(VM* vm, const char* name, Value value, int* fd) {
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        if (number >= 0 && number <= INT32_MAX && number == (int)number) {
+            *fd = (int)number;
+            return true;
+        }
+    }
+    // spelled out so optimised builds can see fd is set whenever we return true
+    nativeError(vm, "%s() expects a file descriptor.", name);
+    return false;
+}
+
+static bool expectPath(VM* vm, const char* name, Value value) {
+    if (IS_STRING(value)) return true;
+    return nativeError(vm, "%s() expects a path.", name);
+}
+
+// the attempt a native makes straight away, it only becomes a real Waiter if it parks
+static Waiter attemptOn(WaitKind kind, int fd) {
+    Waiter waiter;
+    waiter.fiber = NULL;
+    waiter.kind = kind;
+    waiter.fd = fd;
+    waiter.data = NULL;
+    waiter.written = 0;
+    waiter.result = NIL_VAL;
+    waiter.previous = NULL;
+    waiter.next = NULL;
+    return waiter;
+}
+
+// spawn(fn, argument) makes a fiber that runs fn on its own whenever the fibers
+// already running stop to wait, and returns it. The script isn't done until it is
+static bool spawnNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (argCount < 1 || argCount > 2) {
+        return nativeError(vm, "spawn() expects a function and an optional argument.");
+    }
+    if (!IS_FUNCTION(args[0])) return nativeError(vm, "spawn() expects a function.");
+    ObjFunction* function = AS_FUNCTION(args[0]);
+    if (function->arity > 1) {
+        return nativeError(vm, "A fiber's function can take at most one argument.");
+    }
+    ObjFiber* fiber = newFiber(&vm->heap, function);
+    // so nothing resumes it before the loop starts it
+    fiber->state = FIBER_WAITING;
+    Waiter* waiter = newWaiter(fiber, WAIT_START, -1);
+    waiter->result = argCount == 2 ? args[1] : NIL_VAL;
+    makeReady(&vm->loop, waiter);
+    *result = OBJ_VAL(fiber);
+    return true;
+}
+
+// sleep(ms) lets every other fiber run for at least ms milliseconds, sleep(0) just
+// lets the ones that are ready have a turn
+static bool sleepNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!IS_NUMBER(args[0])) return nativeError(vm, "sleep() expects a number of milliseconds.");
+    double ms = AS_NUMBER(args[0]);
+    if (!(ms > 0)) {
+        Waiter* waiter = newWaiter(vm->fiber, WAIT_NOTHING, -1);
+        makeReady(&vm->loop, waiter);
+        vm->fiber->state = FIBER_WAITING;
+        vm->stackTop = args;
+        runNextFiber(vm);
+        return true;
+    }
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) return nativeError(vm, "Couldn't make a timer.");
+    struct itimerspec time;
+    memset(&time, 0, sizeof(time));
+    time.it_value.tv_sec = (time_t)(ms / 1000);
+    time.it_value.tv_nsec = (long)((ms - (double)time.it_value.tv_sec * 1000) * 1e6);
+    // a timer set to 0 is disarmed rather than firing straight away
+    if (time.it_value.tv_sec == 0 && time.it_value.tv_nsec == 0) time.it_value.tv_nsec = 1;
+    timerfd_settime(fd, 0, &time, NULL);
+    Waiter op = attemptOn(WAIT_SLEEP, fd);
+    if (!park(vm, &op, args, EPOLLIN)) {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+// open(path, mode) with mode "r", "w" (which empties the file) or "a", returns a file
+// descriptor or nil if the file can't be opened
+static bool openNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectPath(vm, "open", args[0])) return false;
+    if (!IS_STRING(args[1])) return nativeError(vm, "open() expects a mode.");
+    const char* mode = AS_CSTRING(args[1]);
+    int flags;
+    if (strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (strcmp(mode, "a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        return nativeError(vm, "open() mode must be \"r\", \"w\" or \"a\".");
+    }
+    // non blocking only matters for fifos and devices, regular files are always ready
+    int fd = open(AS_CSTRING(args[0]), flags | O_NONBLOCK | O_CLOEXEC, 0666);
+    *result = fd < 0 ? NIL_VAL : INT_VAL(fd);
+    return true;
+}
+
+// pipe() gives back [read end, write end]
+static bool pipeNative(VM* vm, int argCount, Value* args, Value* result) {
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        *result = NIL_VAL;
+        return true;
+    }
+    ObjArray* ends = newArray(&vm->heap, 2);
+    ends->values[0] = fds[0];
+    ends->values[1] = fds[1];
+    *result = OBJ_VAL(ends);
+    return true;
+}
+
+// read(fd) gives back whatever is there, up to 64KB, waiting if there's nothing yet.
+// An empty string means the end of the file, and nil an error
+static bool readNative(VM* vm, int argCount, Value* args, Value* result) {
+    int fd;
+    if (!expectFd(vm, "read", args[0], &fd)) return false;
+    Waiter op = attemptOn(WAIT_READ, fd);
+    if (!attempt(vm, &op)) return park(vm, &op, args, EPOLLIN);
+    *result = op.result;
+    return true;
+}
+
+// write(fd, text) writes all of text, waiting for room as often as it has to, and
+// gives back how many bytes that was, or nil on an error
+static bool writeNative(VM* vm, int argCount, Value* args, Value* result) {
+    int fd;
+    if (!expectFd(vm, "write", args[0], &fd)) return false;
+    if (!IS_STRING(args[1])) return nativeError(vm, "write() expects a string.");
+    Waiter op = attemptOn(WAIT_WRITE, fd);
+    op.data = AS_STRING(args[1]);
+    if (!attempt(vm, &op)) return park(vm, &op, args, EPOLLOUT);
+    *result = op.result;
+    return true;
+}
+
+static bool closeNative(VM* vm, int argCount, Value* args, Value* result) {
+    int fd;
+    if (!expectFd(vm, "close", args[0], &fd)) return false;
+    // closing it would quietly take it out of epoll and leave the fiber stuck for good
+    for (Waiter* waiter = vm->loop.waiting; waiter != NULL; waiter = waiter->next) {
+        if (waiter->fd == fd) {
+            return nativeError(vm, "Can't close file %d while a fiber is waiting on it.", fd);
+        }
+    }
+    close(fd);
+    *result = NIL_VAL;
+    return true;
+}
+
+// fills in address for the local socket at path, false if the path is too long
+static bool socketAddress(struct sockaddr_un* address, ObjString* path) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if ((size_t)path->length >= sizeof(address->sun_path)) return false;
+    memcpy(address->sun_path, path->chars, (size_t)path->length);
+    return true;
+}
+
+// listen(path) makes a local socket at path for accept(), or gives back nil
+static bool listenNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectPath(vm, "listen", args[0])) return false;
+    *result = NIL_VAL;
+    struct sockaddr_un address;
+    if (!socketAddress(&address, AS_STRING(args[0]))) return true;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return true;
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return true;
+    }
+    *result = INT_VAL(fd);
+    return true;
+}
+
+// accept(fd) waits for a connection to a listening socket and gives back its fd
+static bool acceptNative(VM* vm, int argCount, Value* args, Value* result) {
+    int fd;
+    if (!expectFd(vm, "accept", args[0], &fd)) return false;
+    Waiter op = attemptOn(WAIT_ACCEPT, fd);
+    if (!attempt(vm, &op)) return park(vm, &op, args, EPOLLIN);
+    *result = op.result;
+    return true;
+}
+
+// connect(path) connects to the local socket at path, or gives back nil
+static bool connectNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectPath(vm, "connect", args[0])) return false;
+    *result = NIL_VAL;
+    struct sockaddr_un address;
+    if (!socketAddress(&address, AS_STRING(args[0]))) return true;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return true;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        *result = INT_VAL(fd);
+        return true;
+    }
+    if (errno != EINPROGRESS && errno != EAGAIN) {
+        close(fd);
+        return true;
+    }
+    Waiter op = attemptOn(WAIT_CONNECT, fd);
+    if (!park(vm, &op, args, EPOLLOUT)) {
+        close(fd);
+        return false;
+    }
+    return true;
+}
+
+const NativeDef loopNatives[] = {
+    {"spawn", spawnNative, NATIVE_VARIADIC},
+    {"sleep", sleepNative, 1},
+    {"open", openNative, 2},
+    {"pipe", pipeNative, 0},
+    {"read", readNative, 1},
+    {"write", writeNative, 2},
+    {"close", closeNative, 1},
+    {"listen", listenNative, 1},
+    {"accept", acceptNative, 1},
+    {"connect", connectNative, 1},
+};
+
+const int loopNativeCount = (int)(sizeof(loopNatives) / sizeof(loopNatives[0]));
@@ -0,0 +1,71 @@
+#ifndef clox_loop_h
+#define clox_loop_h
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+struct VM;
+
+// What a fiber is waiting for, see Waiter
+typedef enum {
+    // on the ready list, about to start running the function it was spawned with
+    WAIT_START,
+    // on the ready list with nothing to wait for, sleep(0) puts a fiber here
+    WAIT_NOTHING,
+    WAIT_READ,
+    WAIT_WRITE,
+    WAIT_ACCEPT,
+    WAIT_CONNECT,
+    WAIT_SLEEP,
+} WaitKind;
+
+// A fiber that can't carry on until some file descriptor is ready. It's registered
+// with epoll while it waits, and once its operation has gone through it moves to the
+// ready list with the operation's result, to be switched to when the running fiber
+// stops
+typedef struct Waiter {
+    ObjFiber* fiber;
+    WaitKind kind;
+    int fd;
+    // a write's text and how much of it has gone out so far
+    ObjString* data;
+    size_t written;
+    // what the fiber's call returns once it's done
+    Value result;
+    struct Waiter* previous;
+    struct Waiter* next;
+} Waiter;
+
+// Every VM has one. Blocking natives called from any fiber, the main one included, try
+// their operation straight away and only if it would block do they park the fiber here
+// and switch to the next one that's ready, calling epoll_wait when none are. Nothing
+// else ever blocks, so one VM thread keeps any number of I/O operations going.
+//
+// Spawned fibers go on the ready list too, and a script isn't finished until every
+// fiber it spawned is
+typedef struct {
+    // made the first time a fiber has to wait, -1 until then
+    int epollFd;
+    // registered with epoll
+    Waiter* waiting;
+    // ready to run, in the order they became ready
+    Waiter* readyHead;
+    Waiter* readyTail;
+} EventLoop;
+
+void initLoop(EventLoop* loop);
+// Forgets every fiber waiting or ready to run, a runtime error ends them all. Files the
+// script opened stay open, they belong to the script
+void resetLoop(EventLoop* loop);
+void freeLoop(EventLoop* loop);
+// Called when the running fiber can't carry on, because it's finished or waiting.
+// Switches to the next fiber that's ready, waiting for one if it has to. Returns false
+// if there are none and nothing left to wait for
+bool runNextFiber(struct VM* vm);
+// spawn, sleep, and the file, pipe and local socket natives, defineNatives defines
+// them along with the rest
+extern const NativeDef loopNatives[];
+extern const int loopNativeCount;
+
+#endif
@@ -0,0 +1,550 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpu.h"
+#include "format.h"
+#include "memory.h"
+#include "natives.h"
+#include "number.h"
+#include "object.h"
+
+// Every native checks its own arguments, the VM has only made sure there are the
+// right number of them. Results are written straight into result, which is the slot
+// the native itself was in
+
+static bool expectNumber(VM* vm, const char* name, Value value) {
+    if (IS_NUMBER(value)) return true;
+    return nativeError(vm, "%s() expects a number.", name);
+}
+
+static bool expectString(VM* vm, const char* name, Value value) {
+    if (IS_STRING(value)) return true;
+    return nativeError(vm, "%s() expects a string.", name);
+}
+
+static bool expectArray(VM* vm, const char* name, Value value) {
+    if (IS_ARRAY(value)) return true;
+    return nativeError(vm, "%s() expects an array.", name);
+}
+
+// seconds since the program started, for timing things
+static bool clockNative(VM* vm, int argCount, Value* args, Value* result) {
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+// the math functions that take a double and give one back all look the same
+#define MATH_NATIVE(native, fn) \
+    static bool native(VM* vm, int argCount, Value* args, Value* result) { \
+        if (!expectNumber(vm, #fn, args[0])) return false; \
+        *result = NUMBER_VAL(fn(AS_NUMBER(args[0]))); \
+        return true; \
+    }
+
+MATH_NATIVE(sqrtNative, sqrt)
+MATH_NATIVE(sinNative, sin)
+MATH_NATIVE(cosNative, cos)
+MATH_NATIVE(tanNative, tan)
+MATH_NATIVE(atanNative, atan)
+MATH_NATIVE(expNative, exp)
+MATH_NATIVE(logNative, log)
+
+#undef MATH_NATIVE
+
+// Rounding an int changes nothing, so ints come back as they are. A double that is a
+// whole number after rounding stays a double, 2.5 rounds to 3 but prints the same
+#define ROUNDING_NATIVE(native, fn) \
+    static bool native(VM* vm, int argCount, Value* args, Value* result) { \
+        if (!expectNumber(vm, #fn, args[0])) return false; \
+        *result = IS_INT(args[0]) ? args[0] : NUMBER_VAL(fn(AS_DOUBLE(args[0]))); \
+        return true; \
+    }
+
+ROUNDING_NATIVE(floorNative, floor)
+ROUNDING_NATIVE(ceilNative, ceil)
+ROUNDING_NATIVE(roundNative, round)
+
+#undef ROUNDING_NATIVE
+
+static bool absNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectNumber(vm, "abs", args[0])) return false;
+    Value value = args[0];
+    // like negation, INT64_MIN has no positive int
+    if (IS_INT(value) && AS_INT(value) != INT64_MIN) {
+        *result = INT_VAL(AS_INT(value) < 0 ? -AS_INT(value) : AS_INT(value));
+    } else {
+        *result = NUMBER_VAL(fabs(AS_NUMBER(value)));
+    }
+    return true;
+}
+
+static bool powNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectNumber(vm, "pow", args[0]) || !expectNumber(vm, "pow", args[1])) {
+        return false;
+    }
+    *result = NUMBER_VAL(pow(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+    return true;
+}
+
+static bool atan2Native(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectNumber(vm, "atan2", args[0]) || !expectNumber(vm, "atan2", args[1])) {
+        return false;
+    }
+    *result = NUMBER_VAL(atan2(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+    return true;
+}
+
+// min and max take any number of arguments and give back whichever one it was, so an
+// int stays an int. Given a single array they give its smallest or largest element
+static bool extremeNative(VM* vm, const char* name, bool wantMax, int argCount,
+                          Value* args, Value* result) {
+    if (argCount == 0) return nativeError(vm, "%s() expects at least one argument.", name);
+    if (argCount == 1 && IS_ARRAY(args[0])) {
+        ObjArray* array = AS_ARRAY(args[0]);
+        if (array->count == 0) return nativeError(vm, "%s() of an empty array.", name);
+        double extreme = wantMax ? kernels.maxDoubles(array->values, array->count)
+                                 : kernels.minDoubles(array->values, array->count);
+        *result = NUMBER_VAL(extreme);
+        return true;
+    }
+    Value best = args[0];
+    if (!expectNumber(vm, name, best)) return false;
+    for (int i = 1; i < argCount; i++) {
+        Value value = args[i];
+        if (!expectNumber(vm, name, value)) return false;
+        bool better;
+        if (IS_INT(value) && IS_INT(best)) {
+            better = wantMax ? AS_INT(value) > AS_INT(best) : AS_INT(value) < AS_INT(best);
+        } else {
+            better = wantMax ? AS_NUMBER(value) > AS_NUMBER(best)
+                             : AS_NUMBER(value) < AS_NUMBER(best);
+        }
+        if (better) best = value;
+    }
+    *result = best;
+    return true;
+}
+
+static bool minNative(VM* vm, int argCount, Value* args, Value* result) {
+    return extremeNative(vm, "min", false, argCount, args, result);
+}
+
+static bool maxNative(VM* vm, int argCount, Value* args, Value* result) {
+    return extremeNative(vm, "max", true, argCount, args, result);
+}
+
+static bool lenNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (IS_ARRAY(args[0])) {
+        *result = INT_VAL(AS_ARRAY(args[0])->count);
+        return true;
+    }
+    if (!expectString(vm, "len", args[0])) return false;
+    *result = INT_VAL(AS_STRING(args[0])->length);
+    return true;
+}
+
+// substr(string, start, length), both clamped to the string so it never fails on a
+// range that runs off the end
+static bool substrNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectString(vm, "substr", args[0])) return false;
+    if (!IS_INT(args[1]) || !IS_INT(args[2])) {
+        return nativeError(vm, "substr() expects a whole number start and length.");
+    }
+    ObjString* string = AS_STRING(args[0]);
+    int64_t start = AS_INT(args[1]);
+    int64_t length = AS_INT(args[2]);
+    if (start < 0) start = 0;
+    if (start > string->length) start = string->length;
+    if (length < 0) length = 0;
+    if (length > string->length - start) length = string->length - start;
+    *result = OBJ_VAL(copyString(&vm->heap, string->chars + start, (int)length));
+    return true;
+}
+
+// upper and lower only change ASCII letters, anything else is copied as it is
+static bool changeCase(VM* vm, const char* name, bool upper, Value* args,
+                       Value* result) {
+    if (!expectString(vm, name, args[0])) return false;
+    ObjString* string = AS_STRING(args[0]);
+    char* chars = ALLOCATE(char, string->length + 1);
+    for (int i = 0; i < string->length; i++) {
+        char c = string->chars[i];
+        if (upper && c >= 'a' && c <= 'z') c = (char)(c - 'a' + 'A');
+        if (!upper && c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+        chars[i] = c;
+    }
+    chars[string->length] = '\0';
+    *result = OBJ_VAL(takeString(&vm->heap, chars, string->length));
+    return true;
+}
+
+static bool upperNative(VM* vm, int argCount, Value* args, Value* result) {
+    return changeCase(vm, "upper", true, args, result);
+}
+
+static bool lowerNative(VM* vm, int argCount, Value* args, Value* result) {
+    return changeCase(vm, "lower", false, args, result);
+}
+
+// the elements of array written out the way print shows them
+static ObjString* arrayString(VM* vm, ObjArray* array) {
+    int capacity = 2 + array->count * (NUMBER_BUFFER_SIZE + 2);
+    char* chars = ALLOCATE(char, capacity);
+    int length = 0;
+    chars[length++] = '[';
+    for (int i = 0; i < array->count; i++) {
+        if (i > 0) {
+            chars[length++] = ',';
+            chars[length++] = ' ';
+        }
+        length += formatNumber(array->values[i], chars + length);
+    }
+    chars[length++] = ']';
+    ObjString* string = copyString(&vm->heap, chars, length);
+    FREE_ARRAY(char, chars, capacity);
+    return string;
+}
+
+// the text print would write for value
+static bool strNative(VM* vm, int argCount, Value* args, Value* result) {
+    Value value = args[0];
+    char text[NUMBER_BUFFER_SIZE];
+    int length;
+    switch (value.type) {
+        case VAL_BOOL:
+            strcpy(text, AS_BOOL(value) ? "true" : "false");
+            length = (int)strlen(text);
+            break;
+        case VAL_NIL:
+            strcpy(text, "nil");
+            length = 3;
+            break;
+        case VAL_NUMBER: length = formatNumber(AS_DOUBLE(value), text); break;
+        case VAL_INT: length = formatInteger(AS_INT(value), text); break;
+        case VAL_OBJ: {
+            if (IS_STRING(value)) {
+                *result = value;
+                return true;
+            }
+            if (IS_ARRAY(value)) {
+                *result = OBJ_VAL(arrayString(vm, AS_ARRAY(value)));
+                return true;
+            }
+            ObjString* name = IS_NATIVE(value) ? AS_NATIVE(value)->name
+                                               : AS_FUNCTION(value)->name;
+            if (name == NULL) {
+                *result = OBJ_VAL(copyString(&vm->heap, "<script>", 8));
+                return true;
+            }
+            const char* prefix = IS_NATIVE(value) ? "<native fn " : "<fn ";
+            int prefixLength = (int)strlen(prefix);
+            int total = prefixLength + name->length + 1;
+            char* chars = ALLOCATE(char, total + 1);
+            memcpy(chars, prefix, (size_t)prefixLength);
+            memcpy(chars + prefixLength, name->chars, (size_t)name->length);
+            chars[total - 1] = '>';
+            chars[total] = '\0';
+            *result = OBJ_VAL(takeString(&vm->heap, chars, total));
+            return true;
+        }
+        default:
+            return nativeError(vm, "str() can't convert this value.");
+    }
+    *result = OBJ_VAL(copyString(&vm->heap, text, length));
+    return true;
+}
+
+// Reads a number written the way the scanner would accept it, with an optional
+// leading '-'. Anything else gives nil rather than an error, so scripts can use it
+// to check their input
+static bool numNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectString(vm, "num", args[0])) return false;
+    ObjString* string = AS_STRING(args[0]);
+    const char* start = string->chars;
+    int length = string->length;
+    bool negative = length > 0 && start[0] == '-';
+    if (negative) {
+        start++;
+        length--;
+    }
+
+    int digits = 0;
+    while (digits < length && start[digits] >= '0' && start[digits] <= '9') digits++;
+    int end = digits;
+    bool fraction = false;
+    if (end < length && start[end] == '.' && end + 1 < length &&
+        start[end + 1] >= '0' && start[end + 1] <= '9') {
+        fraction = true;
+        end++;
+        while (end < length && start[end] >= '0' && start[end] <= '9') end++;
+    }
+    if (digits == 0 || end != length) {
+        *result = NIL_VAL;
+        return true;
+    }
+
+    int64_t integer;
+    if (!fraction && parseInteger(start, length, &integer)) {
+        // -0 isn't an int, the same as in the compiler
+        if (negative && integer == 0) {
+            *result = NUMBER_VAL(-0.0);
+        } else {
+            *result = INT_VAL(negative ? -integer : integer);
+        }
+        return true;
+    }
+    double number = parseNumber(start, length);
+    *result = NUMBER_VAL(negative ? -number : number);
+    return true;
+}
+
+// array(count) makes an array of count zeros
+static bool arrayNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!IS_INT(args[0]) || AS_INT(args[0]) < 0 || AS_INT(args[0]) > INT32_MAX) {
+        return nativeError(vm, "array() expects a whole number count.");
+    }
+    *result = OBJ_VAL(newArray(&vm->heap, (int)AS_INT(args[0])));
+    return true;
+}
+
+static bool pushNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectArray(vm, "push", args[0]) || !expectNumber(vm, "push", args[1])) {
+        return false;
+    }
+    appendArray(AS_ARRAY(args[0]), AS_NUMBER(args[1]));
+    *result = NIL_VAL;
+    return true;
+}
+
+static bool sumNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectArray(vm, "sum", args[0])) return false;
+    ObjArray* array = AS_ARRAY(args[0]);
+    *result = NUMBER_VAL(kernels.sumDoubles(array->values, array->count));
+    return true;
+}
+
+// both arrays, and the same length
+static bool expectPair(VM* vm, const char* name, Value* args) {
+    if (!expectArray(vm, name, args[0]) || !expectArray(vm, name, args[1])) return false;
+    if (AS_ARRAY(args[0])->count != AS_ARRAY(args[1])->count) {
+        return nativeError(vm, "%s() expects arrays of the same length.", name);
+    }
+    return true;
+}
+
+static bool dotNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectPair(vm, "dot", args)) return false;
+    ObjArray* a = AS_ARRAY(args[0]);
+    *result = NUMBER_VAL(kernels.dotDoubles(a->values, AS_ARRAY(args[1])->values,
+                                            a->count));
+    return true;
+}
+
+// scale and add work in place and give back the array they changed, so a script
+// crunching a big column doesn't make a new one at every step
+static bool scaleNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectArray(vm, "scale", args[0]) || !expectNumber(vm, "scale", args[1])) {
+        return false;
+    }
+    ObjArray* array = AS_ARRAY(args[0]);
+    kernels.scaleDoubles(array->values, array->count, AS_NUMBER(args[1]));
+    *result = args[0];
+    return true;
+}
+
+static bool addNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectPair(vm, "add", args)) return false;
+    ObjArray* into = AS_ARRAY(args[0]);
+    kernels.addDoubles(into->values, AS_ARRAY(args[1])->values, into->count);
+    *result = args[0];
+    return true;
+}
+
+// Maps a double to an integer that sorts the same way. Positive numbers only need
+// their sign bit set to go above the negatives, negative ones have all their bits
+// flipped since a bigger magnitude has to sort lower
+static uint64_t sortKey(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits >> 63) != 0 ? ~bits : bits | 0x8000000000000000ull;
+}
+
+static double keyValue(uint64_t key) {
+    uint64_t bits = (key >> 63) != 0 ? key & ~0x8000000000000000ull : ~key;
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+#define SORT_DIGIT_BITS 11
+#define SORT_BUCKETS (1 << SORT_DIGIT_BITS)
+
+// Sorts in place. Comparisons don't vectorise, so rather than a SIMD sort this is a
+// radix sort on the keys above, 6 passes of 11 bits each whatever the data looks
+// like. Small arrays aren't worth the passes and use an insertion sort
+static bool sortNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!expectArray(vm, "sort", args[0])) return false;
+    ObjArray* array = AS_ARRAY(args[0]);
+    *result = args[0];
+    int count = array->count;
+    double* values = array->values;
+
+    if (count < 64) {
+        for (int i = 1; i < count; i++) {
+            double value = values[i];
+            uint64_t key = sortKey(value);
+            int j = i - 1;
+            for (; j >= 0 && sortKey(values[j]) > key; j--) values[j + 1] = values[j];
+            values[j + 1] = value;
+        }
+        return true;
+    }
+
+    uint64_t* keys = ALLOCATE(uint64_t, count);
+    uint64_t* scratch = ALLOCATE(uint64_t, count);
+    for (int i = 0; i < count; i++) keys[i] = sortKey(values[i]);
+    for (int shift = 0; shift < 64; shift += SORT_DIGIT_BITS) {
+        int counts[SORT_BUCKETS] = {0};
+        for (int i = 0; i < count; i++) counts[(keys[i] >> shift) & (SORT_BUCKETS - 1)]++;
+        int total = 0;
+        for (int bucket = 0; bucket < SORT_BUCKETS; bucket++) {
+            int bucketCount = counts[bucket];
+            counts[bucket] = total;
+            total += bucketCount;
+        }
+        for (int i = 0; i < count; i++) {
+            scratch[counts[(keys[i] >> shift) & (SORT_BUCKETS - 1)]++] = keys[i];
+        }
+        uint64_t* swap = keys;
+        keys = scratch;
+        scratch = swap;
+    }
+    for (int i = 0; i < count; i++) values[i] = keyValue(keys[i]);
+    FREE_ARRAY(uint64_t, keys, count);
+    FREE_ARRAY(uint64_t, scratch, count);
+    return true;
+}
+
+#undef SORT_DIGIT_BITS
+#undef SORT_BUCKETS
+
+// fiber(fn) makes a fiber that will run fn, which takes at most one argument, the first
+// time it's resumed
+static bool fiberNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!IS_FUNCTION(args[0])) return nativeError(vm, "fiber() expects a function.");
+    ObjFunction* function = AS_FUNCTION(args[0]);
+    if (function->arity > 1) {
+        return nativeError(vm, "A fiber's function can take at most one argument.");
+    }
+    *result = OBJ_VAL(newFiber(&vm->heap, function));
+    return true;
+}
+
+// resume(fiber, value) runs fiber until it yields or finishes, and returns whatever it
+// yielded or returned. The fiber gets value, or nil, back from the yield it stopped
+// at, or as its function's argument if it's only just starting
+static bool resumeNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (argCount < 1 || argCount > 2) {
+        return nativeError(vm, "resume() expects a fiber and an optional value.");
+    }
+    if (!IS_FIBER(args[0])) return nativeError(vm, "resume() expects a fiber.");
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if (fiber->state == FIBER_DONE) return nativeError(vm, "Can't resume a finished fiber.");
+    if (fiber->state == FIBER_RUNNING) {
+        return nativeError(vm, "Can't resume a fiber that is already running.");
+    }
+    if (fiber->state == FIBER_WAITING) {
+        return nativeError(vm, "Can't resume a fiber that is waiting on the event loop.");
+    }
+    Value value = argCount == 2 ? args[1] : NIL_VAL;
+    // our result slot is left on top, for whatever comes back when the fiber yields
+    fiber->caller = vm->fiber;
+    vm->stackTop = args;
+    transferFiber(vm, fiber, value);
+    return true;
+}
+
+// yield(value) hands value, or nil, back to whoever resumed the running fiber, and
+// returns what it's given when the fiber is next resumed
+static bool yieldNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (argCount > 1) return nativeError(vm, "yield() expects at most one value.");
+    ObjFiber* fiber = vm->fiber;
+    if (fiber->caller == NULL) return nativeError(vm, "Can't yield outside a fiber.");
+    Value value = argCount == 1 ? args[0] : NIL_VAL;
+    ObjFiber* caller = fiber->caller;
+    fiber->caller = NULL;
+    fiber->state = FIBER_SUSPENDED;
+    vm->stackTop = args;
+    transferFiber(vm, caller, value);
+    return true;
+}
+
+static bool doneNative(VM* vm, int argCount, Value* args, Value* result) {
+    if (!IS_FIBER(args[0])) return nativeError(vm, "done() expects a fiber.");
+    *result = BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+    return true;
+}
+
+// every native a script starts with, in the order they are defined
+static const NativeDef coreNatives[] = {
+    {"clock", clockNative, 0},
+    {"sqrt", sqrtNative, 1},
+    {"sin", sinNative, 1},
+    {"cos", cosNative, 1},
+    {"tan", tanNative, 1},
+    {"atan", atanNative, 1},
+    {"atan2", atan2Native, 2},
+    {"exp", expNative, 1},
+    {"log", logNative, 1},
+    {"pow", powNative, 2},
+    {"abs", absNative, 1},
+    {"floor", floorNative, 1},
+    {"ceil", ceilNative, 1},
+    {"round", roundNative, 1},
+    {"min", minNative, NATIVE_VARIADIC},
+    {"max", maxNative, NATIVE_VARIADIC},
+    {"len", lenNative, 1},
+    {"substr", substrNative, 3},
+    {"upper", upperNative, 1},
+    {"lower", lowerNative, 1},
+    {"str", strNative, 1},
+    {"num", numNative, 1},
+    {"array", arrayNative, 1},
+    {"push", pushNative, 2},
+    {"sum", sumNative, 1},
+    {"dot", dotNative, 2},
+    {"scale", scaleNative, 2},
+    {"add", addNative, 2},
+    {"sort", sortNative, 1},
+    {"fiber", fiberNative, 1},
+    {"resume", resumeNative, NATIVE_VARIADIC},
+    {"yield", yieldNative, NATIVE_VARIADIC},
+    {"done", doneNative, 1},
+};
+
+#define CORE_NATIVE_COUNT (int)(sizeof(coreNatives) / sizeof(coreNatives[0]))
+
+void defineNatives(VM* vm) {
+    for (int i = 0; i < CORE_NATIVE_COUNT; i++) {
+        defineNative(vm, coreNatives[i].name, coreNatives[i].function, coreNatives[i].arity);
+    }
+    for (int i = 0; i < loopNativeCount; i++) {
+        defineNative(vm, loopNatives[i].name, loopNatives[i].function, loopNatives[i].arity);
+    }
+}
+
+NativeFn findNative(const char* name, int arity) {
+    for (int i = 0; i < CORE_NATIVE_COUNT; i++) {
+        if (strcmp(coreNatives[i].name, name) == 0) {
+            return coreNatives[i].arity == arity ? coreNatives[i].function : NULL;
+        }
+    }
+    for (int i = 0; i < loopNativeCount; i++) {
+        if (strcmp(loopNatives[i].name, name) == 0) {
+            return loopNatives[i].arity == arity ? loopNatives[i].function : NULL;
+        }
+    }
+    return NULL;
+}
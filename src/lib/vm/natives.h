@@ -0,0 +1,13 @@
+#ifndef clox_natives_h
+#define clox_natives_h
+
+#include "vm.h"
+
+// defines the built in functions every script starts with as globals in vm
+void defineNatives(VM* vm);
+// the C function behind the native called name, or NULL if there isn't one taking
+// arity arguments. A heap image can't hold function pointers, so its natives are looked
+// up again by name, and the arity the VM checks calls against has to be the real one
+NativeFn findNative(const char* name, int arity);
+
+#endif
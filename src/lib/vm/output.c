@@ -0,0 +1,120 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "format.h"
+#include "object.h"
+#include "output.h"
+
+void initOutput(Output* output, int fd) {
+    output->fd = fd;
+    output->flushLines = isatty(fd);
+    output->length = 0;
+}
+
+// hands everything in the buffer to the OS, a write can take less than we give it
+static void writeAll(int fd, const char* text, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, text, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            // nowhere to report it (a closed pipe say), the output is just lost
+            return;
+        }
+        text += written;
+        length -= (size_t)written;
+    }
+}
+
+void flushOutput(Output* output) {
+    if (output->length == 0) return;
+    // anything printed through stdio (the REPL's prompt say) has to go out first
+    fflush(stdout);
+    writeAll(output->fd, output->buffer, output->length);
+    output->length = 0;
+}
+
+void writeOutput(Output* output, const char* text, size_t length) {
+    if (output->length + length > OUTPUT_BUFFER_SIZE) {
+        flushOutput(output);
+        // something bigger than the whole buffer may as well go straight out
+        if (length > OUTPUT_BUFFER_SIZE) {
+            writeAll(output->fd, text, length);
+            return;
+        }
+    }
+    memcpy(output->buffer + output->length, text, length);
+    output->length += length;
+}
+
+void writeValue(Output* output, Value value) {
+    switch (value.type) {
+        case VAL_BOOL:
+            if (AS_BOOL(value)) {
+                writeOutput(output, "true", 4);
+            } else {
+                writeOutput(output, "false", 5);
+            }
+            break;
+        case VAL_NIL: writeOutput(output, "nil", 3); break;
+        case VAL_NUMBER: {
+            char text[NUMBER_BUFFER_SIZE];
+            int length = formatNumber(AS_DOUBLE(value), text);
+            writeOutput(output, text, (size_t)length);
+            break;
+        }
+        case VAL_INT: {
+            char text[NUMBER_BUFFER_SIZE];
+            int length = formatInteger(AS_INT(value), text);
+            writeOutput(output, text, (size_t)length);
+            break;
+        }
+        case VAL_OBJ:
+            switch (OBJ_TYPE(value)) {
+                case OBJ_ARRAY: {
+                    ObjArray* array = AS_ARRAY(value);
+                    writeOutput(output, "[", 1);
+                    for (int i = 0; i < array->count; i++) {
+                        if (i > 0) writeOutput(output, ", ", 2);
+                        writeValue(output, NUMBER_VAL(array->values[i]));
+                    }
+                    writeOutput(output, "]", 1);
+                    break;
+                }
+                case OBJ_STRING: {
+                    ObjString* string = AS_STRING(value);
+                    writeOutput(output, string->chars, (size_t)string->length);
+                    break;
+                }
+                case OBJ_FIBER:
+                    writeOutput(output, "<fiber>", 7);
+                    break;
+                case OBJ_FUNCTION: {
+                    ObjFunction* function = AS_FUNCTION(value);
+                    if (function->name == NULL) {
+                        writeOutput(output, "<script>", 8);
+                        break;
+                    }
+                    writeOutput(output, "<fn ", 4);
+                    writeOutput(output, function->name->chars,
+                                (size_t)function->name->length);
+                    writeOutput(output, ">", 1);
+                    break;
+                }
+                case OBJ_NATIVE: {
+                    ObjString* name = AS_NATIVE(value)->name;
+                    writeOutput(output, "<native fn ", 11);
+                    writeOutput(output, name->chars, (size_t)name->length);
+                    writeOutput(output, ">", 1);
+                    break;
+                }
+            }
+            break;
+    }
+}
+
+void writeNewline(Output* output) {
+    writeOutput(output, "\n", 1);
+    if (output->flushLines) flushOutput(output);
+}
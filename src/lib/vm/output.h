@@ -0,0 +1,30 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include "common.h"
+#include "value.h"
+
+// how much printed output we collect before writing it out
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+// Everything a script prints goes through one of these. Printing a value just copies
+// its text into the buffer, and the buffer goes out in a single write once it fills
+// up, when the script finishes or hits an error, or when someone asks for a flush.
+// If we're writing to a terminal we also flush at the end of every line, so output
+// still shows up as it's printed
+typedef struct {
+    int fd;
+    bool flushLines;
+    size_t length;
+    char buffer[OUTPUT_BUFFER_SIZE];
+} Output;
+
+void initOutput(Output* output, int fd);
+void writeOutput(Output* output, const char* text, size_t length);
+// writes value the way the print statement shows it
+void writeValue(Output* output, Value value);
+// ends a line, which on a terminal also flushes it
+void writeNewline(Output* output);
+void flushOutput(Output* output);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "repl.h"
+#include "scanner.h"
+
+void initReplSession(ReplSession* session, VM* vm) {
+    session->vm = vm;
+    session->script = NULL;
+    initTable(&session->stringConstants);
+    session->buffer = NULL;
+    session->length = 0;
+    session->capacity = 0;
+    session->scanned = 0;
+    session->depth = 0;
+    session->inString = false;
+}
+
+void freeReplSession(ReplSession* session) {
+    freeTable(&session->stringConstants);
+    FREE_ARRAY(char, session->buffer, session->capacity);
+    initReplSession(session, session->vm);
+}
+
+static void appendLine(ReplSession* session, const char* line) {
+    size_t length = strlen(line);
+    if (session->capacity < session->length + length + 1) {
+        size_t oldCapacity = session->capacity;
+        session->capacity = GROW_CAPACITY(session->length + length + 1);
+        session->buffer = GROW_ARRAY(char, session->buffer, oldCapacity, session->capacity);
+    }
+    memcpy(session->buffer + session->length, line, length + 1);
+    session->length += length;
+}
+
+// An entry is finished unless it stops inside a string or with a bracket still open.
+// Anything else that is wrong with it is left for the compiler to report. The scan
+// carries on from where the last line's left off, no token but a string spans lines
+static bool entryComplete(ReplSession* session) {
+    const char* text = session->buffer + session->scanned;
+    session->scanned = session->length;
+    if (session->inString) {
+        // strings have no escapes, the first quote ends it
+        const char* quote = strchr(text, '"');
+        if (quote == NULL) return false;
+        session->inString = false;
+        text = quote + 1;
+    }
+    Scanner scanner;
+    initScanner(&scanner, text);
+    for (;;) {
+        Token token = scanToken(&scanner);
+        switch (token.type) {
+            case TOKEN_LEFT_PAREN:
+            case TOKEN_LEFT_BRACE:
+            case TOKEN_LEFT_BRACKET:
+                session->depth++;
+                break;
+            case TOKEN_RIGHT_PAREN:
+            case TOKEN_RIGHT_BRACE:
+            case TOKEN_RIGHT_BRACKET:
+                session->depth--;
+                break;
+            case TOKEN_ERROR:
+                if (strncmp(token.start, "Unterminated string", token.length) == 0) {
+                    session->inString = true;
+                    return false;
+                }
+                break;
+            case TOKEN_EOF:
+                return session->depth <= 0;
+            default:
+                break;
+        }
+    }
+}
+
+ReplStatus replLine(ReplSession* session, const char* line) {
+    appendLine(session, line);
+    if (!entryComplete(session)) return REPL_CONTINUE;
+
+    // only the new entry's code runs, everything before it already has. A failed
+    // compile leaves the script as it was, so there is nothing to undo here
+    if (session->script == NULL) session->script = newFunction(&session->vm->heap);
+    int start = session->script->chunk.count;
+    if (compileAppend(&session->vm->heap, session->buffer, &session->stringConstants,
+                      session->script)) {
+        interpretFrom(session->vm, session->script, start);
+    }
+    session->length = 0;
+    session->scanned = 0;
+    session->depth = 0;
+    return REPL_DONE;
+}
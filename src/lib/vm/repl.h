@@ -0,0 +1,42 @@
+#ifndef clox_repl_h
+#define clox_repl_h
+
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// Everything the REPL keeps between entries. Every entry is compiled onto the end of
+// the same top level function, so its constants, and the strings already interned for identifiers
+// the user keeps typing, are there for the next entry to reuse instead of each line
+// starting from nothing
+typedef struct {
+    // the VM every entry runs in, so globals carry over from one entry to the next
+    VM* vm;
+    // made on the first entry, it lives on the VM's heap like any other function
+    ObjFunction* script;
+    // string constant -> its index in the script's constant pool
+    Table stringConstants;
+    // the entry being typed, which can span several lines
+    char* buffer;
+    size_t length;
+    size_t capacity;
+    // How much of the entry has been scanned for open brackets and strings, how many
+    // brackets are still open and whether it stopped inside a string. Each new line
+    // only scans what it added, so a long entry doesn't get rescanned line after line
+    size_t scanned;
+    int depth;
+    bool inString;
+} ReplSession;
+
+typedef enum {
+    // the entry isn't finished (an open bracket or string), keep reading lines
+    REPL_CONTINUE,
+    REPL_DONE,
+} ReplStatus;
+
+void initReplSession(ReplSession* session, VM* vm);
+void freeReplSession(ReplSession* session);
+// adds a line to the current entry and runs the entry once it is complete
+ReplStatus replLine(ReplSession* session, const char* line);
+
+#endif
@@ -0,0 +1,220 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "runner.h"
+#include "vm.h"
+
+// what stealJob returns when it lost a race for the job, there may be more to take
+#define STEAL_RETRY -2
+#define NO_JOB -1
+
+// A Chase-Lev work stealing deque of job indices. The owner takes jobs from the
+// bottom and the other workers steal from the top, so the owner only ever contends
+// with a thief over the very last job. Every job is pushed before any worker starts
+// and none are added afterwards, so the buffer never has to grow and reading a slot
+// never races with a write to it.
+//
+// Each deque gets its own cache lines, the owner hammers bottom and we don't want
+// that bouncing the line a neighbouring deque's thieves are reading
+typedef struct {
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    int* jobs;
+} Deque;
+
+typedef struct {
+    Script** scripts;
+    Deque* deques;
+    int workers;
+    // per job, each written only by the worker that ran it
+    double* latencies;
+    atomic_int failed;
+} Pool;
+
+typedef struct {
+    Pool* pool;
+    int index;
+} Worker;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static void* allocate(size_t size) {
+    void* memory = malloc(size);
+    if (memory == NULL) {
+        fprintf(stderr, "Not enough memory to run the jobs.\n");
+        exit(74);
+    }
+    return memory;
+}
+
+// the owner's end
+static int takeJob(Deque* deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    // a thief that read the old bottom must either see this one or lose the CAS below
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        // it was already empty
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return NO_JOB;
+    }
+    int job = deque->jobs[bottom];
+    if (top == bottom) {
+        // the last job, a thief may be after it too so whoever moves top gets it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                     memory_order_seq_cst,
+                                                     memory_order_relaxed)) {
+            job = NO_JOB;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return job;
+}
+
+// everyone else's end
+static int stealJob(Deque* deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return NO_JOB;
+    int job = deque->jobs[top];
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return STEAL_RETRY;
+    }
+    return job;
+}
+
+// Jobs are never added once the workers start, so a worker whose own deque is empty
+// and who finds every other deque empty too is done
+static int findJob(Pool* pool, int self, uint32_t* seed) {
+    int job = takeJob(&pool->deques[self]);
+    if (job != NO_JOB) return job;
+    for (;;) {
+        bool retry = false;
+        // start somewhere different each time so thieves spread out over the victims
+        *seed ^= *seed << 13;
+        *seed ^= *seed >> 17;
+        *seed ^= *seed << 5;
+        int start = (int)(*seed % (uint32_t)pool->workers);
+        for (int i = 0; i < pool->workers; i++) {
+            int victim = (start + i) % pool->workers;
+            if (victim == self) continue;
+            job = stealJob(&pool->deques[victim]);
+            if (job >= 0) return job;
+            if (job == STEAL_RETRY) retry = true;
+        }
+        if (!retry) return NO_JOB;
+    }
+}
+
+static void* work(void* argument) {
+    Worker* worker = (Worker*)argument;
+    Pool* pool = worker->pool;
+    // its output buffer alone is more than we want on a thread's stack
+    VM* vm = (VM*)allocate(sizeof(VM));
+    initVM(vm);
+    uint32_t seed = 2463534242u + (uint32_t)worker->index * 2654435761u;
+    for (;;) {
+        int job = findJob(pool, worker->index, &seed);
+        if (job == NO_JOB) break;
+        double start = now();
+        // every job starts from a clean VM, as if it were the only thing we ran
+        resetVM(vm);
+        if (runScript(vm, pool->scripts[job]) != INTERPRET_OK) {
+            atomic_fetch_add(&pool->failed, 1);
+        }
+        pool->latencies[job] = (now() - start) * 1e6;
+    }
+    freeVM(vm);
+    free(vm);
+    return NULL;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// the nearest rank percentile of sorted
+static double percentile(double* sorted, int count, double fraction) {
+    int rank = (int)(fraction * count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    return sorted[rank - 1];
+}
+
+bool runScripts(Script** jobs, int count, int workers, RunReport* report) {
+    if (workers > count) workers = count;
+    if (workers < 1) workers = 1;
+
+    Pool pool;
+    pool.scripts = jobs;
+    pool.workers = workers;
+    pool.latencies = (double*)allocate(sizeof(double) * (size_t)(count > 0 ? count : 1));
+    atomic_init(&pool.failed, 0);
+    // aligned_alloc wants a multiple of the alignment, which sizeof(Deque) already is
+    pool.deques = (Deque*)aligned_alloc(_Alignof(Deque), sizeof(Deque) * (size_t)workers);
+    if (pool.deques == NULL) {
+        fprintf(stderr, "Not enough memory to run the jobs.\n");
+        exit(74);
+    }
+
+    // deal the jobs out like cards, so repeats of the same script are spread over
+    // every worker rather than all landing on one
+    for (int i = 0; i < workers; i++) {
+        Deque* deque = &pool.deques[i];
+        deque->jobs = (int*)allocate(sizeof(int) * (size_t)(count / workers + 1));
+        long size = 0;
+        for (int job = i; job < count; job += workers) deque->jobs[size++] = job;
+        atomic_init(&deque->top, 0);
+        atomic_init(&deque->bottom, size);
+    }
+
+    double start = now();
+    // the calling thread is worker 0, so we only start workers - 1 more
+    Worker* state = (Worker*)allocate(sizeof(Worker) * (size_t)workers);
+    pthread_t* threads = (pthread_t*)allocate(sizeof(pthread_t) * (size_t)workers);
+    int started = 0;
+    for (int i = 0; i < workers; i++) {
+        state[i].pool = &pool;
+        state[i].index = i;
+    }
+    for (int i = 1; i < workers; i++) {
+        // a worker that fails to start just leaves its jobs to be stolen
+        if (pthread_create(&threads[started], NULL, work, &state[i]) != 0) continue;
+        started++;
+    }
+    work(&state[0]);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    report->jobs = count;
+    report->failed = atomic_load(&pool.failed);
+    report->workers = started + 1;
+    report->seconds = now() - start;
+    qsort(pool.latencies, (size_t)count, sizeof(double), compareDoubles);
+    report->p50 = count > 0 ? percentile(pool.latencies, count, 0.50) : 0;
+    report->p90 = count > 0 ? percentile(pool.latencies, count, 0.90) : 0;
+    report->p99 = count > 0 ? percentile(pool.latencies, count, 0.99) : 0;
+    report->max = count > 0 ? pool.latencies[count - 1] : 0;
+
+    for (int i = 0; i < workers; i++) free(pool.deques[i].jobs);
+    free(pool.deques);
+    free(pool.latencies);
+    free(state);
+    free(threads);
+    return report->failed == 0;
+}
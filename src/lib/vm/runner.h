@@ -0,0 +1,30 @@
+#ifndef clox_runner_h
+#define clox_runner_h
+
+#include "common.h"
+#include "script.h"
+
+// How a batch of runs went. Latencies are in microseconds, from the moment a worker
+// picked the job up to the moment its script finished
+typedef struct {
+    int jobs;
+    int failed;
+    int workers;
+    double seconds;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+} RunReport;
+
+// Runs every script in jobs, which can list the same script any number of times, on a
+// pool of workers threads. Each worker has a VM of its own and resets it between jobs,
+// the scripts themselves are shared, so nothing is compiled here and the workers never
+// touch each other's state.
+//
+// The jobs are dealt out between the workers up front, and a worker that runs out
+// steals from the others, so one slow script doesn't leave the rest of its share
+// waiting behind it. Returns true if every job ran without a runtime error
+bool runScripts(Script** jobs, int count, int workers, RunReport* report);
+
+#endif
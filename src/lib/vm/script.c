@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "cpu.h"
+#include "script.h"
+
+static Script* allocateScript() {
+    // the script's strings have to hash the same way as those of the VMs running it,
+    // which may not have started yet
+    initCpuDispatch();
+    Script* script = (Script*)malloc(sizeof(Script));
+    if (script == NULL) {
+        fprintf(stderr, "Not enough memory for a script.\n");
+        exit(74);
+    }
+    initHeap(&script->heap);
+    script->function = NULL;
+    return script;
+}
+
+// Everything the script's code can reach is on its heap, so freezing every function
+// there freezes all of it. From here on the script is only ever read
+static Script* finishScript(Script* script, ObjFunction* function) {
+    if (function == NULL) {
+        freeScript(script);
+        return NULL;
+    }
+    for (Obj* object = script->heap.objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION) ((ObjFunction*)object)->chunk.frozen = true;
+    }
+    script->function = function;
+    return script;
+}
+
+Script* newScript(const char* source) {
+    Script* script = allocateScript();
+    return finishScript(script, compile(&script->heap, source));
+}
+
+Script* loadScript(const char* path) {
+    Source source;
+    if (!openSourceFile(&source, path)) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return NULL;
+    }
+    Script* script = allocateScript();
+    ObjFunction* function = loadBytecodeCache(&script->heap, path, &source);
+    if (function == NULL) {
+        function = compileSource(&script->heap, &source, NULL);
+        if (function != NULL) writeBytecodeCache(path, &source, function);
+    }
+    closeSource(&source);
+    return finishScript(script, function);
+}
+
+void freeScript(Script* script) {
+    freeHeap(&script->heap);
+    free(script);
+}
+
+InterpretResult runScript(VM* vm, Script* script) {
+    return interpretFunction(vm, script->function);
+}
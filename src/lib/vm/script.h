@@ -0,0 +1,33 @@
+#ifndef clox_script_h
+#define clox_script_h
+
+#include "object.h"
+#include "source.h"
+#include "vm.h"
+
+// A script compiled once so it can be run as many times as we like, by as many VMs as
+// we like, at the same time on different threads. Running it costs only running it,
+// there's no scanning or compiling per run.
+//
+// Its functions and constants live on the script's own heap rather than any VM's, and
+// once compiled nothing ever writes to them again: every chunk is frozen, so running
+// it never quickens an instruction or bumps a loop counter. A VM running it makes its
+// own strings on its own heap and compares them to the script's by their contents.
+//
+// A VM that has run a script can hold on to its functions and strings in its globals,
+// so a script must only be freed once every VM that ran it has been reset or freed
+typedef struct {
+    Heap heap;
+    ObjFunction* function;
+} Script;
+
+// both return NULL if the script doesn't compile, having reported why
+Script* newScript(const char* source);
+// compiles the script at path, or loads it from its bytecode cache if that's up to date
+Script* loadScript(const char* path);
+void freeScript(Script* script);
+// Runs the script's top level in vm, on top of whatever globals earlier runs left
+// behind, call resetVM first to run it from a clean slate
+InterpretResult runScript(VM* vm, Script* script);
+
+#endif
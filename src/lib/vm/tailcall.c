@@ -0,0 +1,746 @@
+// An alternative interpreter core, built instead of the switch in vm.c's run() with
+// make CORE=tailcall. Every opcode has a handler function of its own, and each handler
+// finishes by tail calling the next instruction's handler through a table. The ip, the
+// top of the stack, the frame and the budget are passed along as arguments, so they
+// live in the same registers all the way through and each handler gets the register
+// allocator to itself rather than sharing one with every other case of a huge switch.
+//
+// The calls have to become jumps or the C stack would grow with every instruction.
+// musttail (clang 13 and later, gcc 15) guarantees that. Without it we rely on the
+// optimiser turning calls in tail position into jumps, which gcc and clang both do at
+// -O2 for calls like these, so an unoptimised build without musttail is refused. So is
+// a sanitized one: AddressSanitizer keeps each handler's frame alive past the call,
+// gcc then leaves the calls as calls, and any long loop overflows the C stack.
+//
+// The top of the stack lives in sp, vm->stackTop is only brought up to date before
+// anything that looks at it is called, and sp reloaded from it afterwards
+#ifdef CLOX_TAILCALL_CORE
+
+#include <stdio.h>
+
+#include "core.h"
+#include "debug.h"
+#include "jit.h"
+#include "memory.h"
+#include "output.h"
+#include "table.h"
+
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#define SANITIZED_BUILD
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SANITIZED_BUILD
+#endif
+#endif
+#ifndef MUSTTAIL
+#if defined(__OPTIMIZE__) && !defined(SANITIZED_BUILD)
+#define MUSTTAIL
+#else
+#error "The tail call core needs musttail (clang 13 or later) or an optimised build without AddressSanitizer."
+#endif
+#endif
+
+#define HANDLER_ARGS VM* vm, CallFrame* frame, uint8_t* ip, Value* sp, int64_t budget
+typedef InterpretResult (*Handler)(HANDLER_ARGS);
+static const Handler handlers[256];
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceInstruction(VM* vm, CallFrame* frame, uint8_t* ip, Value* sp) {
+    printf("          ");
+    for (Value* slot = vm->stack; slot < sp; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(&frame->function->chunk, (int)(ip - frame->function->chunk.code));
+}
+#define TRACE() traceInstruction(vm, frame, ip, sp)
+#else
+#define TRACE() ((void)0)
+#endif
+
+// runs the instruction at ip, handlers are entered with ip just past their opcode
+#define DISPATCH() \
+    do { \
+        TRACE(); \
+        MUSTTAIL return handlers[*ip](vm, frame, ip + 1, sp, budget); \
+    } while (false)
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() (ip += 3, (int)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT_LONG() (frame->function->chunk.constants.values[READ_LONG()])
+// picks up with whatever frame is on top after the VM's frames or fiber changed
+#define RELOAD() \
+    do { \
+        frame = &vm->frames[vm->frameCount - 1]; \
+        ip = frame->ip; \
+        sp = vm->stackTop; \
+    } while (false)
+#define RUNTIME_ERROR(...) \
+    do { \
+        frame->ip = ip; \
+        vm->stackTop = sp; \
+        runtimeError(vm, __VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+#define SPEND_BUDGET(resumeAt) \
+    do { \
+        if (--budget == 0) { \
+            frame->ip = (resumeAt); \
+            vm->stackTop = sp; \
+            return INTERPRET_YIELD; \
+        } \
+    } while (false)
+// see ENTER_JIT in vm.c
+#define ENTER_JIT() \
+    do { \
+        if (hasJitEntry(frame->function, ip)) { \
+            frame->ip = ip; \
+            vm->stackTop = sp; \
+            int64_t left = budget; \
+            JitStatus status = runJit(vm, frame, &left); \
+            budget = left; \
+            if (status == JIT_ERROR) return INTERPRET_RUNTIME_ERROR; \
+            RELOAD(); \
+            if (budget == 0) return INTERPRET_YIELD; \
+        } \
+    } while (false)
+#define QUICKEN(generic) \
+    do { \
+        if (!frame->function->chunk.frozen) { \
+            vm->stackTop = sp; \
+            if (quicken(vm, ip - 1, generic)) { \
+                ip--; \
+                DISPATCH(); \
+            } \
+        } \
+    } while (false)
+#define DESPECIALISE(generic) \
+    do { \
+        ip[-1] = (generic); \
+        ip--; \
+        DISPATCH(); \
+    } while (false)
+
+static InterpretResult opConstant(HANDLER_ARGS) {
+    *sp++ = READ_CONSTANT();
+    DISPATCH();
+}
+
+static InterpretResult opConstantLong(HANDLER_ARGS) {
+    *sp++ = READ_CONSTANT_LONG();
+    DISPATCH();
+}
+
+static InterpretResult opNil(HANDLER_ARGS) {
+    *sp++ = NIL_VAL;
+    DISPATCH();
+}
+
+static InterpretResult opTrue(HANDLER_ARGS) {
+    *sp++ = BOOL_VAL(true);
+    DISPATCH();
+}
+
+static InterpretResult opFalse(HANDLER_ARGS) {
+    *sp++ = BOOL_VAL(false);
+    DISPATCH();
+}
+
+static InterpretResult opPop(HANDLER_ARGS) {
+    sp--;
+    DISPATCH();
+}
+
+static InterpretResult opGetLocal(HANDLER_ARGS) {
+    *sp++ = frame->slots[READ_BYTE()];
+    DISPATCH();
+}
+
+static InterpretResult opGetLocalLong(HANDLER_ARGS) {
+    *sp++ = frame->slots[READ_LONG()];
+    DISPATCH();
+}
+
+static InterpretResult opSetLocal(HANDLER_ARGS) {
+    frame->slots[READ_BYTE()] = sp[-1];
+    DISPATCH();
+}
+
+static InterpretResult opSetLocalLong(HANDLER_ARGS) {
+    frame->slots[READ_LONG()] = sp[-1];
+    DISPATCH();
+}
+
+// the global handlers are the same for both operand widths apart from how they read
+// the name
+#define GET_GLOBAL(name) \
+    do { \
+        if (!tableGet(&vm->globals, name, sp)) { \
+            RUNTIME_ERROR("Undefined variable '%s'.", name->chars); \
+        } \
+        sp++; \
+    } while (false)
+#define SET_GLOBAL(name) \
+    do { \
+        if (tableSet(&vm->globals, name, sp[-1])) { \
+            tableDelete(&vm->globals, name); \
+            RUNTIME_ERROR("Undefined variable '%s'.", name->chars); \
+        } \
+    } while (false)
+
+static InterpretResult opGetGlobal(HANDLER_ARGS) {
+    ObjString* name = AS_STRING(READ_CONSTANT());
+    GET_GLOBAL(name);
+    DISPATCH();
+}
+
+static InterpretResult opGetGlobalLong(HANDLER_ARGS) {
+    ObjString* name = AS_STRING(READ_CONSTANT_LONG());
+    GET_GLOBAL(name);
+    DISPATCH();
+}
+
+static InterpretResult opSetGlobal(HANDLER_ARGS) {
+    ObjString* name = AS_STRING(READ_CONSTANT());
+    SET_GLOBAL(name);
+    DISPATCH();
+}
+
+static InterpretResult opSetGlobalLong(HANDLER_ARGS) {
+    ObjString* name = AS_STRING(READ_CONSTANT_LONG());
+    SET_GLOBAL(name);
+    DISPATCH();
+}
+
+static InterpretResult opDefineGlobal(HANDLER_ARGS) {
+    ObjString* name = AS_STRING(READ_CONSTANT());
+    tableSet(&vm->globals, name, *--sp);
+    DISPATCH();
+}
+
+static InterpretResult opDefineGlobalLong(HANDLER_ARGS) {
+    ObjString* name = AS_STRING(READ_CONSTANT_LONG());
+    tableSet(&vm->globals, name, *--sp);
+    DISPATCH();
+}
+
+static InterpretResult opEqual(HANDLER_ARGS) {
+    sp--;
+    sp[-1] = BOOL_VAL(valuesEqual(sp[-1], sp[0]));
+    DISPATCH();
+}
+
+// These follow the macros of the same names in vm.c, see there for why each is the
+// way it is
+#define BINARY_OP(valueType, op) \
+    do { \
+        if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(sp[-1]); \
+        double a = AS_NUMBER(sp[-2]); \
+        sp--; \
+        sp[-1] = valueType(a op b); \
+    } while (false)
+#define INT_BINARY_OP(overflowFn, op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        int64_t result; \
+        if (IS_INT(a) && IS_INT(b) && !overflowFn(AS_INT(a), AS_INT(b), &result)) { \
+            sp--; \
+            sp[-1] = INT_VAL(result); \
+        } else { \
+            BINARY_OP(NUMBER_VAL, op); \
+        } \
+    } while (false)
+#define COMPARE_OP(op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        if (IS_INT(a) && IS_INT(b)) { \
+            sp--; \
+            sp[-1] = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+        } else { \
+            BINARY_OP(BOOL_VAL, op); \
+        } \
+    } while (false)
+#define QUICK_INT_OP(generic, overflowFn, op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        if (!IS_INT(a) || !IS_INT(b)) DESPECIALISE(generic); \
+        int64_t result; \
+        sp--; \
+        if (overflowFn(AS_INT(a), AS_INT(b), &result)) { \
+            sp[-1] = NUMBER_VAL((double)AS_INT(a) op (double)AS_INT(b)); \
+        } else { \
+            sp[-1] = INT_VAL(result); \
+        } \
+    } while (false)
+#define QUICK_INT_COMPARE(generic, op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        if (!IS_INT(a) || !IS_INT(b)) DESPECIALISE(generic); \
+        sp--; \
+        sp[-1] = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+    } while (false)
+#define QUICK_DOUBLE_OP(generic, valueType, op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        if (!IS_DOUBLE(a) || !IS_DOUBLE(b)) DESPECIALISE(generic); \
+        sp--; \
+        sp[-1] = valueType(AS_DOUBLE(a) op AS_DOUBLE(b)); \
+    } while (false)
+#define NUMBERS_OP(overflowFn, op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        int64_t result; \
+        sp--; \
+        if (IS_INT(a) && IS_INT(b) && !overflowFn(AS_INT(a), AS_INT(b), &result)) { \
+            sp[-1] = INT_VAL(result); \
+        } else { \
+            sp[-1] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } \
+    } while (false)
+#define NUMBERS_COMPARE(op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        sp--; \
+        if (IS_INT(a) && IS_INT(b)) { \
+            sp[-1] = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+        } else { \
+            sp[-1] = BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } \
+    } while (false)
+
+static InterpretResult opGreater(HANDLER_ARGS) {
+    QUICKEN(OP_GREATER);
+    COMPARE_OP(>);
+    DISPATCH();
+}
+
+static InterpretResult opLess(HANDLER_ARGS) {
+    QUICKEN(OP_LESS);
+    COMPARE_OP(<);
+    DISPATCH();
+}
+
+static InterpretResult opAdd(HANDLER_ARGS) {
+    QUICKEN(OP_ADD);
+    int64_t result;
+    if (IS_INT(sp[-1]) && IS_INT(sp[-2]) &&
+        !__builtin_add_overflow(AS_INT(sp[-2]), AS_INT(sp[-1]), &result)) {
+        sp--;
+        sp[-1] = INT_VAL(result);
+    } else if (IS_STRING(sp[-1]) && IS_STRING(sp[-2])) {
+        vm->stackTop = sp;
+        concatenate(vm);
+        sp = vm->stackTop;
+    } else if (IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])) {
+        double b = AS_NUMBER(sp[-1]);
+        double a = AS_NUMBER(sp[-2]);
+        sp--;
+        sp[-1] = NUMBER_VAL(a + b);
+    } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+    }
+    DISPATCH();
+}
+
+static InterpretResult opSubtract(HANDLER_ARGS) {
+    QUICKEN(OP_SUBTRACT);
+    INT_BINARY_OP(__builtin_sub_overflow, -);
+    DISPATCH();
+}
+
+static InterpretResult opMultiply(HANDLER_ARGS) {
+    QUICKEN(OP_MULTIPLY);
+    INT_BINARY_OP(multiplyOverflows, *);
+    DISPATCH();
+}
+
+static InterpretResult opDivide(HANDLER_ARGS) {
+    QUICKEN(OP_DIVIDE);
+    BINARY_OP(NUMBER_VAL, /);
+    DISPATCH();
+}
+
+static InterpretResult opAddInt(HANDLER_ARGS) {
+    QUICK_INT_OP(OP_ADD, __builtin_add_overflow, +);
+    DISPATCH();
+}
+
+static InterpretResult opAddNum(HANDLER_ARGS) {
+    QUICK_DOUBLE_OP(OP_ADD, NUMBER_VAL, +);
+    DISPATCH();
+}
+
+static InterpretResult opAddStr(HANDLER_ARGS) {
+    if (!IS_STRING(sp[-1]) || !IS_STRING(sp[-2])) DESPECIALISE(OP_ADD);
+    vm->stackTop = sp;
+    concatenate(vm);
+    sp = vm->stackTop;
+    DISPATCH();
+}
+
+static InterpretResult opSubtractInt(HANDLER_ARGS) {
+    QUICK_INT_OP(OP_SUBTRACT, __builtin_sub_overflow, -);
+    DISPATCH();
+}
+
+static InterpretResult opSubtractNum(HANDLER_ARGS) {
+    QUICK_DOUBLE_OP(OP_SUBTRACT, NUMBER_VAL, -);
+    DISPATCH();
+}
+
+static InterpretResult opMultiplyInt(HANDLER_ARGS) {
+    QUICK_INT_OP(OP_MULTIPLY, multiplyOverflows, *);
+    DISPATCH();
+}
+
+static InterpretResult opMultiplyNum(HANDLER_ARGS) {
+    QUICK_DOUBLE_OP(OP_MULTIPLY, NUMBER_VAL, *);
+    DISPATCH();
+}
+
+static InterpretResult opDivideInt(HANDLER_ARGS) {
+    Value b = sp[-1];
+    Value a = sp[-2];
+    if (!IS_INT(a) || !IS_INT(b)) DESPECIALISE(OP_DIVIDE);
+    sp--;
+    sp[-1] = NUMBER_VAL((double)AS_INT(a) / (double)AS_INT(b));
+    DISPATCH();
+}
+
+static InterpretResult opDivideNum(HANDLER_ARGS) {
+    QUICK_DOUBLE_OP(OP_DIVIDE, NUMBER_VAL, /);
+    DISPATCH();
+}
+
+static InterpretResult opGreaterInt(HANDLER_ARGS) {
+    QUICK_INT_COMPARE(OP_GREATER, >);
+    DISPATCH();
+}
+
+static InterpretResult opGreaterNum(HANDLER_ARGS) {
+    QUICK_DOUBLE_OP(OP_GREATER, BOOL_VAL, >);
+    DISPATCH();
+}
+
+static InterpretResult opLessInt(HANDLER_ARGS) {
+    QUICK_INT_COMPARE(OP_LESS, <);
+    DISPATCH();
+}
+
+static InterpretResult opLessNum(HANDLER_ARGS) {
+    QUICK_DOUBLE_OP(OP_LESS, BOOL_VAL, <);
+    DISPATCH();
+}
+
+static InterpretResult opAddNumbers(HANDLER_ARGS) {
+    NUMBERS_OP(__builtin_add_overflow, +);
+    DISPATCH();
+}
+
+static InterpretResult opSubtractNumbers(HANDLER_ARGS) {
+    NUMBERS_OP(__builtin_sub_overflow, -);
+    DISPATCH();
+}
+
+static InterpretResult opMultiplyNumbers(HANDLER_ARGS) {
+    NUMBERS_OP(multiplyOverflows, *);
+    DISPATCH();
+}
+
+static InterpretResult opDivideNumbers(HANDLER_ARGS) {
+    double b = AS_NUMBER(sp[-1]);
+    sp--;
+    sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1]) / b);
+    DISPATCH();
+}
+
+static InterpretResult opGreaterNumbers(HANDLER_ARGS) {
+    NUMBERS_COMPARE(>);
+    DISPATCH();
+}
+
+static InterpretResult opLessNumbers(HANDLER_ARGS) {
+    NUMBERS_COMPARE(<);
+    DISPATCH();
+}
+
+// -0 and -INT64_MIN aren't ints
+static inline Value negate(Value value) {
+    if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT64_MIN) {
+        return INT_VAL(-AS_INT(value));
+    }
+    return NUMBER_VAL(-AS_NUMBER(value));
+}
+
+static InterpretResult opNegateNumber(HANDLER_ARGS) {
+    sp[-1] = negate(sp[-1]);
+    DISPATCH();
+}
+
+static InterpretResult opNot(HANDLER_ARGS) {
+    sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+    DISPATCH();
+}
+
+static InterpretResult opNegate(HANDLER_ARGS) {
+    if (!IS_NUMBER(sp[-1])) RUNTIME_ERROR("Operand must be a number.");
+    sp[-1] = negate(sp[-1]);
+    DISPATCH();
+}
+
+static InterpretResult opPrint(HANDLER_ARGS) {
+    writeValue(&vm->output, *--sp);
+    writeNewline(&vm->output);
+    DISPATCH();
+}
+
+static InterpretResult opJump(HANDLER_ARGS) {
+    uint16_t offset = READ_SHORT();
+    ip += offset;
+    DISPATCH();
+}
+
+static InterpretResult opJumpIfFalse(HANDLER_ARGS) {
+    uint16_t offset = READ_SHORT();
+    if (isFalsey(sp[-1])) ip += offset;
+    DISPATCH();
+}
+
+static InterpretResult opJumpBack(HANDLER_ARGS) {
+    uint16_t offset = READ_SHORT();
+    ip -= offset;
+    SPEND_BUDGET(ip);
+    ENTER_JIT();
+    DISPATCH();
+}
+
+static InterpretResult opLoop(HANDLER_ARGS) {
+    uint16_t offset = READ_SHORT();
+    uint16_t loop = READ_SHORT();
+    if (!frame->function->chunk.frozen &&
+        ++frame->function->chunk.loopCounters[loop] == HOT_LOOP_THRESHOLD && vm->jit) {
+        compileJit(frame->function);
+    }
+    ip -= offset;
+    SPEND_BUDGET(ip);
+    ENTER_JIT();
+    DISPATCH();
+}
+
+static InterpretResult opCall(HANDLER_ARGS) {
+    SPEND_BUDGET(ip - 1);
+    int argCount = READ_BYTE();
+    Value callee = sp[-1 - argCount];
+    if (IS_FUNCTION(callee)) {
+        ObjFunction* function = AS_FUNCTION(callee);
+        Value* slots = sp - argCount - 1;
+        if (function->arity == argCount && vm->frameCount < vm->frameCapacity &&
+            function->maxSlots <= vm->stackEnd - slots) {
+            frame->ip = ip;
+            frame = &vm->frames[vm->frameCount++];
+            frame->function = function;
+            frame->slots = slots;
+            ip = function->chunk.code;
+            if (vm->jit && function->calls < HOT_CALL_THRESHOLD &&
+                ++function->calls == HOT_CALL_THRESHOLD) {
+                compileJit(function);
+            }
+            ENTER_JIT();
+            DISPATCH();
+        }
+    } else if (IS_NATIVE(callee)) {
+        ObjNative* native = AS_NATIVE(callee);
+        Value* args = sp - argCount;
+        if (native->arity == argCount || native->arity == NATIVE_VARIADIC) {
+            ObjFiber* fiber = vm->fiber;
+            frame->ip = ip;
+            vm->stackTop = sp;
+            if (!native->function(vm, argCount, args, &args[-1])) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (vm->fiber != fiber) {
+                RELOAD();
+                DISPATCH();
+            }
+            sp = args;
+            ENTER_JIT();
+            DISPATCH();
+        }
+    }
+    frame->ip = ip;
+    vm->stackTop = sp;
+    if (!callValue(vm, callee, argCount)) return INTERPRET_RUNTIME_ERROR;
+    RELOAD();
+    ENTER_JIT();
+    DISPATCH();
+}
+
+static InterpretResult opArray(HANDLER_ARGS) {
+    int count = READ_BYTE();
+    Value* elements = sp - count;
+    for (int i = 0; i < count; i++) {
+        if (!IS_NUMBER(elements[i])) RUNTIME_ERROR("Arrays can only hold numbers.");
+    }
+    ObjArray* array = newArray(&vm->heap, count);
+    for (int i = 0; i < count; i++) {
+        array->values[i] = AS_NUMBER(elements[i]);
+    }
+    sp = elements;
+    *sp++ = OBJ_VAL(array);
+    DISPATCH();
+}
+
+static InterpretResult opGetIndex(HANDLER_ARGS) {
+    Value index = sp[-1];
+    Value array = sp[-2];
+    if (!IS_ARRAY(array)) RUNTIME_ERROR("Only arrays can be indexed.");
+    if (!IS_INT(index)) RUNTIME_ERROR("Array index must be a whole number.");
+    ObjArray* elements = AS_ARRAY(array);
+    if ((uint64_t)AS_INT(index) >= (uint64_t)elements->count) {
+        RUNTIME_ERROR("Array index %lld out of bounds.", (long long)AS_INT(index));
+    }
+    sp--;
+    sp[-1] = NUMBER_VAL(elements->values[AS_INT(index)]);
+    DISPATCH();
+}
+
+static InterpretResult opSetIndex(HANDLER_ARGS) {
+    Value value = sp[-1];
+    Value index = sp[-2];
+    Value array = sp[-3];
+    if (!IS_ARRAY(array)) RUNTIME_ERROR("Only arrays can be indexed.");
+    if (!IS_INT(index)) RUNTIME_ERROR("Array index must be a whole number.");
+    if (!IS_NUMBER(value)) RUNTIME_ERROR("Arrays can only hold numbers.");
+    ObjArray* elements = AS_ARRAY(array);
+    if ((uint64_t)AS_INT(index) >= (uint64_t)elements->count) {
+        RUNTIME_ERROR("Array index %lld out of bounds.", (long long)AS_INT(index));
+    }
+    elements->values[AS_INT(index)] = AS_NUMBER(value);
+    sp -= 2;
+    sp[-1] = value;
+    DISPATCH();
+}
+
+static InterpretResult opReturn(HANDLER_ARGS) {
+    Value result = *--sp;
+    vm->frameCount--;
+    if (vm->frameCount == 0) {
+        if (vm->fiber == &vm->mainFiber) {
+            // the script's function is all that's left on the stack
+            vm->stackTop = sp - 1;
+            if (!runNextFiber(vm)) return INTERPRET_OK;
+            RELOAD();
+            DISPATCH();
+        }
+        // see OP_RETURN in vm.c
+        ObjFiber* fiber = vm->fiber;
+        ObjFiber* caller = fiber->caller;
+        vm->stackTop = vm->stack;
+        fiber->caller = NULL;
+        fiber->state = FIBER_DONE;
+        if (caller != NULL) {
+            transferFiber(vm, caller, result);
+        } else if (!runNextFiber(vm)) {
+            resetStack(vm);
+            freeFiberStacks(fiber);
+            return INTERPRET_OK;
+        }
+        freeFiberStacks(fiber);
+        RELOAD();
+        DISPATCH();
+    }
+    sp = frame->slots;
+    *sp++ = result;
+    frame = &vm->frames[vm->frameCount - 1];
+    ip = frame->ip;
+    ENTER_JIT();
+    DISPATCH();
+}
+
+static const Handler handlers[256] = {
+    [OP_CONSTANT] = opConstant,
+    [OP_CONSTANT_LONG] = opConstantLong,
+    [OP_NIL] = opNil,
+    [OP_TRUE] = opTrue,
+    [OP_FALSE] = opFalse,
+    [OP_POP] = opPop,
+    [OP_GET_LOCAL] = opGetLocal,
+    [OP_GET_LOCAL_LONG] = opGetLocalLong,
+    [OP_SET_LOCAL] = opSetLocal,
+    [OP_SET_LOCAL_LONG] = opSetLocalLong,
+    [OP_SET_GLOBAL] = opSetGlobal,
+    [OP_SET_GLOBAL_LONG] = opSetGlobalLong,
+    [OP_GET_GLOBAL] = opGetGlobal,
+    [OP_GET_GLOBAL_LONG] = opGetGlobalLong,
+    [OP_DEFINE_GLOBAL] = opDefineGlobal,
+    [OP_DEFINE_GLOBAL_LONG] = opDefineGlobalLong,
+    [OP_EQUAL] = opEqual,
+    [OP_GREATER] = opGreater,
+    [OP_LESS] = opLess,
+    [OP_ADD] = opAdd,
+    [OP_SUBTRACT] = opSubtract,
+    [OP_MULTIPLY] = opMultiply,
+    [OP_DIVIDE] = opDivide,
+    [OP_NOT] = opNot,
+    [OP_NEGATE] = opNegate,
+    [OP_PRINT] = opPrint,
+    [OP_JUMP] = opJump,
+    [OP_JUMP_IF_FALSE] = opJumpIfFalse,
+    [OP_JUMP_BACK] = opJumpBack,
+    [OP_LOOP] = opLoop,
+    [OP_CALL] = opCall,
+    [OP_ARRAY] = opArray,
+    [OP_GET_INDEX] = opGetIndex,
+    [OP_SET_INDEX] = opSetIndex,
+    [OP_RETURN] = opReturn,
+    [OP_ADD_INT] = opAddInt,
+    [OP_ADD_NUM] = opAddNum,
+    [OP_ADD_STR] = opAddStr,
+    [OP_SUBTRACT_INT] = opSubtractInt,
+    [OP_SUBTRACT_NUM] = opSubtractNum,
+    [OP_MULTIPLY_INT] = opMultiplyInt,
+    [OP_MULTIPLY_NUM] = opMultiplyNum,
+    [OP_DIVIDE_INT] = opDivideInt,
+    [OP_DIVIDE_NUM] = opDivideNum,
+    [OP_GREATER_INT] = opGreaterInt,
+    [OP_GREATER_NUM] = opGreaterNum,
+    [OP_LESS_INT] = opLessInt,
+    [OP_LESS_NUM] = opLessNum,
+    [OP_ADD_NUMBERS] = opAddNumbers,
+    [OP_SUBTRACT_NUMBERS] = opSubtractNumbers,
+    [OP_MULTIPLY_NUMBERS] = opMultiplyNumbers,
+    [OP_DIVIDE_NUMBERS] = opDivideNumbers,
+    [OP_GREATER_NUMBERS] = opGreaterNumbers,
+    [OP_LESS_NUMBERS] = opLessNumbers,
+    [OP_NEGATE_NUMBER] = opNegateNumber,
+};
+
+InterpretResult runTailCall(VM* vm) {
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    uint8_t* ip = frame->ip;
+    Value* sp = vm->stackTop;
+    int64_t budget = vm->budget > 0 ? vm->budget : INT64_MAX;
+    InterpretResult result = handlers[*ip](vm, frame, ip + 1, sp, budget);
+    return result;
+}
+
+#endif
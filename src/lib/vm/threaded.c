@@ -0,0 +1,768 @@
+#include <stdio.h>
+
+#include "core.h"
+#include "debug.h"
+#include "jit.h"
+#include "memory.h"
+#include "output.h"
+#include "table.h"
+#include "threaded.h"
+
+void freeThreaded(ThreadedCode* code) {
+    FREE_ARRAY(Cell, code->cells, code->cellCount);
+    FREE_ARRAY(uint32_t, code->offsets, code->cellCount);
+    FREE_ARRAY(Cell*, code->entries, code->entryCount);
+    FREE(ThreadedCode, code);
+}
+
+// Another interpreter core, built instead of the switch in vm.c's run() with make
+// CORE=threaded. It runs each function's threaded code (see threaded.h) with gcc and
+// clang's labels as values, every handler ending in a jump straight to the next one's.
+//
+// Like the tail call core it keeps the top of the stack in sp, bringing vm->stackTop up
+// to date only before anything that looks at it is called, and pc always points at the
+// first cell of the instruction being run until it moves on to the next
+#ifdef CLOX_THREADED_CORE
+
+// handlers that aren't the translation of any one opcode, they follow the opcodes'
+enum {
+    // globals in a shared script's code, which can't remember their entries
+    HANDLER_GET_GLOBAL_SHARED = 256,
+    HANDLER_SET_GLOBAL_SHARED,
+    HANDLER_COUNT,
+};
+
+// how many cells the instruction translates into, its handler and then its operands
+static int cellsFor(uint8_t op) {
+    switch (op) {
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_LOOP:
+            return 3;
+        default:
+            return instructionLength(op) > 1 ? 2 : 1;
+    }
+}
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_BACK || op == OP_LOOP;
+}
+
+// Translates function's chunk into threaded code, labels giving the handler for each
+// opcode. A frozen chunk belongs to a Script that other VMs may be translating at the
+// same moment, so the code is only ever published with a compare and swap, whoever
+// loses throws theirs away and uses the winner's
+static ThreadedCode* translate(ObjFunction* function, const void* const* labels) {
+    Chunk* chunk = &function->chunk;
+    int cellCount = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk->code[offset])) {
+        cellCount += cellsFor(chunk->code[offset]);
+    }
+
+    ThreadedCode* code = ALLOCATE(ThreadedCode, 1);
+    code->cells = ALLOCATE(Cell, cellCount);
+    code->cellCount = cellCount;
+    code->offsets = ALLOCATE(uint32_t, cellCount);
+    code->entries = ALLOCATE(Cell*, chunk->count);
+    code->entryCount = chunk->count;
+    for (int i = 0; i < chunk->count; i++) code->entries[i] = NULL;
+
+    Cell* cell = code->cells;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t* ip = chunk->code + offset;
+        uint8_t op = ip[0];
+        int length = instructionLength(op);
+        int cells = cellsFor(op);
+        code->entries[offset] = cell;
+        for (int i = 0; i < cells; i++) {
+            code->offsets[cell - code->cells + i] = (uint32_t)offset;
+        }
+        cell[0].handler = labels[op];
+        switch (op) {
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+                cell[1].constant = &chunk->constants.values[instructionOperand(ip)];
+                break;
+            case OP_GET_LOCAL:
+            case OP_GET_LOCAL_LONG:
+            case OP_SET_LOCAL:
+            case OP_SET_LOCAL_LONG:
+            case OP_CALL:
+            case OP_ARRAY:
+                cell[1].operand = instructionOperand(ip);
+                break;
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG:
+                if (chunk->frozen) cell[0].handler = labels[HANDLER_GET_GLOBAL_SHARED];
+                cell[1].name = AS_STRING(chunk->constants.values[instructionOperand(ip)]);
+                cell[2].global = NULL;
+                break;
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
+                if (chunk->frozen) cell[0].handler = labels[HANDLER_SET_GLOBAL_SHARED];
+                cell[1].name = AS_STRING(chunk->constants.values[instructionOperand(ip)]);
+                cell[2].global = NULL;
+                break;
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG:
+                cell[1].name = AS_STRING(chunk->constants.values[instructionOperand(ip)]);
+                break;
+            // the offsets jumped to for now, they're made into cells below
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+                cell[1].operand = offset + length + jumpOffset(ip);
+                break;
+            case OP_JUMP_BACK:
+                cell[1].operand = offset + length - jumpOffset(ip);
+                break;
+            case OP_LOOP:
+                cell[1].operand = offset + length - jumpOffset(ip);
+                // a shared script's counters would just be fought over by every VM
+                cell[2].counter = chunk->frozen
+                                      ? NULL
+                                      : &chunk->loopCounters[(ip[3] << 8) | ip[4]];
+                break;
+        }
+        cell += cells;
+        offset += length;
+    }
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk->code[offset])) {
+        if (!isJump(chunk->code[offset])) continue;
+        Cell* jump = code->entries[offset];
+        jump[1].target = code->entries[jump[1].operand];
+    }
+
+    ThreadedCode* published = NULL;
+    if (!__atomic_compare_exchange_n(&function->threaded, &published, code, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        freeThreaded(code);
+        return published;
+    }
+    return code;
+}
+
+static inline ThreadedCode* threadedCode(ObjFunction* function, const void* const* labels) {
+    ThreadedCode* code = __atomic_load_n(&function->threaded, __ATOMIC_ACQUIRE);
+    return code != NULL ? code : translate(function, labels);
+}
+
+// The entry of the global the instruction at pc names. It goes by the entry the
+// instruction remembered if that's still in the table and still holds the global,
+// otherwise it looks it up again and remembers that. NULL if there's no such global
+static inline Entry* findGlobal(Table* globals, Cell* pc) {
+    Entry* entry = pc[2].global;
+    if ((uintptr_t)entry - (uintptr_t)globals->entries <
+            (uintptr_t)globals->capacity * sizeof(Entry) &&
+        entry->key == pc[1].name) {
+        return entry;
+    }
+    entry = tableGetEntry(globals, pc[1].name);
+    pc[2].global = entry;
+    return entry;
+}
+
+InterpretResult runThreaded(VM* vm) {
+    static const void* const labels[HANDLER_COUNT] = {
+        [OP_CONSTANT] = &&opConstant,
+        [OP_CONSTANT_LONG] = &&opConstant,
+        [OP_NIL] = &&opNil,
+        [OP_TRUE] = &&opTrue,
+        [OP_FALSE] = &&opFalse,
+        [OP_POP] = &&opPop,
+        [OP_GET_LOCAL] = &&opGetLocal,
+        [OP_GET_LOCAL_LONG] = &&opGetLocal,
+        [OP_SET_LOCAL] = &&opSetLocal,
+        [OP_SET_LOCAL_LONG] = &&opSetLocal,
+        [OP_SET_GLOBAL] = &&opSetGlobal,
+        [OP_SET_GLOBAL_LONG] = &&opSetGlobal,
+        [OP_GET_GLOBAL] = &&opGetGlobal,
+        [OP_GET_GLOBAL_LONG] = &&opGetGlobal,
+        [OP_DEFINE_GLOBAL] = &&opDefineGlobal,
+        [OP_DEFINE_GLOBAL_LONG] = &&opDefineGlobal,
+        [OP_EQUAL] = &&opEqual,
+        [OP_GREATER] = &&opGreater,
+        [OP_LESS] = &&opLess,
+        [OP_ADD] = &&opAdd,
+        [OP_SUBTRACT] = &&opSubtract,
+        [OP_MULTIPLY] = &&opMultiply,
+        [OP_DIVIDE] = &&opDivide,
+        [OP_NOT] = &&opNot,
+        [OP_NEGATE] = &&opNegate,
+        [OP_PRINT] = &&opPrint,
+        [OP_JUMP] = &&opJump,
+        [OP_JUMP_IF_FALSE] = &&opJumpIfFalse,
+        [OP_JUMP_BACK] = &&opJumpBack,
+        [OP_LOOP] = &&opLoop,
+        [OP_CALL] = &&opCall,
+        [OP_ARRAY] = &&opArray,
+        [OP_GET_INDEX] = &&opGetIndex,
+        [OP_SET_INDEX] = &&opSetIndex,
+        [OP_RETURN] = &&opReturn,
+        [OP_ADD_INT] = &&opAddInt,
+        [OP_ADD_NUM] = &&opAddNum,
+        [OP_ADD_STR] = &&opAddStr,
+        [OP_SUBTRACT_INT] = &&opSubtractInt,
+        [OP_SUBTRACT_NUM] = &&opSubtractNum,
+        [OP_MULTIPLY_INT] = &&opMultiplyInt,
+        [OP_MULTIPLY_NUM] = &&opMultiplyNum,
+        [OP_DIVIDE_INT] = &&opDivideInt,
+        [OP_DIVIDE_NUM] = &&opDivideNum,
+        [OP_GREATER_INT] = &&opGreaterInt,
+        [OP_GREATER_NUM] = &&opGreaterNum,
+        [OP_LESS_INT] = &&opLessInt,
+        [OP_LESS_NUM] = &&opLessNum,
+        [OP_ADD_NUMBERS] = &&opAddNumbers,
+        [OP_SUBTRACT_NUMBERS] = &&opSubtractNumbers,
+        [OP_MULTIPLY_NUMBERS] = &&opMultiplyNumbers,
+        [OP_DIVIDE_NUMBERS] = &&opDivideNumbers,
+        [OP_GREATER_NUMBERS] = &&opGreaterNumbers,
+        [OP_LESS_NUMBERS] = &&opLessNumbers,
+        [OP_NEGATE_NUMBER] = &&opNegateNumber,
+        [HANDLER_GET_GLOBAL_SHARED] = &&opGetGlobalShared,
+        [HANDLER_SET_GLOBAL_SHARED] = &&opSetGlobalShared,
+    };
+    CallFrame* frame;
+    ThreadedCode* code;
+    Cell* pc;
+    Value* sp;
+    int64_t budget = vm->budget > 0 ? vm->budget : INT64_MAX;
+
+// the offset in the chunk of the instruction we're on, and its first byte
+#define OFFSET() (code->offsets[pc - code->cells])
+#define BYTECODE() (frame->function->chunk.code + OFFSET())
+// picks up in whatever frame is on top, at the instruction its ip points to
+#define RESUME() \
+    do { \
+        frame = &vm->frames[vm->frameCount - 1]; \
+        code = threadedCode(frame->function, labels); \
+        pc = code->entries[frame->ip - frame->function->chunk.code]; \
+    } while (false)
+// the same after the VM's frames or fiber changed under us
+#define RELOAD() \
+    do { \
+        RESUME(); \
+        sp = vm->stackTop; \
+    } while (false)
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE() \
+    do { \
+        printf("          "); \
+        for (Value* slot = vm->stack; slot < sp; slot++) { \
+            printf("[ "); \
+            printValue(*slot); \
+            printf(" ]"); \
+        } \
+        printf("\n"); \
+        disassembleInstruction(&frame->function->chunk, (int)OFFSET()); \
+    } while (false)
+#else
+#define TRACE() ((void)0)
+#endif
+// moves on by cells cells and runs the instruction there
+#define NEXT(cells) \
+    do { \
+        pc += (cells); \
+        TRACE(); \
+        goto *pc->handler; \
+    } while (false)
+// reportError takes the ip to be past the start of the failing instruction
+#define RUNTIME_ERROR(...) \
+    do { \
+        frame->ip = BYTECODE() + 1; \
+        vm->stackTop = sp; \
+        runtimeError(vm, __VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+#define SPEND_BUDGET(resumeAt) \
+    do { \
+        if (--budget == 0) { \
+            frame->ip = frame->function->chunk.code + code->offsets[(resumeAt) - code->cells]; \
+            vm->stackTop = sp; \
+            return INTERPRET_YIELD; \
+        } \
+    } while (false)
+// see ENTER_JIT in vm.c
+#define ENTER_JIT() \
+    do { \
+        if (hasJitEntry(frame->function, BYTECODE())) { \
+            frame->ip = BYTECODE(); \
+            vm->stackTop = sp; \
+            int64_t left = budget; \
+            JitStatus status = runJit(vm, frame, &left); \
+            budget = left; \
+            if (status == JIT_ERROR) return INTERPRET_RUNTIME_ERROR; \
+            RELOAD(); \
+            if (budget == 0) return INTERPRET_YIELD; \
+        } \
+    } while (false)
+// quickening rewrites the bytecode, and the cell it was translated into along with it
+#define QUICKEN(generic) \
+    do { \
+        if (!frame->function->chunk.frozen) { \
+            uint8_t* instruction = BYTECODE(); \
+            vm->stackTop = sp; \
+            if (quicken(vm, instruction, generic)) { \
+                pc->handler = labels[*instruction]; \
+                NEXT(0); \
+            } \
+        } \
+    } while (false)
+#define DESPECIALISE(generic) \
+    do { \
+        *BYTECODE() = (generic); \
+        pc->handler = labels[generic]; \
+        NEXT(0); \
+    } while (false)
+// These follow the macros of the same names in vm.c, see there for why each is the
+// way it is
+#define BINARY_OP(valueType, op) \
+    do { \
+        if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(sp[-2])) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(sp[-1]); \
+        double a = AS_NUMBER(sp[-2]); \
+        sp--; \
+        sp[-1] = valueType(a op b); \
+    } while (false)
+#define INT_BINARY_OP(overflowFn, op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        int64_t result; \
+        if (IS_INT(a) && IS_INT(b) && !overflowFn(AS_INT(a), AS_INT(b), &result)) { \
+            sp--; \
+            sp[-1] = INT_VAL(result); \
+        } else { \
+            BINARY_OP(NUMBER_VAL, op); \
+        } \
+    } while (false)
+#define COMPARE_OP(op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        if (IS_INT(a) && IS_INT(b)) { \
+            sp--; \
+            sp[-1] = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+        } else { \
+            BINARY_OP(BOOL_VAL, op); \
+        } \
+    } while (false)
+#define QUICK_INT_OP(generic, overflowFn, op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        if (!IS_INT(a) || !IS_INT(b)) DESPECIALISE(generic); \
+        int64_t result; \
+        sp--; \
+        if (overflowFn(AS_INT(a), AS_INT(b), &result)) { \
+            sp[-1] = NUMBER_VAL((double)AS_INT(a) op (double)AS_INT(b)); \
+        } else { \
+            sp[-1] = INT_VAL(result); \
+        } \
+    } while (false)
+#define QUICK_INT_COMPARE(generic, op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        if (!IS_INT(a) || !IS_INT(b)) DESPECIALISE(generic); \
+        sp--; \
+        sp[-1] = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+    } while (false)
+#define QUICK_DOUBLE_OP(generic, valueType, op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        if (!IS_DOUBLE(a) || !IS_DOUBLE(b)) DESPECIALISE(generic); \
+        sp--; \
+        sp[-1] = valueType(AS_DOUBLE(a) op AS_DOUBLE(b)); \
+    } while (false)
+#define NUMBERS_OP(overflowFn, op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        int64_t result; \
+        sp--; \
+        if (IS_INT(a) && IS_INT(b) && !overflowFn(AS_INT(a), AS_INT(b), &result)) { \
+            sp[-1] = INT_VAL(result); \
+        } else { \
+            sp[-1] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } \
+    } while (false)
+#define NUMBERS_COMPARE(op) \
+    do { \
+        Value b = sp[-1]; \
+        Value a = sp[-2]; \
+        sp--; \
+        if (IS_INT(a) && IS_INT(b)) { \
+            sp[-1] = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+        } else { \
+            sp[-1] = BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } \
+    } while (false)
+// -0 and -INT64_MIN aren't ints
+#define NEGATE(value) \
+    (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT64_MIN \
+         ? INT_VAL(-AS_INT(value)) \
+         : NUMBER_VAL(-AS_NUMBER(value)))
+
+    RELOAD();
+    NEXT(0);
+
+opConstant:
+    *sp++ = *pc[1].constant;
+    NEXT(2);
+opNil:
+    *sp++ = NIL_VAL;
+    NEXT(1);
+opTrue:
+    *sp++ = BOOL_VAL(true);
+    NEXT(1);
+opFalse:
+    *sp++ = BOOL_VAL(false);
+    NEXT(1);
+opPop:
+    sp--;
+    NEXT(1);
+opGetLocal:
+    *sp++ = frame->slots[pc[1].operand];
+    NEXT(2);
+opSetLocal:
+    frame->slots[pc[1].operand] = sp[-1];
+    NEXT(2);
+opGetGlobal: {
+    Entry* entry = findGlobal(&vm->globals, pc);
+    if (entry == NULL) RUNTIME_ERROR("Undefined variable '%s'.", pc[1].name->chars);
+    *sp++ = entry->value;
+    NEXT(3);
+}
+opSetGlobal: {
+    // assigning never adds a global, so there's nothing to take back out if it fails
+    Entry* entry = findGlobal(&vm->globals, pc);
+    if (entry == NULL) RUNTIME_ERROR("Undefined variable '%s'.", pc[1].name->chars);
+    entry->value = sp[-1];
+    NEXT(3);
+}
+opGetGlobalShared: {
+    ObjString* name = pc[1].name;
+    if (!tableGet(&vm->globals, name, sp)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+    }
+    sp++;
+    NEXT(3);
+}
+opSetGlobalShared: {
+    ObjString* name = pc[1].name;
+    if (tableSet(&vm->globals, name, sp[-1])) {
+        tableDelete(&vm->globals, name);
+        RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
+    }
+    NEXT(3);
+}
+opDefineGlobal:
+    tableSet(&vm->globals, pc[1].name, sp[-1]);
+    sp--;
+    NEXT(2);
+opEqual:
+    sp--;
+    sp[-1] = BOOL_VAL(valuesEqual(sp[-1], sp[0]));
+    NEXT(1);
+opGreater:
+    QUICKEN(OP_GREATER);
+    COMPARE_OP(>);
+    NEXT(1);
+opLess:
+    QUICKEN(OP_LESS);
+    COMPARE_OP(<);
+    NEXT(1);
+opAdd: {
+    QUICKEN(OP_ADD);
+    int64_t result;
+    if (IS_INT(sp[-1]) && IS_INT(sp[-2]) &&
+        !__builtin_add_overflow(AS_INT(sp[-2]), AS_INT(sp[-1]), &result)) {
+        sp--;
+        sp[-1] = INT_VAL(result);
+    } else if (IS_STRING(sp[-1]) && IS_STRING(sp[-2])) {
+        vm->stackTop = sp;
+        concatenate(vm);
+        sp = vm->stackTop;
+    } else if (IS_NUMBER(sp[-1]) && IS_NUMBER(sp[-2])) {
+        double b = AS_NUMBER(sp[-1]);
+        double a = AS_NUMBER(sp[-2]);
+        sp--;
+        sp[-1] = NUMBER_VAL(a + b);
+    } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+    }
+    NEXT(1);
+}
+opSubtract:
+    QUICKEN(OP_SUBTRACT);
+    INT_BINARY_OP(__builtin_sub_overflow, -);
+    NEXT(1);
+opMultiply:
+    QUICKEN(OP_MULTIPLY);
+    INT_BINARY_OP(multiplyOverflows, *);
+    NEXT(1);
+opDivide:
+    QUICKEN(OP_DIVIDE);
+    BINARY_OP(NUMBER_VAL, /);
+    NEXT(1);
+opAddInt:
+    QUICK_INT_OP(OP_ADD, __builtin_add_overflow, +);
+    NEXT(1);
+opAddNum:
+    QUICK_DOUBLE_OP(OP_ADD, NUMBER_VAL, +);
+    NEXT(1);
+opAddStr:
+    if (!IS_STRING(sp[-1]) || !IS_STRING(sp[-2])) DESPECIALISE(OP_ADD);
+    vm->stackTop = sp;
+    concatenate(vm);
+    sp = vm->stackTop;
+    NEXT(1);
+opSubtractInt:
+    QUICK_INT_OP(OP_SUBTRACT, __builtin_sub_overflow, -);
+    NEXT(1);
+opSubtractNum:
+    QUICK_DOUBLE_OP(OP_SUBTRACT, NUMBER_VAL, -);
+    NEXT(1);
+opMultiplyInt:
+    QUICK_INT_OP(OP_MULTIPLY, multiplyOverflows, *);
+    NEXT(1);
+opMultiplyNum:
+    QUICK_DOUBLE_OP(OP_MULTIPLY, NUMBER_VAL, *);
+    NEXT(1);
+opDivideInt: {
+    Value b = sp[-1];
+    Value a = sp[-2];
+    if (!IS_INT(a) || !IS_INT(b)) DESPECIALISE(OP_DIVIDE);
+    sp--;
+    sp[-1] = NUMBER_VAL((double)AS_INT(a) / (double)AS_INT(b));
+    NEXT(1);
+}
+opDivideNum:
+    QUICK_DOUBLE_OP(OP_DIVIDE, NUMBER_VAL, /);
+    NEXT(1);
+opGreaterInt:
+    QUICK_INT_COMPARE(OP_GREATER, >);
+    NEXT(1);
+opGreaterNum:
+    QUICK_DOUBLE_OP(OP_GREATER, BOOL_VAL, >);
+    NEXT(1);
+opLessInt:
+    QUICK_INT_COMPARE(OP_LESS, <);
+    NEXT(1);
+opLessNum:
+    QUICK_DOUBLE_OP(OP_LESS, BOOL_VAL, <);
+    NEXT(1);
+opAddNumbers:
+    NUMBERS_OP(__builtin_add_overflow, +);
+    NEXT(1);
+opSubtractNumbers:
+    NUMBERS_OP(__builtin_sub_overflow, -);
+    NEXT(1);
+opMultiplyNumbers:
+    NUMBERS_OP(multiplyOverflows, *);
+    NEXT(1);
+opDivideNumbers: {
+    double b = AS_NUMBER(sp[-1]);
+    sp--;
+    sp[-1] = NUMBER_VAL(AS_NUMBER(sp[-1]) / b);
+    NEXT(1);
+}
+opGreaterNumbers:
+    NUMBERS_COMPARE(>);
+    NEXT(1);
+opLessNumbers:
+    NUMBERS_COMPARE(<);
+    NEXT(1);
+opNegateNumber:
+    sp[-1] = NEGATE(sp[-1]);
+    NEXT(1);
+opNot:
+    sp[-1] = BOOL_VAL(isFalsey(sp[-1]));
+    NEXT(1);
+opNegate:
+    if (!IS_NUMBER(sp[-1])) RUNTIME_ERROR("Operand must be a number.");
+    sp[-1] = NEGATE(sp[-1]);
+    NEXT(1);
+opPrint:
+    writeValue(&vm->output, *--sp);
+    writeNewline(&vm->output);
+    NEXT(1);
+opJump:
+    pc = pc[1].target;
+    NEXT(0);
+opJumpIfFalse:
+    if (isFalsey(sp[-1])) {
+        pc = pc[1].target;
+        NEXT(0);
+    }
+    NEXT(2);
+opJumpBack:
+    pc = pc[1].target;
+    SPEND_BUDGET(pc);
+    ENTER_JIT();
+    NEXT(0);
+opLoop:
+    if (pc[2].counter != NULL && ++*pc[2].counter == HOT_LOOP_THRESHOLD && vm->jit) {
+        compileJit(frame->function);
+    }
+    pc = pc[1].target;
+    SPEND_BUDGET(pc);
+    ENTER_JIT();
+    NEXT(0);
+opCall: {
+    SPEND_BUDGET(pc);
+    int argCount = (int)pc[1].operand;
+    Value callee = sp[-1 - argCount];
+    // a call returns to just past its 2 bytes
+    if (IS_FUNCTION(callee)) {
+        ObjFunction* function = AS_FUNCTION(callee);
+        Value* slots = sp - argCount - 1;
+        if (function->arity == argCount && vm->frameCount < vm->frameCapacity &&
+            function->maxSlots <= vm->stackEnd - slots) {
+            frame->ip = BYTECODE() + 2;
+            frame = &vm->frames[vm->frameCount++];
+            frame->function = function;
+            frame->slots = slots;
+            code = threadedCode(function, labels);
+            pc = code->cells;
+            if (vm->jit && function->calls < HOT_CALL_THRESHOLD &&
+                ++function->calls == HOT_CALL_THRESHOLD) {
+                compileJit(function);
+            }
+            ENTER_JIT();
+            NEXT(0);
+        }
+    } else if (IS_NATIVE(callee)) {
+        ObjNative* native = AS_NATIVE(callee);
+        Value* args = sp - argCount;
+        if (native->arity == argCount || native->arity == NATIVE_VARIADIC) {
+            ObjFiber* fiber = vm->fiber;
+            frame->ip = BYTECODE() + 2;
+            vm->stackTop = sp;
+            if (!native->function(vm, argCount, args, &args[-1])) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (vm->fiber != fiber) {
+                RELOAD();
+                NEXT(0);
+            }
+            sp = args;
+            pc += 2;
+            ENTER_JIT();
+            NEXT(0);
+        }
+    }
+    frame->ip = BYTECODE() + 2;
+    vm->stackTop = sp;
+    if (!callValue(vm, callee, argCount)) return INTERPRET_RUNTIME_ERROR;
+    RELOAD();
+    ENTER_JIT();
+    NEXT(0);
+}
+opArray: {
+    int count = (int)pc[1].operand;
+    Value* elements = sp - count;
+    for (int i = 0; i < count; i++) {
+        if (!IS_NUMBER(elements[i])) RUNTIME_ERROR("Arrays can only hold numbers.");
+    }
+    ObjArray* array = newArray(&vm->heap, count);
+    for (int i = 0; i < count; i++) {
+        array->values[i] = AS_NUMBER(elements[i]);
+    }
+    sp = elements;
+    *sp++ = OBJ_VAL(array);
+    NEXT(2);
+}
+opGetIndex: {
+    Value index = sp[-1];
+    Value array = sp[-2];
+    if (!IS_ARRAY(array)) RUNTIME_ERROR("Only arrays can be indexed.");
+    if (!IS_INT(index)) RUNTIME_ERROR("Array index must be a whole number.");
+    ObjArray* elements = AS_ARRAY(array);
+    if ((uint64_t)AS_INT(index) >= (uint64_t)elements->count) {
+        RUNTIME_ERROR("Array index %lld out of bounds.", (long long)AS_INT(index));
+    }
+    sp--;
+    sp[-1] = NUMBER_VAL(elements->values[AS_INT(index)]);
+    NEXT(1);
+}
+opSetIndex: {
+    Value value = sp[-1];
+    Value index = sp[-2];
+    Value array = sp[-3];
+    if (!IS_ARRAY(array)) RUNTIME_ERROR("Only arrays can be indexed.");
+    if (!IS_INT(index)) RUNTIME_ERROR("Array index must be a whole number.");
+    if (!IS_NUMBER(value)) RUNTIME_ERROR("Arrays can only hold numbers.");
+    ObjArray* elements = AS_ARRAY(array);
+    if ((uint64_t)AS_INT(index) >= (uint64_t)elements->count) {
+        RUNTIME_ERROR("Array index %lld out of bounds.", (long long)AS_INT(index));
+    }
+    elements->values[AS_INT(index)] = AS_NUMBER(value);
+    sp -= 2;
+    sp[-1] = value;
+    NEXT(1);
+}
+opReturn: {
+    Value result = *--sp;
+    vm->frameCount--;
+    if (vm->frameCount == 0) {
+        if (vm->fiber == &vm->mainFiber) {
+            // the script's function is all that's left on the stack
+            vm->stackTop = sp - 1;
+            if (!runNextFiber(vm)) return INTERPRET_OK;
+            RELOAD();
+            NEXT(0);
+        }
+        // see OP_RETURN in vm.c
+        ObjFiber* fiber = vm->fiber;
+        ObjFiber* caller = fiber->caller;
+        vm->stackTop = vm->stack;
+        fiber->caller = NULL;
+        fiber->state = FIBER_DONE;
+        if (caller != NULL) {
+            transferFiber(vm, caller, result);
+        } else if (!runNextFiber(vm)) {
+            resetStack(vm);
+            freeFiberStacks(fiber);
+            return INTERPRET_OK;
+        }
+        freeFiberStacks(fiber);
+        RELOAD();
+        NEXT(0);
+    }
+    sp = frame->slots;
+    *sp++ = result;
+    RESUME();
+    ENTER_JIT();
+    NEXT(0);
+}
+#undef OFFSET
+#undef BYTECODE
+#undef RESUME
+#undef RELOAD
+#undef TRACE
+#undef NEXT
+#undef RUNTIME_ERROR
+#undef SPEND_BUDGET
+#undef ENTER_JIT
+#undef QUICKEN
+#undef DESPECIALISE
+#undef BINARY_OP
+#undef INT_BINARY_OP
+#undef COMPARE_OP
+#undef QUICK_INT_OP
+#undef QUICK_INT_COMPARE
+#undef QUICK_DOUBLE_OP
+#undef NUMBERS_OP
+#undef NUMBERS_COMPARE
+#undef NEGATE
+}
+
+#endif
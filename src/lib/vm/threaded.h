@@ -0,0 +1,46 @@
+#ifndef clox_threaded_h
+#define clox_threaded_h
+
+#include "object.h"
+#include "table.h"
+
+// Direct-threaded code, what the core built with make CORE=threaded runs instead of
+// the bytecode. The first time a function runs its chunk is translated into an array
+// of cells, each instruction becoming the address of the code that runs it followed
+// by its operands already worked out:
+//
+// OP_CONSTANT 3      ->  [&&opConstant][&constants.values[3]]
+// OP_GET_GLOBAL 7    ->  [&&opGetGlobal][name][the global's Entry, once it's looked up]
+// OP_JUMP 12         ->  [&&opJump][the cell to jump to]
+//
+// so running an instruction is one indirect jump, and no operand bytes are decoded and
+// no constant is looked up in the pool along the way. The _LONG forms translate into
+// the very same cells as the short ones.
+//
+// The bytecode stays the truth: frames still point into it, the JIT compiles it, and
+// quickening rewrites it along with the cell it was translated into. The offsets and
+// entries map between the two whenever a frame is left or picked up again
+typedef union Cell {
+    const void* handler;
+    Value* constant;
+    ObjString* name;
+    Entry* global;
+    union Cell* target;
+    uint64_t* counter;
+    intptr_t operand;
+} Cell;
+
+typedef struct ThreadedCode {
+    Cell* cells;
+    int cellCount;
+    // by cell, the offset in the chunk of the instruction the cell is part of
+    uint32_t* offsets;
+    // by offset in the chunk, the cell its instruction starts at, NULL for offsets in
+    // the middle of an instruction
+    Cell** entries;
+    int entryCount;
+} ThreadedCode;
+
+void freeThreaded(ThreadedCode* code);
+
+#endif
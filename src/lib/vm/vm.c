@@ -1,78 +1,325 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "core.h"
+#include "cpu.h"
 #include "debug.h"
+#include "image.h"
+#include "jit.h"
 #include "memory.h"
+#include "natives.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-VM vm;
+// the running fiber's frames and stack live on the VM while it runs, see VM
+static void saveFiber(VM* vm) {
+    vm->fiber->frameCount = vm->frameCount;
+    vm->fiber->stackTop = vm->stackTop;
+}
+
+static void loadFiber(VM* vm, ObjFiber* fiber) {
+    vm->fiber = fiber;
+    vm->frames = fiber->frames;
+    vm->frameCount = fiber->frameCount;
+    vm->frameCapacity = fiber->frameCapacity;
+    vm->stack = fiber->stack;
+    vm->stackTop = fiber->stackTop;
+    vm->stackEnd = fiber->stack + fiber->stackCapacity;
+}
+
+void resetStack(VM* vm) {
+    // a runtime error ends the fiber it happened on and every fiber waiting on it,
+    // along with everything waiting on the event loop
+    for (ObjFiber* fiber = vm->fiber; fiber != NULL && fiber != &vm->mainFiber;) {
+        ObjFiber* caller = fiber->caller;
+        fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        fiber = caller;
+    }
+    resetLoop(&vm->loop);
+    vm->mainFiber.state = FIBER_RUNNING;
+    loadFiber(vm, &vm->mainFiber);
+    vm->stackTop = vm->stack;
+    vm->frameCount = 0;
+}
 
-static void resetStack() {
-    vm.stackTop = vm.stack;
+static void reportError(VM* vm, const char* format, va_list args) {
+    // whatever the script printed before the error should come out before it
+    flushOutput(&vm->output);
+    // then print the arguments to standard error
+    vfprintf(stderr, format, args);
+    fputs("\n", stderr);
+    // then where every call still in progress was, innermost first
+    for (int i = vm->frameCount - 1; i >= 0; i--) {
+        CallFrame* frame = &vm->frames[i];
+        ObjFunction* function = frame->function;
+        // the ip has already moved past the instruction that failed
+        size_t instruction = frame->ip - function->chunk.code - 1;
+        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
+        if (function->name == NULL) {
+            fprintf(stderr, "script\n");
+        } else {
+            fprintf(stderr, "%s()\n", function->name->chars);
+        }
+    }
+    resetStack(vm);
 }
 
-static void runtimeError(const char* format, ...) {
+void runtimeError(VM* vm, const char* format, ...) {
     // this allows us to pass a variadic number of arguments to this function ...^
     va_list args;
     // add our format arg to the start
     va_start(args, format);
-    // then print the arguments to standard error
-    vfprintf(stderr, format, args);
+    reportError(vm, format, args);
     // then we end the va list
     va_end(args);
-    fputs("\n", stderr);
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
 }
 
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+bool nativeError(VM* vm, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    reportError(vm, format, args);
+    va_end(args);
+    return false;
+}
+
+void defineNative(VM* vm, const char* name, NativeFn function, int arity) {
+    ObjString* string = copyString(&vm->heap, name, (int)strlen(name));
+    ObjNative* native = newNative(&vm->heap, function, arity, string);
+    tableSet(&vm->globals, string, OBJ_VAL(native));
+}
+
+// everything initVM does but fill the heap and globals
+static void initEmptyVM(VM* vm) {
+    // pick the best scanning and hashing kernels for this CPU before we intern anything
+    initCpuDispatch();
+    initFiber(&vm->mainFiber);
+    vm->mainFiber.obj.type = OBJ_FIBER;
+    vm->mainFiber.obj.next = NULL;
+    vm->mainFiber.state = FIBER_RUNNING;
+    vm->fiber = &vm->mainFiber;
+    initLoop(&vm->loop);
+    resetStack(vm);
+    initHeap(&vm->heap);
+    initOutput(&vm->output, STDOUT_FILENO);
+    initTable(&vm->globals);
+    vm->budget = 0;
+    vm->jit = false;
+}
+
+void initVM(VM* vm) {
+    initEmptyVM(vm);
+    defineNatives(vm);
+}
+
+bool initVMFromImage(VM* vm, const char* path) {
+    initEmptyVM(vm);
+    if (loadHeapImage(&vm->heap, &vm->globals, path)) return true;
+    defineNatives(vm);
+    return false;
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    freeObjects();
+void freeVM(VM* vm) {
+    flushOutput(&vm->output);
+    resetStack(vm);
+    freeLoop(&vm->loop);
+    freeFiberStacks(&vm->mainFiber);
+    freeTable(&vm->globals);
+    freeHeap(&vm->heap);
 }
 
-void push(Value value) {
+void resetVM(VM* vm) {
+    flushOutput(&vm->output);
+    // back onto the main fiber before the heap, and any fiber we were on, goes
+    resetStack(vm);
+    freeTable(&vm->globals);
+    freeHeap(&vm->heap);
+    initHeap(&vm->heap);
+    initTable(&vm->globals);
+    defineNatives(vm);
+}
+
+void push(VM* vm, Value value) {
     // this line stores value in the array element at the top of the stack,
     // remember here that stacktop points past the last used element
-    *vm.stackTop = value;
+    *vm->stackTop = value;
     // stackTop (which is a pointer) is then incremented using pointer arithmetic
-    vm.stackTop++;
+    vm->stackTop++;
 }
 
-Value pop() {
+Value pop(VM* vm) {
     // opposite to pop, go back one step by decrementing the stack top
-    vm.stackTop--;
+    vm->stackTop--;
     // then return that value (dereferenced)
-    return *vm.stackTop;
+    return *vm->stackTop;
+}
+
+static Value peek(VM* vm, int distance) {
+    return vm->stackTop[-1 - distance];
+}
+
+// the quickened form of a generic binary instruction for these operands, or the
+// generic instruction itself if there isn't one
+static uint8_t specialise(uint8_t generic, Value a, Value b) {
+    bool ints = IS_INT(a) && IS_INT(b);
+    bool doubles = IS_DOUBLE(a) && IS_DOUBLE(b);
+    switch (generic) {
+        case OP_ADD:
+            if (ints) return OP_ADD_INT;
+            if (doubles) return OP_ADD_NUM;
+            if (IS_STRING(a) && IS_STRING(b)) return OP_ADD_STR;
+            break;
+        case OP_SUBTRACT:
+            if (ints) return OP_SUBTRACT_INT;
+            if (doubles) return OP_SUBTRACT_NUM;
+            break;
+        case OP_MULTIPLY:
+            if (ints) return OP_MULTIPLY_INT;
+            if (doubles) return OP_MULTIPLY_NUM;
+            break;
+        case OP_DIVIDE:
+            if (ints) return OP_DIVIDE_INT;
+            if (doubles) return OP_DIVIDE_NUM;
+            break;
+        case OP_GREATER:
+            if (ints) return OP_GREATER_INT;
+            if (doubles) return OP_GREATER_NUM;
+            break;
+        case OP_LESS:
+            if (ints) return OP_LESS_INT;
+            if (doubles) return OP_LESS_NUM;
+            break;
+    }
+    return generic;
+}
+
+// every later run of a quickened instruction goes straight to the specialised code
+bool quicken(VM* vm, uint8_t* instruction, uint8_t generic) {
+    uint8_t quick = specialise(generic, peek(vm, 1), peek(vm, 0));
+    if (quick == generic) return false;
+    *instruction = quick;
+    return true;
+}
+
+// Makes the running fiber's stack at least needed slots long. The stack moves when it
+// grows, so every pointer into it moves along with it, the frames' slots and the top
+static bool growStack(VM* vm, size_t needed) {
+    if (needed > STACK_MAX) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    ObjFiber* fiber = vm->fiber;
+    int capacity = fiber->stackCapacity < 8 ? 8 : fiber->stackCapacity * 2;
+    while ((size_t)capacity < needed) capacity *= 2;
+    if (capacity > STACK_MAX) capacity = STACK_MAX;
+
+    Value* stack = ALLOCATE(Value, capacity);
+    if (vm->stack != NULL) memcpy(stack, vm->stack, sizeof(Value) * (size_t)(vm->stackTop - vm->stack));
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    vm->stackTop = stack + (vm->stackTop - vm->stack);
+    FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+    fiber->stack = stack;
+    fiber->stackCapacity = capacity;
+    vm->stack = stack;
+    vm->stackEnd = stack + capacity;
+    return true;
+}
+
+// makes room for one more frame on the running fiber, nothing points into the frames
+// so they can simply be reallocated
+static bool growFrames(VM* vm) {
+    if (vm->frameCapacity >= FRAMES_MAX) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    ObjFiber* fiber = vm->fiber;
+    int capacity = GROW_CAPACITY(fiber->frameCapacity);
+    if (capacity > FRAMES_MAX) capacity = FRAMES_MAX;
+    fiber->frames = GROW_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity, capacity);
+    fiber->frameCapacity = capacity;
+    vm->frames = fiber->frames;
+    vm->frameCapacity = capacity;
+    return true;
+}
+
+void transferFiber(VM* vm, ObjFiber* fiber, Value value) {
+    saveFiber(vm);
+    loadFiber(vm, fiber);
+    if (fiber->state == FIBER_NEW && vm->frames[0].function->arity == 0) {
+        // there's nowhere for the value to go
+    } else if (fiber->state == FIBER_NEW) {
+        push(vm, value);
+    } else {
+        vm->stackTop[-1] = value;
+    }
+    fiber->state = FIBER_RUNNING;
+}
+
+// pushes a frame for a call to function, whose arguments are already on the stack
+static bool call(VM* vm, ObjFunction* function, int argCount) {
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    if (vm->frameCount == vm->frameCapacity && !growFrames(vm)) return false;
+    Value* slots = vm->stackTop - argCount - 1;
+    if (function->maxSlots > vm->stackEnd - slots) {
+        if (!growStack(vm, (size_t)(slots - vm->stack) + (size_t)function->maxSlots)) {
+            return false;
+        }
+        slots = vm->stackTop - argCount - 1;
+    }
+
+    CallFrame* frame = &vm->frames[vm->frameCount++];
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    frame->slots = slots;
+    return true;
 }
 
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+// runs a native on the arguments at the top of the stack and replaces them and the
+// native itself with its result
+static bool callNative(VM* vm, ObjNative* native, int argCount) {
+    if (native->arity != NATIVE_VARIADIC && argCount != native->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", native->arity, argCount);
+        return false;
+    }
+    Value* args = vm->stackTop - argCount;
+    ObjFiber* fiber = vm->fiber;
+    if (!native->function(vm, argCount, args, &args[-1])) return false;
+    // a native that switched fibers has already left this one's stack as it should be
+    if (vm->fiber == fiber) vm->stackTop = args;
+    return true;
 }
 
-static bool isFalsey(Value value) {
-    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+// the slow path of OP_CALL, for anything its fast path didn't handle
+bool callValue(VM* vm, Value callee, int argCount) {
+    if (IS_OBJ(callee)) {
+        switch (OBJ_TYPE(callee)) {
+            case OBJ_FUNCTION:
+                return call(vm, AS_FUNCTION(callee), argCount);
+            case OBJ_NATIVE:
+                return callNative(vm, AS_NATIVE(callee), argCount);
+            default:
+                break; // Non-callable object type.
+        }
+    }
+    runtimeError(vm, "Can only call functions and classes.");
+    return false;
 }
 
-static void concatenate() {
-  ObjString* b = AS_STRING(pop());
-  ObjString* a = AS_STRING(pop());
+void concatenate(VM* vm) {
+  ObjString* b = AS_STRING(pop(vm));
+  ObjString* a = AS_STRING(pop(vm));
 
   int length = a->length + b->length;
   char* chars = ALLOCATE(char, length + 1);
@@ -80,34 +327,212 @@ static void concatenate() {
   memcpy(chars + a->length, b->chars, b->length);
   chars[length] = '\0';
 
-  ObjString* result = takeString(chars, length);
-  push(OBJ_VAL(result));
+  ObjString* result = takeString(&vm->heap, chars, length);
+  push(vm, OBJ_VAL(result));
 }
 
-static InterpretResult run() {
+#if defined(CLOX_TAILCALL_CORE)
+// built with make CORE=tailcall, the handlers in tailcall.c run the bytecode instead
+#define run runTailCall
+#elif defined(CLOX_THREADED_CORE)
+// and with make CORE=threaded, the threaded code of threaded.c
+#define run runThreaded
+#else
+static InterpretResult run(VM* vm) {
+    // The frame of the function we're running and where we are in it. They're kept in
+    // locals so the compiler can hold them in registers, the ip is only written back
+    // to the frame when a call leaves it or something needs to know where we are
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    uint8_t* ip = frame->ip;
+    // Back edges and calls are the only ways a script can keep going indefinitely, so
+    // they're where it pays for its time. Without a budget the count starts so high it
+    // never runs out
+    int64_t budget = vm->budget > 0 ? vm->budget : INT64_MAX;
 //Reads the byte currently pointed at by instruction pointer, then increments
-#define READ_BYTE() (*vm.ip++)
+#define READ_BYTE() (*ip++)
 // Reads the next byte from bytecode ^, uses that as an index, then looks up the value
 // in the constants array
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
+#define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
+// the operand of the _LONG opcodes, 3 bytes with the most significant first
+#define READ_LONG() \
+    (ip += 3, (int)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+// a 2 byte jump offset
+#define READ_SHORT() \
+    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT_LONG() (frame->function->chunk.constants.values[READ_LONG()])
+// reports a runtime error from the instruction we're on and stops the script, the
+// frame has to know where we are for the stack trace
+#define RUNTIME_ERROR(...) \
+    do { \
+        frame->ip = ip; \
+        runtimeError(vm, __VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+// Carries on in machine code if the running function has been compiled and has code
+// for where we are. When the machine code stops we pick up with whichever frame is
+// on top, on the instruction it stopped at. The budget is handed over in a copy so it
+// can stay in a register here
+#define ENTER_JIT() \
+    do { \
+        if (hasJitEntry(frame->function, ip)) { \
+            frame->ip = ip; \
+            int64_t left = budget; \
+            JitStatus status = runJit(vm, frame, &left); \
+            budget = left; \
+            if (status == JIT_ERROR) return INTERPRET_RUNTIME_ERROR; \
+            frame = &vm->frames[vm->frameCount - 1]; \
+            ip = frame->ip; \
+            if (budget == 0) return INTERPRET_YIELD; \
+        } \
+    } while (false)
+// Stops the run once the budget is spent, resuming starts at resumeAt. Everything else
+// the run needs is already in the frames and on the stack
+#define SPEND_BUDGET(resumeAt) \
+    do { \
+        if (--budget == 0) { \
+            frame->ip = (resumeAt); \
+            return INTERPRET_YIELD; \
+        } \
+    } while (false)
+// the global instructions are the same for both operand widths apart from how they
+// read the name, so they share these bodies
+#define GET_GLOBAL(name) \
+    do { \
+        Value value; \
+        if (!tableGet(&vm->globals, name, &value)) { \
+            RUNTIME_ERROR("Undefined variable '%s'.", name->chars); \
+        } \
+        push(vm, value); \
+    } while (false)
+// assigning to a global that was never defined is an error, tableSet tells us it
+// just created the key so we take it back out again
+#define SET_GLOBAL(name) \
+    do { \
+        if (tableSet(&vm->globals, name, peek(vm, 0))) { \
+            tableDelete(&vm->globals, name); \
+            RUNTIME_ERROR("Undefined variable '%s'.", name->chars); \
+        } \
+    } while (false)
 // This is a creative use of the C pre processor, the outer while loop here is kind of
 // strange but basically is a pattern that allows us to write multi line macro statements
 // without any strange behaviour occuring
 #define BINARY_OP(valueType, op) \
     do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers."); \
-            return INTERPRET_RUNTIME_ERROR; \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(pop(vm)); \
+        double a = AS_NUMBER(pop(vm)); \
+        push(vm, valueType(a op b)); \
+    } while (false)
+// When both operands are ints we try the operation in integers first, overflowFn
+// reports whether the result doesn't fit, in which case (or for any other mix of
+// numbers) we fall back on doing it in doubles
+#define INT_BINARY_OP(overflowFn, op) \
+    do { \
+        Value b = peek(vm, 0); \
+        Value a = peek(vm, 1); \
+        int64_t result; \
+        if (IS_INT(a) && IS_INT(b) && !overflowFn(AS_INT(a), AS_INT(b), &result)) { \
+            vm->stackTop--; \
+            vm->stackTop[-1] = INT_VAL(result); \
+            break; \
+        } \
+        BINARY_OP(NUMBER_VAL, op); \
+    } while (false)
+// comparing two ints can't overflow, but does have to be done in integers to be
+// exact above 2^53
+#define COMPARE_OP(op) \
+    do { \
+        Value b = peek(vm, 0); \
+        Value a = peek(vm, 1); \
+        if (IS_INT(a) && IS_INT(b)) { \
+            vm->stackTop--; \
+            vm->stackTop[-1] = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+            break; \
+        } \
+        BINARY_OP(BOOL_VAL, op); \
+    } while (false)
+// a quickened instruction that sees operands it wasn't made for turns back into the
+// generic one and backs up so that runs instead
+#define DESPECIALISE(generic) (ip[-1] = (generic), ip--)
+// the generic instructions start with this, see quicken
+#define QUICKEN(generic) \
+    if (!frame->function->chunk.frozen && quicken(vm, ip - 1, generic)) { \
+        ip--; \
+        break; \
+    }
+// The quickened forms only check that their operands are still what they expect,
+// there's no working out which of several cases we're in
+#define QUICK_INT_OP(generic, overflowFn, op) \
+    do { \
+        Value b = peek(vm, 0); \
+        Value a = peek(vm, 1); \
+        if (!IS_INT(a) || !IS_INT(b)) { \
+            DESPECIALISE(generic); \
+            break; \
+        } \
+        int64_t result; \
+        vm->stackTop--; \
+        if (overflowFn(AS_INT(a), AS_INT(b), &result)) { \
+            vm->stackTop[-1] = NUMBER_VAL((double)AS_INT(a) op (double)AS_INT(b)); \
+        } else { \
+            vm->stackTop[-1] = INT_VAL(result); \
+        } \
+    } while (false)
+#define QUICK_INT_COMPARE(generic, op) \
+    do { \
+        Value b = peek(vm, 0); \
+        Value a = peek(vm, 1); \
+        if (!IS_INT(a) || !IS_INT(b)) { \
+            DESPECIALISE(generic); \
+            break; \
+        } \
+        vm->stackTop--; \
+        vm->stackTop[-1] = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+    } while (false)
+#define QUICK_DOUBLE_OP(generic, valueType, op) \
+    do { \
+        Value b = peek(vm, 0); \
+        Value a = peek(vm, 1); \
+        if (!IS_DOUBLE(a) || !IS_DOUBLE(b)) { \
+            DESPECIALISE(generic); \
+            break; \
+        } \
+        vm->stackTop--; \
+        vm->stackTop[-1] = valueType(AS_DOUBLE(a) op AS_DOUBLE(b)); \
+    } while (false)
+// the operands are certainly numbers, the compiler proved it, so all that's left is
+// whether they're both ints
+#define NUMBERS_OP(overflowFn, op) \
+    do { \
+        Value b = peek(vm, 0); \
+        Value a = peek(vm, 1); \
+        int64_t result; \
+        vm->stackTop--; \
+        if (IS_INT(a) && IS_INT(b) && !overflowFn(AS_INT(a), AS_INT(b), &result)) { \
+            vm->stackTop[-1] = INT_VAL(result); \
+        } else { \
+            vm->stackTop[-1] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } \
+    } while (false)
+#define NUMBERS_COMPARE(op) \
+    do { \
+        Value b = peek(vm, 0); \
+        Value a = peek(vm, 1); \
+        vm->stackTop--; \
+        if (IS_INT(a) && IS_INT(b)) { \
+            vm->stackTop[-1] = BOOL_VAL(AS_INT(a) op AS_INT(b)); \
+        } else { \
+            vm->stackTop[-1] = BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
     } while (false)
     for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
     printf("         ");
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
         printf("[ ");
         printValue(*slot);
         printf(" ]");
@@ -115,121 +540,444 @@ static InterpretResult run() {
     printf("\n");
     // This function takes an integer offset, so we need to do some pointer math to convert
     // ip back to its relative offset from the beginning of the bytecode
-    disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+    disassembleInstruction(&frame->function->chunk,
+                           (int)(ip - frame->function->chunk.code));
 #endif
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
-                push(constant);
+                push(vm, constant);
                 break;
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
+            case OP_CONSTANT_LONG: push(vm, READ_CONSTANT_LONG()); break;
+            case OP_NIL: push(vm, NIL_VAL); break;
+            case OP_TRUE: push(vm, BOOL_VAL(true)); break;
+            case OP_FALSE: push(vm, BOOL_VAL(false)); break;
+            case OP_POP: pop(vm); break;
             case OP_GET_LOCAL: {
                 uint8_t slot = READ_BYTE();
-                push(vm.stack[slot]);
+                push(vm, frame->slots[slot]);
                 break;
             }
+            case OP_GET_LOCAL_LONG: push(vm, frame->slots[READ_LONG()]); break;
             case OP_SET_LOCAL: {
                 uint8_t slot = READ_BYTE();
-                vm.stack[slot] = peek(0);
+                frame->slots[slot] = peek(vm, 0);
                 break;
             }
+            case OP_SET_LOCAL_LONG: frame->slots[READ_LONG()] = peek(vm, 0); break;
             case OP_GET_GLOBAL: {
                 ObjString* name = READ_STRING();
-                printf("NAME: %s\n", name->chars);
-                Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                printf("GOT: %s\n", AS_STRING(value)->chars);
-                push(value);
+                GET_GLOBAL(name);
+                break;
+            }
+            case OP_GET_GLOBAL_LONG: {
+                ObjString* name = READ_STRING_LONG();
+                GET_GLOBAL(name);
+                break;
+            }
+            case OP_SET_GLOBAL: {
+                ObjString* name = READ_STRING();
+                SET_GLOBAL(name);
+                break;
+            }
+            case OP_SET_GLOBAL_LONG: {
+                ObjString* name = READ_STRING_LONG();
+                SET_GLOBAL(name);
                 break;
             }
             case OP_DEFINE_GLOBAL: {
                 ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
+                tableSet(&vm->globals, name, peek(vm, 0));
+                pop(vm);
+                break;
+            }
+            case OP_DEFINE_GLOBAL_LONG: {
+                ObjString* name = READ_STRING_LONG();
+                tableSet(&vm->globals, name, peek(vm, 0));
+                pop(vm);
                 break;
             }
             case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
+                Value b = pop(vm);
+                Value a = pop(vm);
+                push(vm, BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
+            case OP_GREATER:
+                QUICKEN(OP_GREATER);
+                COMPARE_OP(>);
+                break;
+            case OP_LESS:
+                QUICKEN(OP_LESS);
+                COMPARE_OP(<);
+                break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                  concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                  double b = AS_NUMBER(pop());
-                  double a = AS_NUMBER(pop());
-                  push(NUMBER_VAL(a + b));
+                QUICKEN(OP_ADD);
+                int64_t result;
+                if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1)) &&
+                    !__builtin_add_overflow(AS_INT(peek(vm, 1)), AS_INT(peek(vm, 0)), &result)) {
+                  vm->stackTop--;
+                  vm->stackTop[-1] = INT_VAL(result);
+                } else if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                  concatenate(vm);
+                } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                  double b = AS_NUMBER(pop(vm));
+                  double a = AS_NUMBER(pop(vm));
+                  push(vm, NUMBER_VAL(a + b));
                 } else {
-                  runtimeError(
+                  RUNTIME_ERROR(
                       "Operands must be two numbers or two strings.");
-                  return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
+            case OP_SUBTRACT:
+                QUICKEN(OP_SUBTRACT);
+                INT_BINARY_OP(__builtin_sub_overflow, -);
+                break;
+            case OP_MULTIPLY:
+                QUICKEN(OP_MULTIPLY);
+                INT_BINARY_OP(multiplyOverflows, *);
+                break;
+            // division always gives a double, 7 / 2 is still 3.5
+            case OP_DIVIDE:
+                QUICKEN(OP_DIVIDE);
+                BINARY_OP(NUMBER_VAL, /);
+                break;
+            case OP_ADD_INT: QUICK_INT_OP(OP_ADD, __builtin_add_overflow, +); break;
+            case OP_ADD_NUM: QUICK_DOUBLE_OP(OP_ADD, NUMBER_VAL, +); break;
+            case OP_ADD_STR:
+                if (!IS_STRING(peek(vm, 0)) || !IS_STRING(peek(vm, 1))) {
+                    DESPECIALISE(OP_ADD);
+                    break;
+                }
+                concatenate(vm);
+                break;
+            case OP_SUBTRACT_INT:
+                QUICK_INT_OP(OP_SUBTRACT, __builtin_sub_overflow, -);
+                break;
+            case OP_SUBTRACT_NUM: QUICK_DOUBLE_OP(OP_SUBTRACT, NUMBER_VAL, -); break;
+            case OP_MULTIPLY_INT: QUICK_INT_OP(OP_MULTIPLY, multiplyOverflows, *); break;
+            case OP_MULTIPLY_NUM: QUICK_DOUBLE_OP(OP_MULTIPLY, NUMBER_VAL, *); break;
+            case OP_DIVIDE_INT: {
+                Value b = peek(vm, 0);
+                Value a = peek(vm, 1);
+                if (!IS_INT(a) || !IS_INT(b)) {
+                    DESPECIALISE(OP_DIVIDE);
+                    break;
+                }
+                vm->stackTop--;
+                vm->stackTop[-1] = NUMBER_VAL((double)AS_INT(a) / (double)AS_INT(b));
+                break;
+            }
+            case OP_DIVIDE_NUM: QUICK_DOUBLE_OP(OP_DIVIDE, NUMBER_VAL, /); break;
+            case OP_GREATER_INT: QUICK_INT_COMPARE(OP_GREATER, >); break;
+            case OP_GREATER_NUM: QUICK_DOUBLE_OP(OP_GREATER, BOOL_VAL, >); break;
+            case OP_LESS_INT: QUICK_INT_COMPARE(OP_LESS, <); break;
+            case OP_LESS_NUM: QUICK_DOUBLE_OP(OP_LESS, BOOL_VAL, <); break;
+            case OP_ADD_NUMBERS: NUMBERS_OP(__builtin_add_overflow, +); break;
+            case OP_SUBTRACT_NUMBERS: NUMBERS_OP(__builtin_sub_overflow, -); break;
+            case OP_MULTIPLY_NUMBERS: NUMBERS_OP(multiplyOverflows, *); break;
+            case OP_DIVIDE_NUMBERS: {
+                double b = AS_NUMBER(pop(vm));
+                vm->stackTop[-1] = NUMBER_VAL(AS_NUMBER(vm->stackTop[-1]) / b);
+                break;
+            }
+            case OP_GREATER_NUMBERS: NUMBERS_COMPARE(>); break;
+            case OP_LESS_NUMBERS: NUMBERS_COMPARE(<); break;
+            case OP_NEGATE_NUMBER: {
+                Value value = vm->stackTop[-1];
+                if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT64_MIN) {
+                    vm->stackTop[-1] = INT_VAL(-AS_INT(value));
+                } else {
+                    vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(value));
+                }
+                break;
+            }
             case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
+                push(vm, BOOL_VAL(isFalsey(pop(vm))));
                 break;
             case OP_NEGATE:
                 // we can now use the macros to check whether the value on top of the stack
                 // is actually a number
-                if (!IS_NUMBER(peek(0))) {
+                if (!IS_NUMBER(peek(vm, 0))) {
                     // if not then we cant perform the negation operation so report a runtime error
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+            {
+                Value value = pop(vm);
+                // -0 and -INT64_MIN aren't ints
+                if (IS_INT(value) && AS_INT(value) != 0 && AS_INT(value) != INT64_MIN) {
+                    push(vm, INT_VAL(-AS_INT(value)));
+                } else {
+                    push(vm, NUMBER_VAL(-AS_NUMBER(value)));
                 }
-            push(NUMBER_VAL(-AS_NUMBER(pop()))); break;
+                break;
+            }
             case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
+                writeValue(&vm->output, pop(vm));
+                writeNewline(&vm->output);
+                break;
+            }
+            case OP_JUMP: {
+                uint16_t offset = READ_SHORT();
+                ip += offset;
+                break;
+            }
+            case OP_JUMP_IF_FALSE: {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(peek(vm, 0))) ip += offset;
+                break;
+            }
+            case OP_JUMP_BACK: {
+                uint16_t offset = READ_SHORT();
+                ip -= offset;
+                SPEND_BUDGET(ip);
+                ENTER_JIT();
+                break;
+            }
+            case OP_LOOP: {
+                uint16_t offset = READ_SHORT();
+                uint16_t loop = READ_SHORT();
+                // this is all it costs to know which loops are hot, a shared script's
+                // counters would just be fought over by every VM running it
+                if (!frame->function->chunk.frozen &&
+                    ++frame->function->chunk.loopCounters[loop] == HOT_LOOP_THRESHOLD &&
+                    vm->jit) {
+                    compileJit(frame->function);
+                }
+                ip -= offset;
+                SPEND_BUDGET(ip);
+                ENTER_JIT();
+                break;
+            }
+            case OP_CALL: {
+                // a yield here runs the whole call again when we resume
+                SPEND_BUDGET(ip - 1);
+                int argCount = READ_BYTE();
+                Value callee = peek(vm, argCount);
+                // The usual call is to a function with the right number of arguments
+                // and plenty of stack left, we set that up right here. Anything else,
+                // errors included, goes through callValue
+                if (IS_FUNCTION(callee)) {
+                    ObjFunction* function = AS_FUNCTION(callee);
+                    Value* slots = vm->stackTop - argCount - 1;
+                    if (function->arity == argCount && vm->frameCount < vm->frameCapacity &&
+                        function->maxSlots <= vm->stackEnd - slots) {
+                        frame->ip = ip;
+                        frame = &vm->frames[vm->frameCount++];
+                        frame->function = function;
+                        frame->slots = slots;
+                        ip = function->chunk.code;
+                        if (vm->jit && function->calls < HOT_CALL_THRESHOLD &&
+                            ++function->calls == HOT_CALL_THRESHOLD) {
+                            compileJit(function);
+                        }
+                        ENTER_JIT();
+                        break;
+                    }
+                } else if (IS_NATIVE(callee)) {
+                    // Natives get the arguments where they are and write their result
+                    // over the native, there's no frame to set up. The ip is saved
+                    // first in case the native reports an error
+                    ObjNative* native = AS_NATIVE(callee);
+                    Value* args = vm->stackTop - argCount;
+                    if (native->arity == argCount || native->arity == NATIVE_VARIADIC) {
+                        ObjFiber* fiber = vm->fiber;
+                        frame->ip = ip;
+                        if (!native->function(vm, argCount, args, &args[-1])) {
+                            return INTERPRET_RUNTIME_ERROR;
+                        }
+                        if (vm->fiber != fiber) {
+                            // it switched fibers, we carry on wherever the new one was
+                            frame = &vm->frames[vm->frameCount - 1];
+                            ip = frame->ip;
+                            break;
+                        }
+                        vm->stackTop = args;
+                        ENTER_JIT();
+                        break;
+                    }
+                }
+                frame->ip = ip;
+                if (!callValue(vm, callee, argCount)) return INTERPRET_RUNTIME_ERROR;
+                frame = &vm->frames[vm->frameCount - 1];
+                ip = frame->ip;
+                ENTER_JIT();
+                break;
+            }
+            case OP_ARRAY: {
+                int count = READ_BYTE();
+                Value* elements = vm->stackTop - count;
+                for (int i = 0; i < count; i++) {
+                    if (!IS_NUMBER(elements[i])) {
+                        RUNTIME_ERROR("Arrays can only hold numbers.");
+                    }
+                }
+                ObjArray* array = newArray(&vm->heap, count);
+                for (int i = 0; i < count; i++) {
+                    array->values[i] = AS_NUMBER(elements[i]);
+                }
+                vm->stackTop = elements;
+                push(vm, OBJ_VAL(array));
+                break;
+            }
+            case OP_GET_INDEX: {
+                Value index = peek(vm, 0);
+                Value array = peek(vm, 1);
+                if (!IS_ARRAY(array)) RUNTIME_ERROR("Only arrays can be indexed.");
+                if (!IS_INT(index)) RUNTIME_ERROR("Array index must be a whole number.");
+                ObjArray* elements = AS_ARRAY(array);
+                // a negative index wraps round to a huge one, so one check covers both ends
+                if ((uint64_t)AS_INT(index) >= (uint64_t)elements->count) {
+                    RUNTIME_ERROR("Array index %lld out of bounds.", (long long)AS_INT(index));
+                }
+                vm->stackTop--;
+                vm->stackTop[-1] = NUMBER_VAL(elements->values[AS_INT(index)]);
+                break;
+            }
+            case OP_SET_INDEX: {
+                Value value = peek(vm, 0);
+                Value index = peek(vm, 1);
+                Value array = peek(vm, 2);
+                if (!IS_ARRAY(array)) RUNTIME_ERROR("Only arrays can be indexed.");
+                if (!IS_INT(index)) RUNTIME_ERROR("Array index must be a whole number.");
+                if (!IS_NUMBER(value)) RUNTIME_ERROR("Arrays can only hold numbers.");
+                ObjArray* elements = AS_ARRAY(array);
+                if ((uint64_t)AS_INT(index) >= (uint64_t)elements->count) {
+                    RUNTIME_ERROR("Array index %lld out of bounds.", (long long)AS_INT(index));
+                }
+                elements->values[AS_INT(index)] = AS_NUMBER(value);
+                // the assignment's value is what it leaves behind
+                vm->stackTop -= 2;
+                vm->stackTop[-1] = value;
                 break;
             }
             case OP_RETURN: {
-                return INTERPRET_OK;
+                Value result = pop(vm);
+                vm->frameCount--;
+                if (vm->frameCount == 0) {
+                    if (vm->fiber == &vm->mainFiber) {
+                        // the script itself is finished, all that's left is its function
+                        pop(vm);
+                        // but it isn't done until every fiber it spawned is
+                        if (!runNextFiber(vm)) return INTERPRET_OK;
+                        frame = &vm->frames[vm->frameCount - 1];
+                        ip = frame->ip;
+                        break;
+                    }
+                    // A fiber's function returning finishes the fiber, and what it
+                    // returned is what the resume that started this run of it returns.
+                    // A spawned fiber has nobody to return to, the event loop picks
+                    // what runs next. Nothing runs on it again so its stacks can go
+                    ObjFiber* fiber = vm->fiber;
+                    ObjFiber* caller = fiber->caller;
+                    vm->stackTop = vm->stack;
+                    fiber->caller = NULL;
+                    fiber->state = FIBER_DONE;
+                    if (caller != NULL) {
+                        transferFiber(vm, caller, result);
+                    } else if (!runNextFiber(vm)) {
+                        // that was the last one, and the script had already finished
+                        resetStack(vm);
+                        freeFiberStacks(fiber);
+                        return INTERPRET_OK;
+                    }
+                    freeFiberStacks(fiber);
+                    frame = &vm->frames[vm->frameCount - 1];
+                    ip = frame->ip;
+                    break;
+                }
+                // the callee and its arguments are replaced by the result
+                vm->stackTop = frame->slots;
+                push(vm, result);
+                frame = &vm->frames[vm->frameCount - 1];
+                ip = frame->ip;
+                ENTER_JIT();
+                break;
             }
         }
     }
 #undef READ_BYTE
+#undef READ_SHORT
 #undef READ_CONSTANT
 #undef BINARY_OP
+#undef INT_BINARY_OP
+#undef COMPARE_OP
+#undef DESPECIALISE
+#undef QUICKEN
+#undef RUNTIME_ERROR
+#undef QUICK_INT_OP
+#undef QUICK_INT_COMPARE
+#undef QUICK_DOUBLE_OP
+#undef NUMBERS_OP
+#undef NUMBERS_COMPARE
 #undef READ_STRING
+#undef READ_LONG
+#undef READ_CONSTANT_LONG
+#undef READ_STRING_LONG
+#undef SPEND_BUDGET
+#undef GET_GLOBAL
+#undef SET_GLOBAL
+#undef ENTER_JIT
 }
+#endif
 
-// this interprets the source code
-InterpretResult interpret(const char* source) {
-    // create a chunk and init it
-    Chunk chunk;
-    initChunk(&chunk);
+static InterpretResult finishRun(VM* vm, InterpretResult result) {
+#ifdef DEBUG_LOOP_HOTNESS
+    if (result != INTERPRET_YIELD) {
+        for (Obj* object = vm->heap.objects; object != NULL; object = object->next) {
+            if (object->type != OBJ_FUNCTION) continue;
+            ObjFunction* function = (ObjFunction*)object;
+            printLoopHotness(&function->chunk,
+                             function->name != NULL ? function->name->chars : "<script>");
+        }
+    }
+#endif
+    // The caller may exit straight away, so nothing printed can be left in the buffer.
+    // A yielded run may not be resumed for a while, so its output goes out now too
+    flushOutput(&vm->output);
+    return result;
+}
+
+InterpretResult interpretFunction(VM* vm, ObjFunction* script) {
+    return interpretFrom(vm, script, 0);
+}
 
-    // if compile fails, free the chunk and return an error
-    if (!compile(source, &chunk)) {
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+InterpretResult interpretFrom(VM* vm, ObjFunction* script, int offset) {
+    resetStack(vm);
+    if (vm->frameCapacity == 0 && !growFrames(vm)) return INTERPRET_RUNTIME_ERROR;
+    if (script->maxSlots > vm->stackEnd - vm->stack &&
+        !growStack(vm, (size_t)script->maxSlots)) {
+        return INTERPRET_RUNTIME_ERROR;
     }
+    // the script runs as a call to its top level function, in slot 0 like any other
+    push(vm, OBJ_VAL(script));
+    CallFrame* frame = &vm->frames[vm->frameCount++];
+    frame->function = script;
+    // start at the first instruction we haven't run yet
+    frame->ip = script->chunk.code + offset;
+    frame->slots = vm->stack;
+    return finishRun(vm, run(vm));
+}
 
-    // set the vm chunk to the created chunk
-    vm.chunk = &chunk;
-    // set instruction pointer to the first opcode
-    vm.ip = vm.chunk->code;
+InterpretResult resumeVM(VM* vm) {
+    // a run that finished or failed has nothing left to resume
+    if (vm->frameCount == 0) return INTERPRET_OK;
+    return finishRun(vm, run(vm));
+}
 
-    // interpret the result using the virtual machine
-    InterpretResult result = run();
+// this interprets the source code
+InterpretResult interpret(VM* vm, const char* source) {
+    ObjFunction* script = compile(&vm->heap, source);
+    if (script == NULL) return INTERPRET_COMPILE_ERROR;
+    // the function belongs to the heap, it's freed along with everything else
+    return interpretFunction(vm, script);
+}
 
-    // free the chunk
-    freeChunk(&chunk);
-    return result;
+InterpretResult interpretSource(VM* vm, Source* source) {
+    ObjFunction* script = compileSource(&vm->heap, source, NULL);
+    if (script == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(vm, script);
 }
@@ -2,33 +2,92 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "loop.h"
+#include "object.h"
+#include "output.h"
+#include "source.h"
 #include "table.h"
 #include "value.h"
 
-#define STACK_MAX 256
+// how deep calls can nest on one fiber before we call it a stack overflow
+#define FRAMES_MAX 1024
+// Functions can have up to UINT16_COUNT locals in scope but almost never do. Calls check
+// there's room for the function's maxSlots before they start, growing the fiber's
+// stack if there isn't, so a deep recursion or a huge function just runs out of stack
+// with a runtime error once it gets this big rather than overrunning it
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
 
-typedef struct {
-    Chunk* chunk;
-    uint8_t* ip;
-    Value stack[STACK_MAX];
+typedef struct VM {
+    // The fiber that's running. The interpreter works on copies of its frames and
+    // stack kept right here, switching fibers writes them back into the fiber and
+    // loads the next one's, which is all a switch costs
+    ObjFiber* fiber;
+    CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
     Value* stackTop;
+    // one past the last slot the stack has room for
+    Value* stackEnd;
+    // the fiber every script starts on, it belongs to the VM rather than the heap
+    ObjFiber mainFiber;
+    // the fibers waiting on I/O, and those ready to run again
+    EventLoop loop;
     Table globals;
-    Table strings;
-    Obj* objects;
+    // every object the running script creates, and the interned strings
+    Heap heap;
+    // where print statements write to
+    Output output;
+    // How many back edges and calls a run gets before it stops and returns
+    // INTERPRET_YIELD, so a script that never finishes can't keep its thread for good.
+    // 0 means there's no limit, which is how initVM leaves it
+    int64_t budget;
+    // compile hot functions to machine code (see jit.h), initVM leaves it off
+    bool jit;
 } VM;
 
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
     INTERPRET_RUNTIME_ERROR,
+    // the script used up its budget, its frames and stack are left exactly as they
+    // were so resumeVM can carry on from there
+    INTERPRET_YIELD,
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+// A VM is entirely self contained, everything a running script can reach lives in it
+// or on its heap, so separate VMs can run on separate threads at the same time with
+// nothing shared between them
+void initVM(VM* vm);
+// Starts the VM from the heap image at path (see image.h) rather than defining
+// everything afresh, so it begins with whatever globals the VM that wrote the image
+// had. If the image can't be used this is initVM and returns false
+bool initVMFromImage(VM* vm, const char* path);
+void freeVM(VM* vm);
+// puts the VM back the way initVM left it, forgetting every global and object the
+// scripts it ran made, without giving up the VM itself. A VM started from an image
+// lets go of it too and starts over with only the natives
+void resetVM(VM* vm);
+InterpretResult interpret(VM* vm, const char* source);
+InterpretResult interpretSource(VM* vm, Source* source);
+// runs the top level of an already compiled (or cached) script
+InterpretResult interpretFunction(VM* vm, ObjFunction* script);
+// runs script starting at offset in its code, the REPL uses it to run each new entry
+InterpretResult interpretFrom(VM* vm, ObjFunction* script, int offset);
+// carries on with a run that yielded, on a fresh budget
+InterpretResult resumeVM(VM* vm);
+// Hands control to fiber, which gets value as what its yield returns, or as its
+// function's argument if it hasn't started yet. The running fiber's stack must
+// already be cut back so its top slot is where the value it gets back should go.
+// This is how the fiber natives switch, the interpreter carries on in fiber as soon
+// as the native returns
+void transferFiber(VM* vm, ObjFiber* fiber, Value value);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+// Makes a C function available to scripts as a global called name. Calls with any
+// other number of arguments than arity are errors, unless it's NATIVE_VARIADIC
+void defineNative(VM* vm, const char* name, NativeFn function, int arity);
+// reports a runtime error from inside a native, which then returns what this does
+bool nativeError(VM* vm, const char* format, ...);
 
 #endif
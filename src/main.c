@@ -1,91 +1,213 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "batch.h"
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "image.h"
+#include "repl.h"
+#include "runner.h"
+#include "script.h"
+#include "source.h"
 #include "vm.h"
 
-static void repl() {
-    // our repl here has a hard coded line length limit, this is not the norm
-    // but is okay for our purposes
-    char line[1024];
+static void repl(VM* vm) {
+    // the session keeps the compiled code and its constants between entries
+    ReplSession session;
+    initReplSession(&session, vm);
+    // getline grows the buffer for us, so there is no limit on how long a line can be
+    char* line = NULL;
+    size_t capacity = 0;
+    ReplStatus status = REPL_DONE;
     for (;;) {
-        // print a helper character at the start of each repl line
-        printf("> ");
+        // print a helper character at the start of each repl line, a different one
+        // while we're still in the middle of an entry
+        printf(status == REPL_CONTINUE ? "... " : "> ");
         // get stdin and load into char array
-        if (!fgets(line, sizeof(line), stdin)) {
+        if (getline(&line, &capacity, stdin) == -1) {
             printf("\n");
             break;
         }
-        // interpret that line
-        interpret(line);
+        // add the line to the entry, running it once it is complete
+        status = replLine(&session, line);
     }
+    free(line);
+    freeReplSession(&session);
 }
 
-static char* readFile(const char* path) {
-    // open the filej
-    FILE* file = fopen(path, "rb");
-    // print a logical error response if unable to open the file
-    if (file == NULL) {
+// runs a script from a file, or from stdin if the path is "-"
+static void runFile(VM* vm, const char* path) {
+    // regular files get mapped straight into memory, anything else (a pipe, a fifo,
+    // stdin) is streamed to the scanner a block at a time, either way we never make
+    // our own copy of the whole script
+    Source source;
+    if (strcmp(path, "-") == 0) {
+        openSourceStream(&source, stdin);
+    } else if (!openSourceFile(&source, path)) {
+        // print a logical error response if unable to open the file
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
+    InterpretResult result;
+    if (strcmp(path, "-") == 0) {
+        // interpret the source code
+        result = interpretSource(vm, &source);
+    } else {
+        // if we've compiled this exact script before we can skip straight to running
+        // the cached bytecode, otherwise compile it and cache it for next time
+        ObjFunction* script = loadBytecodeCache(&vm->heap, path, &source);
+        if (script == NULL) {
+            script = compileSource(&vm->heap, &source, NULL);
+            if (script != NULL) writeBytecodeCache(path, &source, script);
+        }
+        result = script != NULL ? interpretFunction(vm, script) : INTERPRET_COMPILE_ERROR;
+    }
+    // then unmap or free the text, nothing refers to it once compilation is done
+    closeSource(&source);
 
-    // seek basically allows us to walk through the entire file, by passing
-    // in SEEK END we go to the end of the file
-    fseek(file, 0L, SEEK_END);
-    // ftell then tells us how many bytes we are from the start of the file
-    size_t fileSize = ftell(file);
-    // we then rewind back to the beginning of the file
-    rewind(file);
-
-    // then we allocate a char buffer of that size
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        // will only happen if OS doesnt have enough memory to read file in
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+    // exit codes differ for each error
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+// clox --compile [--jobs N] files... compiles scripts ahead of time, filling in their
+// bytecode caches without running them
+static void compileOnly(int argc, const char* argv[]) {
+    int first = 2;
+    // one thread per core unless told otherwise
+    int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 3 && strcmp(argv[2], "--jobs") == 0) {
+        jobs = atoi(argv[3]);
+        first = 4;
     }
-    // then we read the whole file in a single batch
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+    if (first >= argc || jobs < 1) {
+        fprintf(stderr, "Usage: clox --compile [--jobs N] path...\n");
+        exit(64);
     }
-    buffer[bytesRead] = '\0';
-
-    fclose(file);
-    return buffer;
+    if (!compileFiles(argv + first, argc - first, jobs)) exit(65);
 }
 
+// the one VM the command line runs scripts in
+static VM vm;
 
-static void runFile(const char* path) {
-    // read in the file
-    char* source = readFile(path);
-    // interpret the source code
-    InterpretResult result = interpret(source);
-    // then free the char array (we need to do this because readfile dynamically
-    // allocates the memory and then passes ownership to this function)
-    free(source);
+// clox --jobs N [--repeat R] files... runs every script (R times over) on a pool of
+// N threads, compiling each one only once, then reports how long the runs took
+static void runJobs(int argc, const char* argv[]) {
+    int first = 3;
+    int workers = argc > 2 ? atoi(argv[2]) : 0;
+    int repeat = 1;
+    if (argc > 4 && strcmp(argv[3], "--repeat") == 0) {
+        repeat = atoi(argv[4]);
+        first = 5;
+    }
+    if (first >= argc || workers < 1 || repeat < 1) {
+        fprintf(stderr, "Usage: clox --jobs N [--repeat R] path...\n");
+        exit(64);
+    }
 
-    // exit codes differ for each error
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    int scriptCount = argc - first;
+    Script** scripts = (Script**)malloc(sizeof(Script*) * (size_t)scriptCount);
+    for (int i = 0; i < scriptCount; i++) {
+        scripts[i] = loadScript(argv[first + i]);
+        if (scripts[i] == NULL) exit(65);
+    }
+    int count = scriptCount * repeat;
+    Script** jobs = (Script**)malloc(sizeof(Script*) * (size_t)count);
+    for (int i = 0; i < count; i++) jobs[i] = scripts[i % scriptCount];
+
+    RunReport report;
+    bool succeeded = runScripts(jobs, count, workers, &report);
+    fprintf(stderr, "%d jobs on %d threads in %.3fs (%.0f jobs/s), %d failed\n",
+            report.jobs, report.workers, report.seconds,
+            report.seconds > 0 ? report.jobs / report.seconds : 0.0, report.failed);
+    fprintf(stderr, "latency p50 %.1fus p90 %.1fus p99 %.1fus max %.1fus\n",
+            report.p50, report.p90, report.p99, report.max);
+
+    // every VM that ran them is gone, so the scripts can go too
+    for (int i = 0; i < scriptCount; i++) freeScript(scripts[i]);
+    free(scripts);
+    free(jobs);
+    if (!succeeded) exit(70);
+}
+
+// clox --snapshot image [path...] runs the scripts, a prelude of functions and
+// constants say, and saves the heap they leave behind as an image that later runs can
+// start from with --image
+static void snapshot(int argc, const char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: clox --snapshot image [path...]\n");
+        exit(64);
+    }
+    for (int i = 3; i < argc; i++) runFile(&vm, argv[i]);
+    if (!writeHeapImage(&vm.heap, &vm.globals, argv[2])) exit(74);
 }
 
 int main(int argc, const char* argv[]) {
-    initVM();
-    if (argc == 1) {
-        repl();
+    // --jit compiles hot functions to machine code and --image image starts from a
+    // heap image instead of from scratch, whatever follows them is then read as if it
+    // were the whole command line
+    bool jit = false;
+    const char* image = NULL;
+    for (;;) {
+        if (argc > 1 && strcmp(argv[1], "--jit") == 0) {
+            jit = true;
+            argc--;
+            argv++;
+        } else if (argc > 2 && strcmp(argv[1], "--image") == 0) {
+            image = argv[2];
+            argc -= 2;
+            argv += 2;
+        } else {
+            break;
+        }
+    }
+    if (image == NULL) {
+        initVM(&vm);
+    } else if (!initVMFromImage(&vm, image)) {
+        fprintf(stderr, "Could not load heap image \"%s\".\n", image);
+        exit(74);
+    }
+    vm.jit = jit;
+    if (argc > 1 && strcmp(argv[1], "--snapshot") == 0) {
+        snapshot(argc, argv);
+        freeVM(&vm);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--compile") == 0) {
+        compileOnly(argc, argv);
+        freeVM(&vm);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "--jobs") == 0) {
+        runJobs(argc, argv);
+        freeVM(&vm);
+        return 0;
+    }
+    // --repl runs the REPL even when stdin isn't a terminal, so a session can be piped
+    // in one line at a time, which is how tests/run.sh replays one
+    bool forceRepl = argc == 2 && strcmp(argv[1], "--repl") == 0;
+    if (argc == 1 || forceRepl) {
+        // if stdin is a pipe rather than a terminal, treat it as a script
+        if (forceRepl || isatty(fileno(stdin))) {
+            repl(&vm);
+        } else {
+            runFile(&vm, "-");
+        }
     } else if (argc == 2) {
-        runFile(argv[1]);
+        runFile(&vm, argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--jit] [--image image] [path | --repl]\n"
+                        "       clox --compile [--jobs N] path...\n"
+                        "       clox --jobs N [--repeat R] path...\n"
+                        "       clox [--jit] [--image image] --snapshot image [path...]\n");
         exit(64);
     }
-    freeVM();
+    freeVM(&vm);
     return 0;
 }
 
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Runs every script under tests/ through clox twice, once interpreted and once with
+# --jit, and checks both against what the script is expected to print. A name.lox is
+# run as a file, a name.repl is piped into clox --repl a line at a time, as a REPL
+# session would type it. name.out holds the expected stdout, and name.err, when there
+# is one, the expected stderr. The expected output doesn't depend on the core, so
+# make CORE=threaded check checks the threaded core against the very same files
+#
+# usage: tests/run.sh [path to clox]
+clox=${1:-bin/clox}
+dir=$(dirname "$0")
+out=$(mktemp)
+err=$(mktemp)
+trap 'rm -f "$out" "$err"' EXIT
+failed=0
+count=0
+for script in "$dir"/*/*.lox "$dir"/*/*.repl; do
+    [ -e "$script" ] || continue
+    base=${script%.*}
+    for mode in "" --jit; do
+        count=$((count + 1))
+        case $script in
+        *.repl) $clox $mode --repl < "$script" > "$out" 2> "$err" ;;
+        *) $clox $mode "$script" > "$out" 2> "$err" ;;
+        esac
+        if ! cmp -s "$out" "$base.out"; then
+            echo "FAIL $script $mode: stdout differs"
+            diff "$base.out" "$out" | head -20
+            failed=$((failed + 1))
+        elif [ -e "$base.err" ] && ! cmp -s "$err" "$base.err"; then
+            echo "FAIL $script $mode: stderr differs"
+            diff "$base.err" "$err" | head -20
+            failed=$((failed + 1))
+        fi
+    done
+done
+echo "$((count - failed)) of $count passed"
+[ "$failed" -eq 0 ]